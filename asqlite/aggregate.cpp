@@ -0,0 +1,387 @@
+#include <algorithm>
+#include <cstring>
+
+#include "aggregate.h"
+#include "serialize.h"
+#include "threadpool.h"
+#include "output.h"
+
+
+namespace asql {
+
+    // Bookkeeping of a group beyond its key and states, roughly a hash node and bucket
+    static constexpr size_t GROUP_OVERHEAD = 64;
+
+    /* Group key of a row, every key value tagged with its type in GetValue() layout */
+    static void EncodeKey(const std::vector<const Vector*> &keys, size_t row, std::string &out)
+    {
+        out.clear();
+        for (const auto *key : keys) {
+            const auto &v = *key;
+            size_t r = v.constant ? 0 : row;
+            out += static_cast<char>(v.type);
+            switch (v.type) {
+            case CT_INT:
+                out.append(reinterpret_cast<const char*>(&v.ints[r]), sizeof(int64_t));
+                break;
+            case CT_FLOAT: {
+                // -0.0 and 0.0 are the same group
+                double f = v.floats[r] == 0 ? 0 : v.floats[r];
+                out.append(reinterpret_cast<const char*>(&f), sizeof(double));
+                break;
+            }
+            case CT_STR: {
+                const auto &str = v.Str(r);
+                auto len = static_cast<uint32_t>(str.size());
+                out.append(reinterpret_cast<const char*>(&len), sizeof(len));
+                out += str;
+                break;
+            }
+            }
+        }
+    }
+
+    static void Update(AggregateState &st, AggregateKind kind, const Vector &arg, size_t row)
+    {
+        st.count++;
+        size_t r = arg.constant ? 0 : row;
+
+        switch (kind) {
+        case AGG_COUNT:
+            break;
+        case AGG_SUM:
+        case AGG_AVG:
+            if (arg.type == CT_INT)
+                st.isum += arg.ints[r];
+            else
+                st.fsum += arg.floats[r];
+            break;
+        case AGG_MIN:
+        case AGG_MAX: {
+            auto v = arg.Get(r);
+            int c = st.has_extreme ? CompareValues(v, st.extreme) : 0;
+            if (!st.has_extreme || (kind == AGG_MIN ? c < 0 : c > 0)) {
+                st.extreme = std::move(v);
+                st.has_extreme = true;
+            }
+            break;
+        }
+        }
+    }
+
+    static Value Result(const AggregateState &st, const AggregateExpr &agg)
+    {
+        switch (agg.kind) {
+        case AGG_COUNT: return Value::Int(st.count);
+        case AGG_SUM:   return agg.type == CT_INT ? Value::Int(st.isum) : Value::Float(st.fsum);
+        case AGG_AVG:   return Value::Float(st.count ? (static_cast<double>(st.isum) + st.fsum) / static_cast<double>(st.count) : 0);
+        case AGG_MIN:
+        case AGG_MAX:
+            // No rows at all, there are no NULLs so report the type's zero
+            if (!st.has_extreme) {
+                Value v;
+                v.type = agg.type;
+                return v;
+            }
+            return st.extreme;
+        }
+        return {};
+    }
+
+    static void PutState(ByteWriter &w, const AggregateState &st)
+    {
+        w.Put(st.count);
+        w.Put(st.isum);
+        w.Put(st.fsum);
+        w.Put(static_cast<uint8_t>(st.has_extreme));
+        if (st.has_extreme)
+            PutValue(w, st.extreme);
+    }
+
+    static AggregateState GetState(ByteReader &r)
+    {
+        AggregateState st;
+        st.count = r.Get<int64_t>();
+        st.isum = r.Get<int64_t>();
+        st.fsum = r.Get<double>();
+        st.has_extreme = r.Get<uint8_t>() != 0;
+        if (st.has_extreme)
+            st.extreme = GetValue(r);
+        return st;
+    }
+
+    HashAggregation::HashAggregation(const SelectQuery &query, const std::vector<Value> &params, size_t memory_budget):
+        query{query},
+        params{params},
+        // Consume() runs on at most every pool thread at once, each with a local table
+        local_budget{std::max<size_t>(memory_budget / GetThreadPool().ThreadCount(), 1)}
+    {
+        // Constant columns are the same for every group, evaluate them once
+        constants.resize(query.columns.size());
+        for (size_t i = 0; i < query.outputs.size(); ++i) {
+            if (query.outputs[i].source != OS_CONSTANT)
+                continue;
+
+            Batch batch;
+            batch.count = 1;
+            batch.params = params.data();
+            Vector v;
+            query.columns[i]->EvalBatch(batch, v);
+            constants[i] = v.Get(0);
+        }
+    }
+
+    HashAggregation::~HashAggregation()
+    {
+        for (auto &local : locals)
+            for (auto f : local->spill)
+                if (f)
+                    fclose(f);
+    }
+
+    HashAggregation::Local* HashAggregation::Acquire()
+    {
+        std::lock_guard<std::mutex> guard{lock};
+        if (idle.empty()) {
+            locals.push_back(std::make_unique<Local>());
+            return locals.back().get();
+        }
+
+        auto local = idle.back();
+        idle.pop_back();
+        return local;
+    }
+
+    void HashAggregation::Release(Local *local)
+    {
+        std::lock_guard<std::mutex> guard{lock};
+        idle.push_back(local);
+    }
+
+    AggregateState* HashAggregation::FindGroup(Partition &part, const std::string &key, size_t &added_bytes)
+    {
+        if (auto f = part.groups.find(key); f != part.groups.end())
+            return part.states.data() + f->second;
+
+        const size_t naggs = query.aggregates.size();
+        size_t first = part.states.size();
+        part.states.resize(first + naggs);
+        part.groups.emplace(key, first);
+        added_bytes += key.size() + naggs * sizeof(AggregateState) + GROUP_OVERHEAD;
+        return part.states.data() + first;
+    }
+
+    void HashAggregation::Merge(AggregateState *into, const AggregateState *from) const
+    {
+        for (size_t a = 0; a < query.aggregates.size(); ++a) {
+            auto &st = into[a];
+            const auto &other = from[a];
+            st.count += other.count;
+            st.isum += other.isum;
+            st.fsum += other.fsum;
+
+            if (!other.has_extreme)
+                continue;
+            int c = st.has_extreme ? CompareValues(other.extreme, st.extreme) : 0;
+            if (!st.has_extreme || (query.aggregates[a]->kind == AGG_MIN ? c < 0 : c > 0)) {
+                st.extreme = other.extreme;
+                st.has_extreme = true;
+            }
+        }
+    }
+
+    bool HashAggregation::Consume(const Batch &batch, const std::vector<Vector> &regs, const std::vector<uint8_t> &keep)
+    {
+        const auto &program = query.program;
+
+        // COUNT(*) has no argument, its register holds an unused constant
+        std::vector<const Vector*> keys, args;
+        for (auto reg : program.group_keys)
+            keys.push_back(&regs[reg]);
+        for (auto reg : program.aggregate_args)
+            args.push_back(&regs[reg]);
+
+        auto local = Acquire();
+        std::string key;
+        bool ok = true;
+
+        // Grouped by one dictionary encoded column, a code's group is only looked up once. Forgotten after a spill
+        struct CodeGroup {
+            Partition *part = nullptr;
+            size_t first = 0;
+        };
+        const Vector *codes = keys.size() == 1 && keys[0]->codes ? keys[0] : nullptr;
+        std::vector<CodeGroup> code_groups(codes ? codes->dict_size : 0);
+
+        for (size_t row = 0; row < batch.count && ok; ++row) {
+            if (!keep[row])
+                continue;
+
+            CodeGroup *cached = codes ? &code_groups[codes->codes[row]] : nullptr;
+            if (cached && cached->part) {
+                auto states = cached->part->states.data() + cached->first;
+                for (size_t a = 0; a < args.size(); ++a)
+                    Update(states[a], query.aggregates[a]->kind, *args[a], row);
+                continue;
+            }
+
+            EncodeKey(keys, row, key);
+            auto &part = local->parts[std::hash<std::string>{}(key) % PARTITIONS];
+
+            size_t added = 0;
+            auto states = FindGroup(part, key, added);
+            for (size_t a = 0; a < args.size(); ++a)
+                Update(states[a], query.aggregates[a]->kind, *args[a], row);
+            if (cached)
+                *cached = {&part, static_cast<size_t>(states - part.states.data())};
+
+            if (added) {
+                local->bytes += added;
+                if (local->bytes > local_budget) {
+                    ok = Spill(*local);
+                    code_groups.assign(code_groups.size(), CodeGroup{});
+                }
+            }
+        }
+
+        Release(local);
+        return ok;
+    }
+
+    /* Append every group of the local table to its partition's temporary file and empty it */
+    bool HashAggregation::Spill(Local &local)
+    {
+        const size_t naggs = query.aggregates.size();
+
+        for (size_t p = 0; p < PARTITIONS; ++p) {
+            auto &part = local.parts[p];
+            if (part.groups.empty())
+                continue;
+
+            if (!local.spill[p] && !(local.spill[p] = tmpfile())) {
+                Print("Unable to create a temporary file for aggregation\n");
+                return false;
+            }
+
+            ByteWriter w;
+            for (const auto &g : part.groups) {
+                w.PutString(g.first);
+                for (size_t a = 0; a < naggs; ++a)
+                    PutState(w, part.states[g.second + a]);
+            }
+
+            if (fwrite(w.buf.data(), 1, w.buf.size(), local.spill[p]) != w.buf.size()) {
+                Print("Unable to write aggregation spill file\n");
+                return false;
+            }
+            local.spilled[p] += part.groups.size();
+            part = Partition{};
+        }
+
+        local.bytes = 0;
+        spills++;
+        return true;
+    }
+
+    /* Fold partition p of every local table, in memory and spilled, into out */
+    bool HashAggregation::MergePartition(size_t p, Partition &out)
+    {
+        const size_t naggs = query.aggregates.size();
+        size_t unused = 0;
+
+        for (auto &local : locals) {
+            auto &part = local->parts[p];
+            for (const auto &g : part.groups)
+                Merge(FindGroup(out, g.first, unused), part.states.data() + g.second);
+            part = Partition{};
+
+            auto f = local->spill[p];
+            if (!f)
+                continue;
+
+            std::vector<char> data;
+            if (fseek(f, 0, SEEK_END) == 0) {
+                data.resize(static_cast<size_t>(ftell(f)));
+                rewind(f);
+            }
+            if (fread(data.data(), 1, data.size(), f) != data.size()) {
+                Print("Unable to read aggregation spill file\n");
+                return false;
+            }
+
+            ByteReader r{data.data(), data.size()};
+            std::vector<AggregateState> states(naggs);
+            for (size_t g = 0; g < local->spilled[p] && r.ok; ++g) {
+                auto key = r.GetString();
+                for (auto &st : states)
+                    st = GetState(r);
+                Merge(FindGroup(out, key, unused), states.data());
+            }
+
+            if (!r.ok) {
+                Print("Corrupt aggregation spill file\n");
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool HashAggregation::EmitPartition(const Partition &part, const std::function<bool(const std::vector<Value>&)> &emit)
+    {
+        std::vector<Value> keys(query.group_by.size());
+        std::vector<Value> row(query.outputs.size());
+
+        for (const auto &g : part.groups) {
+            ByteReader r{g.first.data(), g.first.size()};
+            for (auto &k : keys)
+                k = GetValue(r);
+
+            const auto *states = part.states.data() + g.second;
+            for (size_t i = 0; i < row.size(); ++i) {
+                const auto &out = query.outputs[i];
+                switch (out.source) {
+                case OS_GROUP_KEY: row[i] = keys[out.index];                                     break;
+                case OS_AGGREGATE: row[i] = Result(states[out.index], *query.aggregates[out.index]); break;
+                case OS_CONSTANT:  row[i] = constants[i];                                        break;
+                }
+            }
+
+            if (!emit(row))
+                return false;
+        }
+        return true;
+    }
+
+    bool HashAggregation::Finish(const std::function<bool(const std::vector<Value>&)> &emit)
+    {
+        const size_t step = spills ? 1 : PARTITIONS;
+        bool any = false;
+
+        for (size_t first = 0; first < PARTITIONS; first += step) {
+            std::vector<Partition> merged(step);
+            std::atomic<bool> ok{true};
+            GetThreadPool().ParallelFor(step, [&](size_t i) {
+                if (!MergePartition(first + i, merged[i]))
+                    ok = false;
+            });
+            if (!ok)
+                return false;
+
+            for (const auto &part : merged) {
+                any |= !part.groups.empty();
+                if (!EmitPartition(part, emit))
+                    return true;
+            }
+        }
+
+        // Without a GROUP BY there is one group, even when no row matched
+        if (!any && query.group_by.empty()) {
+            Partition empty;
+            size_t unused = 0;
+            FindGroup(empty, "", unused);
+            EmitPartition(empty, emit);
+        }
+        return true;
+    }
+
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <atomic>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "database.h"
+#include "query.h"
+
+
+namespace asql {
+
+    /* Running state of one aggregate within a group */
+    struct AggregateState {
+        int64_t count = 0;
+        int64_t isum = 0;
+        double fsum = 0;
+        // MIN and MAX only
+        bool has_extreme = false;
+        Value extreme;
+    };
+
+    /*
+    * Hash aggregation for a SELECT with aggregates or a GROUP BY. Every thread
+    * folds its morsels into a local table of its own, split into partitions by
+    * key hash. Finish() merges partition p of every local table independently,
+    * so partitions merge in parallel. Group keys are kept encoded as bytes.
+    * Every local table gets an equal share of the memory budget, one per pool
+    * thread. A local table that outgrows its share writes its partitions to
+    * temporary files and starts over, so every spill frees a full share. The
+    * spilled groups are read back when their partition is merged.
+    */
+    class HashAggregation {
+    public:
+        HashAggregation(const SelectQuery &query, const std::vector<Value> &params, size_t memory_budget);
+        ~HashAggregation();
+
+        /*
+        * Fold the rows of the batch kept by the query's program, regs holds the
+        * result registers the program computed for it. Safe to call from several threads.
+        */
+        bool Consume(const Batch &batch, const std::vector<Vector> &regs, const std::vector<uint8_t> &keep);
+        /*
+        * Merge the local tables and call emit with one row per group, values in
+        * output column order. Stops early once emit returns false. Spilled
+        * aggregations merge a partition at a time to stay near the budget.
+        */
+        bool Finish(const std::function<bool(const std::vector<Value>&)> &emit);
+
+        std::atomic<size_t> spills{0};
+
+    private:
+        static constexpr size_t PARTITIONS = 16;
+
+        /* Encoded key to the group's first state, a group has one state per aggregate */
+        struct Partition {
+            std::unordered_map<std::string, size_t> groups;
+            std::vector<AggregateState> states;
+        };
+
+        struct Local {
+            Partition parts[PARTITIONS];
+            FILE *spill[PARTITIONS] = {};
+            size_t spilled[PARTITIONS] = {};
+            size_t bytes = 0;
+        };
+
+        Local* Acquire();
+        void Release(Local *local);
+        bool Spill(Local &local);
+        /* The group's states in part, added if it's new */
+        AggregateState* FindGroup(Partition &part, const std::string &key, size_t &added_bytes);
+        void Merge(AggregateState *into, const AggregateState *from) const;
+        bool MergePartition(size_t p, Partition &out);
+        bool EmitPartition(const Partition &part, const std::function<bool(const std::vector<Value>&)> &emit);
+
+        const SelectQuery &query;
+        const std::vector<Value> &params;
+        // Memory budget of each local table
+        const size_t local_budget;
+        std::vector<Value> constants;
+
+        std::mutex lock;
+        std::vector<std::unique_ptr<Local>> locals;
+        std::vector<Local*> idle;
+    };
+
+}
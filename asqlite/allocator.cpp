@@ -0,0 +1,42 @@
+#include <cstdlib>
+#include <new>
+
+#include "profile.h"
+
+
+/*
+* Replaces the global allocation functions to count bytes per thread for
+* EXPLAIN ANALYZE, otherwise behaves like the default ones. Linked into the
+* asql binary only, see the Makefile, a library mustn't replace its host's
+* allocator.
+*/
+namespace {
+    // Set before main(), EXPLAIN ANALYZE only reports allocations when they're counted
+    struct EnableCounting {
+        EnableCounting() { asql::CountingAllocations = true; }
+    } enable_counting;
+}
+
+void* operator new(size_t size)
+{
+    asql::AllocatedBytes += size;
+    while ( true ) {
+        if (void *p = malloc(size ? size : 1))
+            return p;
+        // Built without exceptions, there is no bad_alloc to throw
+        auto handler = std::get_new_handler();
+        if (!handler)
+            abort();
+        handler();
+    }
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
@@ -0,0 +1,72 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+#include "arena.h"
+#include "output.h"
+
+
+namespace asql {
+
+    Arena::~Arena()
+    {
+        // Finalizers were pushed in allocation order, so this destroys in reverse
+        for (auto f = finalizers; f; f = f->next)
+            f->fn(f->obj);
+
+        while (blocks) {
+            auto next = blocks->next;
+            free(blocks);
+            blocks = next;
+        }
+    }
+
+    void* Arena::Allocate(size_t size, size_t align)
+    {
+        auto p = reinterpret_cast<uintptr_t>(pos);
+        auto aligned = (p + align - 1) & ~(static_cast<uintptr_t>(align) - 1);
+
+        if (aligned + size > reinterpret_cast<uintptr_t>(end)) {
+            // Oversized requests get a block of their own
+            size_t need = sizeof(Block) + size + align;
+            size_t block_size = std::max(BLOCK_SIZE, need);
+
+            auto block = static_cast<Block*>(malloc(block_size));
+            if (!block) {
+                Print("Arena: out of memory allocating %zu bytes\n", block_size);
+                abort();
+            }
+            block->next = blocks;
+            blocks = block;
+
+            pos = reinterpret_cast<char*>(block + 1);
+            end = reinterpret_cast<char*>(block) + block_size;
+            p = reinterpret_cast<uintptr_t>(pos);
+            aligned = (p + align - 1) & ~(static_cast<uintptr_t>(align) - 1);
+        }
+
+        pos = reinterpret_cast<char*>(aligned + size);
+        allocated += size;
+        return reinterpret_cast<void*>(aligned);
+    }
+
+    std::string_view Arena::CopyString(std::string_view s)
+    {
+        if (s.empty())
+            return {};
+
+        auto mem = static_cast<char*>(Allocate(s.size(), 1));
+        memcpy(mem, s.data(), s.size());
+        return {mem, s.size()};
+    }
+
+    void Arena::AddFinalizer(void *obj, void (*fn)(void*))
+    {
+        auto f = static_cast<Finalizer*>(Allocate(sizeof(Finalizer), alignof(Finalizer)));
+        f->fn = fn;
+        f->obj = obj;
+        f->next = finalizers;
+        finalizers = f;
+    }
+}
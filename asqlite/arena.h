@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+
+namespace asql {
+
+    /*
+    * Monotonic bump allocator. Everything allocated from it is released in one
+    * shot when the arena is destroyed. Objects with a non-trivial destructor get
+    * it called at that point, trivially destructible ones cost nothing.
+    * The first block lives inside the arena itself, so short queries never touch malloc.
+    */
+    class Arena {
+    public:
+        Arena() = default;
+        Arena(const Arena&) = delete;
+        Arena& operator=(const Arena&) = delete;
+        ~Arena();
+
+        void* Allocate(size_t size, size_t align = alignof(std::max_align_t));
+
+        template <typename T, typename... Args>
+        T* New(Args&&... args)
+        {
+            T *obj = new (Allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+            if constexpr (!std::is_trivially_destructible_v<T>)
+                AddFinalizer(obj, [](void *p) { static_cast<T*>(p)->~T(); });
+            return obj;
+        }
+
+        std::string_view CopyString(std::string_view s);
+
+        /* Bytes handed out so far, not counting block slack */
+        size_t BytesAllocated() const { return allocated; }
+
+    private:
+        struct Block {
+            Block *next;
+        };
+
+        struct Finalizer {
+            void (*fn)(void*);
+            void *obj;
+            Finalizer *next;
+        };
+
+        void AddFinalizer(void *obj, void (*fn)(void*));
+
+        static constexpr size_t INLINE_SIZE = 1024;
+        static constexpr size_t BLOCK_SIZE  = 8192;
+
+        alignas(std::max_align_t) char inline_block[INLINE_SIZE];
+        char *pos = inline_block;
+        char *end = inline_block + INLINE_SIZE;
+        Block *blocks = nullptr;
+        Finalizer *finalizers = nullptr;
+        size_t allocated = 0;
+    };
+
+
+    /* std allocator adaptor so containers can live in an arena. Freeing is a no-op */
+    template <typename T>
+    class ArenaAllocator {
+    public:
+        using value_type = T;
+
+        ArenaAllocator(Arena *arena): arena{arena} {}
+        template <typename U>
+        ArenaAllocator(const ArenaAllocator<U> &other): arena{other.arena} {}
+
+        T* allocate(size_t n) { return static_cast<T*>(arena->Allocate(n * sizeof(T), alignof(T))); }
+        void deallocate(T*, size_t) {}
+
+        template <typename U>
+        bool operator==(const ArenaAllocator<U> &other) const { return arena == other.arena; }
+        template <typename U>
+        bool operator!=(const ArenaAllocator<U> &other) const { return arena != other.arena; }
+
+        Arena *arena;
+    };
+
+    template <typename T>
+    using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+}
@@ -0,0 +1,326 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+
+#include "asql.h"
+#include "image.h"
+#include "lexer.h"
+#include "output.h"
+#include "parser.h"
+#include "query.h"
+#include "statement.h"
+#include "threadpool.h"
+
+
+namespace asql {
+
+    // The tables a Database serves are globals, so only one is open at a time
+    static std::mutex OpenLock;
+    static bool DatabaseOpen = false;
+
+    /* Collects what the calling thread prints. The engine reports errors as messages, they become Error() */
+    class CapturedOutput {
+    public:
+        CapturedOutput(): saved{Output()}
+        {
+            out = open_memstream(&buf, &len);
+            if (out)
+                SetOutput(out);
+        }
+        CapturedOutput(const CapturedOutput&) = delete;
+        CapturedOutput& operator=(const CapturedOutput&) = delete;
+        ~CapturedOutput() { Take(); }
+
+        /* Stop capturing and return the text, without the last line's newline */
+        std::string Take()
+        {
+            if (out) {
+                SetOutput(saved);
+                fclose(out);
+                out = nullptr;
+            }
+
+            std::string text = buf ? std::string(buf, len) : std::string();
+            free(buf);
+            buf = nullptr;
+            while (text.size() && text.back() == '\n')
+                text.pop_back();
+            return text;
+        }
+
+    private:
+        FILE *saved;
+        FILE *out = nullptr;
+        char *buf = nullptr;
+        size_t len = 0;
+    };
+
+    /* Nothing but a ';' may follow the statement at the current token, which has been parsed */
+    static bool AtLastStatement(ParserContext &ctx)
+    {
+        auto token = ctx.GetCurrentToken();
+        while (token == T_NULL)
+            token = ctx.GetNextToken();
+        return token == T_EOF;
+    }
+
+    /* Lex the whole text of a statement that is run later, to see it's a single one */
+    static bool SingleStatement(const std::string &sql)
+    {
+        ParserContext ctx;
+        ctx.SetInput(sql);
+        auto token = ctx.GetNextToken();
+        while (token != T_NULL && token != T_EOF)
+            token = ctx.GetNextToken();
+        return AtLastStatement(ctx);
+    }
+
+    /* Database */
+
+    std::unique_ptr<Database> Database::Open(const std::string &path, const DatabaseOptions &options, std::string *error)
+    {
+        std::lock_guard<std::mutex> guard{OpenLock};
+        CapturedOutput output;
+
+        SyncMode sync = SYNC_FULL;
+        bool ok = true;
+        if (DatabaseOpen) {
+            Print("Another database is already open\n");
+            ok = false;
+        } else if (!ParseSyncMode(options.sync, sync)) {
+            Print("Unknown sync mode '%s', expected full, normal or off\n", options.sync.c_str());
+            ok = false;
+        }
+
+        if (ok) {
+            SetThreadCount(options.threads);
+            TableData.clear();
+            InitTables();
+            if (path.empty())
+                ok = true;
+            else if (options.image)
+                ok = OpenImage(path);
+            else
+                ok = OpenDatabase(path, options.cache_mb << 20, sync) && RecoverDatabase();
+        }
+
+        auto text = output.Take();
+        if (!ok) {
+            if (error)
+                *error = text;
+            return nullptr;
+        }
+
+        DatabaseOpen = true;
+        return std::unique_ptr<Database>{new Database};
+    }
+
+    Database::~Database()
+    {
+        std::lock_guard<std::mutex> guard{OpenLock};
+        CloseDatabase();
+
+        // Image tables point into the mapping
+        TableData.clear();
+        CloseImage();
+        QueryPlanCache.Clear();
+        DatabaseOpen = false;
+    }
+
+    Statement Database::Prepare(std::string_view sql)
+    {
+        Statement stmt;
+        stmt.sql = std::string(sql);
+        CapturedOutput output;
+
+        ParserContext ctx;
+        ctx.SetInput(stmt.sql);
+        bool single = true;
+        switch (ctx.GetNextToken()) {
+        case T_QRY_SELECT:
+            stmt.plan = PrepareSelect(ctx);
+            if (stmt.plan) {
+                stmt.ok = true;
+                single = AtLastStatement(ctx);
+                stmt.params.resize(static_cast<size_t>(stmt.plan->param_count));
+                for (const auto &column : stmt.plan->columns)
+                    stmt.names.push_back(column->GetAlias());
+            }
+            break;
+
+        case T_QRY_INSERT:
+            stmt.insert = std::make_unique<InsertStatement>();
+            if (ParseInsert(ctx, *stmt.insert, true)) {
+                stmt.ok = true;
+                single = AtLastStatement(ctx);
+                stmt.params.resize(stmt.insert->params.size());
+            }
+            break;
+
+        // Checked when they run
+        case T_QRY_UPDATE:
+        case T_QRY_DELETE:
+        case T_QRY_CREATE:
+            stmt.ok = true;
+            single = SingleStatement(stmt.sql);
+            break;
+
+        default:
+            Print("Only SELECT, INSERT, UPDATE, DELETE and CREATE INDEX statements can be prepared\n");
+            break;
+        }
+
+        if (!single) {
+            Print("Only one statement can be prepared at a time\n");
+            stmt.ok = false;
+        }
+        stmt.bound.resize(stmt.params.size());
+        stmt.error = output.Take();
+        return stmt;
+    }
+
+    /* Statement */
+
+    Statement::Statement(Statement&&) noexcept = default;
+    Statement& Statement::operator=(Statement&&) noexcept = default;
+    Statement::~Statement() = default;
+
+    bool Statement::Bind(size_t i, int64_t v)
+    {
+        return Bind(i, Value::Int(v));
+    }
+
+    bool Statement::Bind(size_t i, double v)
+    {
+        return Bind(i, Value::Float(v));
+    }
+
+    bool Statement::Bind(size_t i, std::string_view v)
+    {
+        return Bind(i, Value::Str(std::string(v)));
+    }
+
+    bool Statement::Bind(size_t i, const Value &v)
+    {
+        if (i >= params.size()) {
+            error = "Parameter " + std::to_string(i) + " is out of range, the statement has " +
+                    std::to_string(params.size());
+            return false;
+        }
+        params[i] = v;
+        bound[i] = true;
+        return true;
+    }
+
+    StepResult Statement::Step()
+    {
+        if (!ok || (executed && error.size()))
+            return STEP_ERROR;
+
+        if (!executed) {
+            executed = true;
+            CapturedOutput output;
+            size_t unbound = 0;
+            while (unbound < bound.size() && bound[unbound])
+                unbound++;
+
+            if (unbound < bound.size()) {
+                Print("Parameter %zu isn't bound\n", unbound);
+            } else if (plan) {
+                result = std::make_unique<ResultRows>();
+                plan->Execute(params, nullptr, result.get());
+            } else if (insert) {
+                auto values = insert->values;
+                for (size_t i = 0; i < params.size(); ++i)
+                    values[insert->params[i]] = params[i];
+                ApplyInsert(*insert->table, std::move(values));
+            } else {
+                Session session;
+                RunStatements(session, sql);
+            }
+
+            // Statements only print when they fail
+            error = output.Take();
+            if (error.size()) {
+                result.reset();
+                return STEP_ERROR;
+            }
+        }
+
+        if (!result || next >= result->ends.size())
+            return STEP_DONE;
+
+        // Decode the row in place, strings stay in the result
+        const char *p = result->data.data() + (next ? result->ends[next - 1] : 0);
+        next++;
+        row.resize(names.size());
+        for (auto &col : row) {
+            col.type = static_cast<ColumnType>(*p++);
+            switch (col.type) {
+            case CT_INT:
+                memcpy(&col.i, p, sizeof(col.i));
+                p += sizeof(col.i);
+                break;
+            case CT_FLOAT:
+                memcpy(&col.f, p, sizeof(col.f));
+                p += sizeof(col.f);
+                break;
+            case CT_STR: {
+                uint32_t len;
+                memcpy(&len, p, sizeof(len));
+                col.s = {p + sizeof(len), len};
+                p += sizeof(len) + len;
+                break;
+            }
+            }
+        }
+        return STEP_ROW;
+    }
+
+    void Statement::Reset()
+    {
+        if (ok)
+            error.clear();
+        executed = false;
+        result.reset();
+        next = 0;
+        row.clear();
+    }
+
+    size_t Statement::ColumnCount() const
+    {
+        return names.size();
+    }
+
+    const std::string& Statement::ColumnName(size_t i) const
+    {
+        return names[i];
+    }
+
+    int64_t Statement::Int(size_t i) const
+    {
+        const auto &col = row[i];
+        switch (col.type) {
+        case CT_INT:   return col.i;
+        case CT_FLOAT: return static_cast<int64_t>(col.f);
+        default:       return 0;
+        }
+    }
+
+    double Statement::Float(size_t i) const
+    {
+        const auto &col = row[i];
+        switch (col.type) {
+        case CT_INT:   return static_cast<double>(col.i);
+        case CT_FLOAT: return col.f;
+        default:       return 0;
+        }
+    }
+
+    std::string_view Statement::Str(size_t i) const
+    {
+        return row[i].type == CT_STR ? row[i].s : std::string_view{};
+    }
+
+}
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "database.h"
+
+
+/*
+* Embedding API, for running statements in-process instead of through the
+* asql binary. Build libasql.a or libasql.so with `make lib` and include
+* this header:
+*
+*     auto db = asql::Database::Open("app.db");
+*     auto stmt = db->Prepare("SELECT name, weight_kg FROM employees WHERE emp_id = ?;");
+*     stmt.Bind(0, int64_t{42});
+*     while (stmt.Step() == asql::STEP_ROW)
+*         use(stmt.Str(0), stmt.Float(1));
+*
+* The engine's tables are process wide, so there is one Database at a time.
+* Statements may run on different threads at once, but each one is only used
+* by one thread at a time, and all of them have to be gone before their
+* Database is. The library leaves the global operator new alone.
+*/
+namespace asql {
+
+    class SelectQuery;
+    struct ResultRows;
+    struct InsertStatement;
+
+    struct DatabaseOptions {
+        // Buffer pool of a database file
+        size_t cache_mb = 64;
+        // full, normal or off, see SyncMode
+        std::string sync = "full";
+        // Open path as a read-only image written by .export, see image.h
+        bool image = false;
+        // Scan threads, 0 is one per core
+        size_t threads = 0;
+    };
+
+    enum StepResult {
+        STEP_ROW,   // a row is ready, read it through the column accessors
+        STEP_DONE,  // no more rows, or a statement without rows ran
+        STEP_ERROR, // see Statement::Error()
+    };
+
+    /*
+    * A prepared statement, exactly one. A SELECT runs on its first Step() with
+    * the values bound to its '?' parameters and collects all of its rows in a
+    * compact result before returning the first, so memory grows with the
+    * result; every Step() after moves to the next row. The morsels run on the
+    * thread pool, rows aren't streamed as they're produced.
+    *
+    * An INSERT takes '?' in its VALUES tuples and inserts its rows on its
+    * first Step(), UPDATE, DELETE and CREATE INDEX run as written and can't
+    * have parameters. Reset() runs the statement again on the next Step(),
+    * with the same bindings unless they're replaced.
+    */
+    class Statement {
+    public:
+        Statement(Statement&&) noexcept;
+        Statement& operator=(Statement&&) noexcept;
+        ~Statement();
+
+        /* Parsed and validated, otherwise Error() says why and Step() fails */
+        bool Ok() const { return ok; }
+        const std::string& Error() const { return error; }
+
+        /* Parameter count of a SELECT or INSERT, '?' are numbered from 0 in statement order */
+        size_t ParamCount() const { return params.size(); }
+        bool Bind(size_t i, int64_t v);
+        bool Bind(size_t i, double v);
+        bool Bind(size_t i, std::string_view v);
+        bool Bind(size_t i, const Value &v);
+
+        StepResult Step();
+        void Reset();
+
+        /*
+        * The current row, valid after Step() returned STEP_ROW. Strings point
+        * into the statement's result, a copy of the rows made by Step(), and
+        * stay valid until Reset() or the statement is gone.
+        * Int() of a FLOAT column and Float() of an INT column convert, any
+        * other mismatch returns 0 or an empty string.
+        */
+        size_t ColumnCount() const;
+        const std::string& ColumnName(size_t i) const;
+        ColumnType Type(size_t i) const { return row[i].type; }
+        int64_t Int(size_t i) const;
+        double Float(size_t i) const;
+        std::string_view Str(size_t i) const;
+
+    private:
+        friend class Database;
+        Statement() = default;
+
+        /* A value of the current row, strings are views into the result */
+        struct Column {
+            ColumnType type = CT_INT;
+            int64_t i = 0;
+            double f = 0;
+            std::string_view s;
+        };
+
+        bool ok = false;
+        std::string error;
+        // Set for a SELECT or an INSERT, anything else is run as sql
+        std::shared_ptr<const SelectQuery> plan;
+        std::unique_ptr<InsertStatement> insert;
+        std::string sql;
+        std::vector<std::string> names;
+        std::vector<Value> params;
+        std::vector<bool> bound;
+
+        bool executed = false;
+        std::unique_ptr<ResultRows> result;
+        size_t next = 0;
+        std::vector<Column> row;
+    };
+
+    class Database {
+    public:
+        /*
+        * Open the database file at path, created if it doesn't exist, and
+        * recover its write-ahead log. An empty path keeps everything in memory.
+        * nullptr if it can't be opened or another Database is open, error says why.
+        */
+        static std::unique_ptr<Database> Open(const std::string &path, const DatabaseOptions &options = {},
+                                              std::string *error = nullptr);
+        Database(const Database&) = delete;
+        Database& operator=(const Database&) = delete;
+        /* Checkpoints and closes the file */
+        ~Database();
+
+        /* One SELECT, INSERT, UPDATE, DELETE or CREATE INDEX statement, text after its ';' is an error */
+        Statement Prepare(std::string_view sql);
+
+    private:
+        Database() = default;
+    };
+
+}
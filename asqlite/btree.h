@@ -0,0 +1,190 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+
+namespace asql {
+
+    /* A row's position in its table, row group in the high half and row within it in the low */
+    using RowId = uint64_t;
+
+    inline RowId MakeRowId(size_t group, size_t row) { return static_cast<RowId>(group) << 32 | row; }
+    inline size_t RowIdGroup(RowId id) { return static_cast<size_t>(id >> 32); }
+    inline size_t RowIdRow(RowId id) { return static_cast<size_t>(id & 0xffffffff); }
+
+    /* One end of a range lookup, an unset bound is open */
+    template <typename K>
+    struct KeyBound {
+        bool set = false;
+        bool inclusive = true;
+        K key{};
+    };
+
+
+    /*
+    * In-memory B+tree from keys to RowIds. Duplicate keys are allowed, an
+    * inner key is the first key of the child to its right, but equal keys
+    * can straddle that boundary. Leaves are chained left to right for range
+    * scans. Nodes are fixed arrays sized to a few cache lines of keys.
+    */
+    template <typename K>
+    class BPlusTree {
+    public:
+        BPlusTree(): root{new Leaf} {}
+        BPlusTree(const BPlusTree&) = delete;
+        BPlusTree& operator=(const BPlusTree&) = delete;
+        ~BPlusTree() { Free(root); }
+
+        void Insert(const K &key, RowId row)
+        {
+            Split split;
+            if (InsertInto(root, key, row, split)) {
+                auto inner = new Inner;
+                inner->count = 1;
+                inner->keys[0] = split.key;
+                inner->children[0] = root;
+                inner->children[1] = split.right;
+                root = inner;
+            }
+            size++;
+        }
+
+        /* Append the rows of every key within [lo, hi] to rows, in key order */
+        void Scan(const KeyBound<K> &lo, const KeyBound<K> &hi, std::vector<RowId> &rows) const
+        {
+            // Lower bound descent, equal keys may start in the child left of an equal separator
+            auto node = root;
+            while (!node->leaf) {
+                auto inner = static_cast<const Inner*>(node);
+                size_t i = lo.set ? std::lower_bound(inner->keys, inner->keys + inner->count, lo.key) - inner->keys : 0;
+                node = inner->children[i];
+            }
+
+            auto leaf = static_cast<const Leaf*>(node);
+            size_t i = 0;
+            if (lo.set) {
+                auto keys_end = leaf->keys + leaf->count;
+                i = (lo.inclusive ? std::lower_bound(leaf->keys, keys_end, lo.key)
+                                  : std::upper_bound(leaf->keys, keys_end, lo.key)) - leaf->keys;
+            }
+
+            for (; leaf; leaf = leaf->next, i = 0) {
+                for (; i < leaf->count; ++i) {
+                    const K &key = leaf->keys[i];
+                    if (lo.set && (lo.inclusive ? key < lo.key : !(lo.key < key)))
+                        continue;
+                    if (hi.set && (hi.inclusive ? hi.key < key : !(key < hi.key)))
+                        return;
+                    rows.push_back(leaf->rows[i]);
+                }
+            }
+        }
+
+        void Clear()
+        {
+            Free(root);
+            root = new Leaf;
+            size = 0;
+        }
+
+        size_t Size() const { return size; }
+
+    private:
+        static constexpr size_t FANOUT = 64;
+
+        struct Node {
+            bool leaf;
+            uint32_t count = 0;
+            K keys[FANOUT];
+
+            Node(bool leaf): leaf{leaf} {}
+        };
+
+        struct Leaf: Node {
+            Leaf(): Node{true} {}
+            RowId rows[FANOUT];
+            Leaf *next = nullptr;
+        };
+
+        struct Inner: Node {
+            Inner(): Node{false} {}
+            Node *children[FANOUT + 1];
+        };
+
+        struct Split {
+            K key;
+            Node *right;
+        };
+
+        /* Insert below node. Nodes split as soon as they fill up, the new right sibling is returned in split */
+        static bool InsertInto(Node *node, const K &key, RowId row, Split &split)
+        {
+            if (node->leaf) {
+                auto leaf = static_cast<Leaf*>(node);
+                size_t pos = std::upper_bound(leaf->keys, leaf->keys + leaf->count, key) - leaf->keys;
+                std::move_backward(leaf->keys + pos, leaf->keys + leaf->count, leaf->keys + leaf->count + 1);
+                std::move_backward(leaf->rows + pos, leaf->rows + leaf->count, leaf->rows + leaf->count + 1);
+                leaf->keys[pos] = key;
+                leaf->rows[pos] = row;
+                if (++leaf->count < FANOUT)
+                    return false;
+
+                auto right = new Leaf;
+                size_t half = FANOUT / 2;
+                right->count = static_cast<uint32_t>(FANOUT - half);
+                std::move(leaf->keys + half, leaf->keys + FANOUT, right->keys);
+                std::copy(leaf->rows + half, leaf->rows + FANOUT, right->rows);
+                leaf->count = static_cast<uint32_t>(half);
+                right->next = leaf->next;
+                leaf->next = right;
+
+                split = {right->keys[0], right};
+                return true;
+            }
+
+            auto inner = static_cast<Inner*>(node);
+            size_t pos = std::upper_bound(inner->keys, inner->keys + inner->count, key) - inner->keys;
+            Split child;
+            if (!InsertInto(inner->children[pos], key, row, child))
+                return false;
+
+            std::move_backward(inner->keys + pos, inner->keys + inner->count, inner->keys + inner->count + 1);
+            std::copy_backward(inner->children + pos + 1, inner->children + inner->count + 1, inner->children + inner->count + 2);
+            inner->keys[pos] = child.key;
+            inner->children[pos + 1] = child.right;
+            if (++inner->count < FANOUT)
+                return false;
+
+            // The middle key moves up, it isn't kept in either half
+            auto right = new Inner;
+            size_t mid = FANOUT / 2;
+            right->count = static_cast<uint32_t>(FANOUT - mid - 1);
+            std::move(inner->keys + mid + 1, inner->keys + FANOUT, right->keys);
+            std::copy(inner->children + mid + 1, inner->children + FANOUT + 1, right->children);
+            inner->count = static_cast<uint32_t>(mid);
+
+            split = {inner->keys[mid], right};
+            return true;
+        }
+
+        static void Free(Node *node)
+        {
+            if (node->leaf) {
+                delete static_cast<Leaf*>(node);
+                return;
+            }
+
+            auto inner = static_cast<Inner*>(node);
+            for (size_t i = 0; i <= inner->count; ++i)
+                Free(inner->children[i]);
+            delete inner;
+        }
+
+        Node *root;
+        size_t size = 0;
+    };
+
+}
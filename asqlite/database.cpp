@@ -1,13 +1,1417 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
 #include <string>
+#include <thread>
+#include <type_traits>
 #include "database.h"
+#include "image.h"
+#include "serialize.h"
+#include "output.h"
 
 
 namespace asql {
-    void insertEmployee(EmployeeTbl data)
+
+    std::unordered_map<std::string, TableStorage> TableData;
+
+    // The open database file, both null when running purely in memory
+    static std::unique_ptr<Pager> DbPager;
+    static std::unique_ptr<BufferPool> DbPool;
+    static std::unique_ptr<WriteAheadLog> DbWal;
+
+    std::mutex WriterLock;
+
+    /* Schema helpers */
+
+    TableSchema::const_iterator TableSchema::find(std::string_view name) const
+    {
+        for (auto it = columns.begin(); it != columns.end(); ++it)
+            if (it->first == name)
+                return it;
+        return columns.end();
+    }
+
+    int TableSchema::Index(std::string_view name) const
+    {
+        auto f = find(name);
+        if (f == columns.end())
+            return -1;
+        return static_cast<int>(f - columns.begin());
+    }
+
+    /* Values */
+
+    std::string Value::ToString() const
+    {
+        char buf[64];
+        switch (type) {
+        case CT_INT:
+            snprintf(buf, sizeof(buf), "%lld", static_cast<long long>(i));
+            return buf;
+        case CT_FLOAT:
+            snprintf(buf, sizeof(buf), "%g", f);
+            return buf;
+        case CT_STR:
+            return s;
+        }
+        return "";
+    }
+
+    int CompareValues(const Value &lhs, const Value &rhs)
+    {
+        if (lhs.type == CT_STR || rhs.type == CT_STR) {
+            if (lhs.type != rhs.type)
+                return lhs.type == CT_STR ? 1 : -1;
+            return lhs.s.compare(rhs.s);
+        }
+
+        if (lhs.type == CT_INT && rhs.type == CT_INT)
+            return (lhs.i > rhs.i) - (lhs.i < rhs.i);
+
+        double l = lhs.AsFloat();
+        double r = rhs.AsFloat();
+        return (l > r) - (l < r);
+    }
+
+    void PutValue(ByteWriter &w, const Value &v)
+    {
+        w.Put(static_cast<uint8_t>(v.type));
+        switch (v.type) {
+        case CT_INT:   w.Put(v.i);       break;
+        case CT_FLOAT: w.Put(v.f);       break;
+        case CT_STR:   w.PutString(v.s); break;
+        }
+    }
+
+    Value GetValue(ByteReader &r)
+    {
+        switch (r.Get<uint8_t>()) {
+        case CT_INT:   return Value::Int(r.Get<int64_t>());
+        case CT_FLOAT: return Value::Float(r.Get<double>());
+        case CT_STR:   return Value::Str(r.GetString());
+        }
+        r.ok = false;
+        return {};
+    }
+
+    /* Column vectors */
+
+    void ColumnVector::Reserve(size_t n)
+    {
+        switch (type) {
+        case CT_INT:   ints.reserve(n);   break;
+        case CT_FLOAT: floats.reserve(n); break;
+        case CT_STR:   strs.reserve(n);   break;
+        }
+    }
+
+    void ColumnVector::Append(const Value &v)
+    {
+        switch (type) {
+        case CT_INT:   ints.push_back(v.i);           break;
+        case CT_FLOAT: floats.push_back(v.AsFloat()); break;
+        case CT_STR:   strs.push_back(v.s);           break;
+        }
+    }
+
+    void ColumnVector::Append(Value &&v)
+    {
+        if (type == CT_STR)
+            strs.push_back(std::move(v.s));
+        else
+            Append(v);
+    }
+
+    Value ColumnVector::Get(size_t row) const
+    {
+        switch (type) {
+        case CT_INT:   return Value::Int(Ints()[row]);
+        case CT_FLOAT: return Value::Float(Floats()[row]);
+        case CT_STR:   return Value::Str(Str(row));
+        }
+        return {};
+    }
+
+    // A string column is dictionary encoded with at most one distinct value per this many rows
+    static constexpr size_t DICTIONARY_ROWS_PER_VALUE = 4;
+
+    /* Codes into the distinct strings of the first rows of col in first seen order, false once there are more than limit */
+    static bool BuildDictionary(const ColumnVector &col, size_t rows, size_t limit,
+                                std::vector<uint32_t> &codes, std::vector<std::string> &dict)
+    {
+        std::unordered_map<std::string_view, uint32_t> seen;
+        std::vector<std::string_view> order;
+        codes.resize(rows);
+        for (size_t i = 0; i < rows; ++i) {
+            auto f = seen.emplace(col.Str(i), static_cast<uint32_t>(order.size()));
+            if (f.second) {
+                if (order.size() == limit)
+                    return false;
+                order.push_back(f.first->first);
+            }
+            codes[i] = f.first->second;
+        }
+
+        dict.assign(order.begin(), order.end());
+        return true;
+    }
+
+    bool ColumnVector::EncodeDictionary(size_t rows)
+    {
+        if (type != CT_STR || !dict.empty() || !rows)
+            return false;
+
+        std::vector<uint32_t> c;
+        std::vector<std::string> d;
+        if (!BuildDictionary(*this, rows, rows / DICTIONARY_ROWS_PER_VALUE, c, d))
+            return false;
+
+        codes = std::move(c);
+        dict = std::move(d);
+        strs.clear();
+        strs.shrink_to_fit();
+        return true;
+    }
+
+    void ColumnVector::DecodeDictionary()
+    {
+        if (dict.empty())
+            return;
+
+        strs.reserve(codes.size());
+        for (auto code : codes)
+            strs.push_back(dict[code]);
+        codes.clear();
+        dict.clear();
+    }
+
+    /* Zone maps */
+
+    template <typename T>
+    static void Widen(const T *values, size_t n, bool set, T &min, T &max)
+    {
+        if (!set)
+            min = max = values[0];
+        for (size_t i = 0; i < n; ++i) {
+            min = std::min(min, values[i]);
+            max = std::max(max, values[i]);
+        }
+    }
+
+    void ZoneMap::Add(const ColumnVector &col, size_t begin, size_t end)
+    {
+        if (begin >= end)
+            return;
+
+        const size_t n = end - begin;
+        switch (col.type) {
+        case CT_INT: {
+            int64_t lo = min.i, hi = max.i;
+            Widen(col.Ints() + begin, n, set, lo, hi);
+            min = Value::Int(lo);
+            max = Value::Int(hi);
+            break;
+        }
+        case CT_FLOAT: {
+            double lo = min.f, hi = max.f;
+            Widen(col.Floats() + begin, n, set, lo, hi);
+            min = Value::Float(lo);
+            max = Value::Float(hi);
+            break;
+        }
+        case CT_STR: {
+            // Compare in place, only the new bounds are copied
+            const std::string *lo = set ? &min.s : &col.Str(begin);
+            const std::string *hi = set ? &max.s : &col.Str(begin);
+            for (size_t i = begin; i < end; ++i) {
+                const auto &str = col.Str(i);
+                if (str < *lo)
+                    lo = &str;
+                if (*hi < str)
+                    hi = &str;
+            }
+            if (lo != &min.s)
+                min = Value::Str(*lo);
+            if (hi != &max.s)
+                max = Value::Str(*hi);
+            break;
+        }
+        }
+        set = true;
+    }
+
+    /* Recompute every zone of a group in memory */
+    static void RebuildZones(RowGroup &g)
+    {
+        g.zones.assign(g.columns.size(), ZoneMap{});
+        for (size_t c = 0; c < g.columns.size(); ++c)
+            g.zones[c].Add(g.columns[c], 0, g.rows);
+    }
+
+    /* Vectors */
+
+    void Vector::Reference(const ColumnVector &col)
+    {
+        type = col.type;
+        constant = false;
+        ints = col.Ints();
+        floats = col.Floats();
+        strs = col.strs.data();
+        codes = col.dict.empty() ? nullptr : col.codes.data();
+        dict = col.dict.data();
+        dict_size = col.dict.size();
+    }
+
+    void Vector::Reference(const Vector &other)
+    {
+        type = other.type;
+        constant = other.constant;
+        ints = other.ints;
+        floats = other.floats;
+        strs = other.strs;
+        codes = other.codes;
+        dict = other.dict;
+        dict_size = other.dict_size;
+    }
+
+    void Vector::Constant(const Value &v)
+    {
+        type = v.type;
+        constant = true;
+        codes = nullptr;
+        switch (type) {
+        case CT_INT:   int_buf.assign(1, v.i);   ints = int_buf.data();     break;
+        case CT_FLOAT: float_buf.assign(1, v.f); floats = float_buf.data(); break;
+        case CT_STR:   str_buf.assign(1, v.s);   strs = str_buf.data();     break;
+        }
+    }
+
+    int64_t* Vector::MakeInts(size_t n)
+    {
+        type = CT_INT;
+        constant = false;
+        codes = nullptr;
+        int_buf.resize(n);
+        ints = int_buf.data();
+        return int_buf.data();
+    }
+
+    double* Vector::MakeFloats(size_t n)
+    {
+        type = CT_FLOAT;
+        constant = false;
+        codes = nullptr;
+        float_buf.resize(n);
+        floats = float_buf.data();
+        return float_buf.data();
+    }
+
+    Value Vector::Get(size_t row) const
+    {
+        if (constant)
+            row = 0;
+
+        switch (type) {
+        case CT_INT:   return Value::Int(ints[row]);
+        case CT_FLOAT: return Value::Float(floats[row]);
+        case CT_STR:   return Value::Str(Str(row));
+        }
+        return {};
+    }
+
+    /* Indexes */
+
+    void Index::Insert(const Value &key, RowId row)
+    {
+        std::unique_lock<std::shared_mutex> guard{latch};
+        switch (type) {
+        case CT_INT:   ints.Insert(key.i, row);           break;
+        case CT_FLOAT: floats.Insert(key.AsFloat(), row); break;
+        case CT_STR:   strs.Insert(key.s, row);           break;
+        }
+    }
+
+    void Index::Clear()
+    {
+        std::unique_lock<std::shared_mutex> guard{latch};
+        ints.Clear();
+        floats.Clear();
+        strs.Clear();
+    }
+
+    /* Convert a bound to the tree's key type, only where that keeps the comparison exact */
+    template <typename K>
+    static bool MakeBound(const Value *v, bool inclusive, KeyBound<K> &bound)
+    {
+        if (!v)
+            return true;
+
+        bound.set = true;
+        bound.inclusive = inclusive;
+        if constexpr (std::is_same_v<K, int64_t>) {
+            bound.key = v->i;
+            return v->type == CT_INT;
+        } else if constexpr (std::is_same_v<K, double>) {
+            bound.key = v->AsFloat();
+            return v->type != CT_STR;
+        } else {
+            bound.key = v->s;
+            return v->type == CT_STR;
+        }
+    }
+
+    template <typename K>
+    static bool TreeLookup(const BPlusTree<K> &tree, const Value *lo, bool lo_inclusive, const Value *hi, bool hi_inclusive,
+                           std::vector<RowId> &rows)
+    {
+        KeyBound<K> l, h;
+        if (!MakeBound(lo, lo_inclusive, l) || !MakeBound(hi, hi_inclusive, h))
+            return false;
+        tree.Scan(l, h, rows);
+        return true;
+    }
+
+    bool Index::Lookup(const Value *lo, bool lo_inclusive, const Value *hi, bool hi_inclusive, std::vector<RowId> &rows) const
+    {
+        std::shared_lock<std::shared_mutex> guard{latch};
+        switch (type) {
+        case CT_INT:   return TreeLookup(ints, lo, lo_inclusive, hi, hi_inclusive, rows);
+        case CT_FLOAT: return TreeLookup(floats, lo, lo_inclusive, hi, hi_inclusive, rows);
+        case CT_STR:   return TreeLookup(strs, lo, lo_inclusive, hi, hi_inclusive, rows);
+        }
+        return false;
+    }
+
+    /* Row group persistence */
+
+    /* How a column of a sealed group is laid out in the database file, picked per column when it's written */
+    enum ColumnEncoding : uint8_t {
+        ENC_PLAIN,       // every value, strings length prefixed
+        ENC_DICTIONARY,  // the distinct strings, then a bit packed code per row
+        ENC_FRAME,       // frame of reference: the minimum, then each value's bit packed offset from it
+        ENC_RLE,         // (value, run length) pairs, for sorted or repetitive columns
+    };
+
+    static unsigned BitWidth(uint64_t v)
+    {
+        return v ? 64 - static_cast<unsigned>(__builtin_clzll(v)) : 0;
+    }
+
+    static size_t PackedBytes(size_t n, unsigned width)
+    {
+        return (n * width + 7) / 8;
+    }
+
+    /* Values of width bits each, back to back from the lowest bit */
+    static void PackBits(ByteWriter &w, const std::vector<uint64_t> &values, unsigned width)
+    {
+        // A value spans at most 9 bytes, padding lets every store write 16
+        std::vector<char> bits(PackedBytes(values.size(), width) + 16);
+        for (size_t i = 0; i < values.size() && width; ++i) {
+            size_t bit = i * width;
+            unsigned shift = bit % 8;
+            char *p = bits.data() + bit / 8;
+
+            uint64_t word;
+            memcpy(&word, p, sizeof(word));
+            word |= values[i] << shift;
+            memcpy(p, &word, sizeof(word));
+            if (shift) {
+                memcpy(&word, p + 8, sizeof(word));
+                word |= values[i] >> (64 - shift);
+                memcpy(p + 8, &word, sizeof(word));
+            }
+        }
+        w.PutBytes(bits.data(), PackedBytes(values.size(), width));
+    }
+
+    static void UnpackBits(ByteReader &r, size_t n, unsigned width, std::vector<uint64_t> &values)
+    {
+        values.assign(n, 0);
+        auto data = r.Take(PackedBytes(n, width));
+        if (!data || !width)
+            return;
+
+        std::vector<char> bits(data, data + PackedBytes(n, width));
+        bits.resize(bits.size() + 16);
+        const uint64_t mask = width == 64 ? ~0ULL : (1ULL << width) - 1;
+        for (size_t i = 0; i < n; ++i) {
+            size_t bit = i * width;
+            unsigned shift = bit % 8;
+            const char *p = bits.data() + bit / 8;
+
+            uint64_t lo, hi;
+            memcpy(&lo, p, sizeof(lo));
+            uint64_t v = lo >> shift;
+            if (shift) {
+                memcpy(&hi, p + 8, sizeof(hi));
+                v |= hi << (64 - shift);
+            }
+            values[i] = v & mask;
+        }
+    }
+
+    static void SerializeInts(const std::vector<int64_t> &ints, size_t rows, ByteWriter &w)
+    {
+        int64_t lo = rows ? ints[0] : 0, hi = lo;
+        size_t runs = rows ? 1 : 0;
+        for (size_t i = 1; i < rows; ++i) {
+            lo = std::min(lo, ints[i]);
+            hi = std::max(hi, ints[i]);
+            runs += ints[i] != ints[i - 1];
+        }
+
+        // Whichever layout is smallest
+        const unsigned width = BitWidth(static_cast<uint64_t>(hi) - static_cast<uint64_t>(lo));
+        const size_t plain = rows * sizeof(int64_t);
+        const size_t frame = sizeof(int64_t) + 1 + PackedBytes(rows, width);
+        const size_t rle = sizeof(uint32_t) + runs * (sizeof(int64_t) + sizeof(uint32_t));
+
+        if (rle < frame && rle < plain) {
+            w.Put(ENC_RLE);
+            w.Put(static_cast<uint32_t>(runs));
+            for (size_t i = 0; i < rows; ) {
+                size_t j = i;
+                while (j < rows && ints[j] == ints[i])
+                    ++j;
+                w.Put(ints[i]);
+                w.Put(static_cast<uint32_t>(j - i));
+                i = j;
+            }
+        } else if (frame < plain) {
+            w.Put(ENC_FRAME);
+            w.Put(lo);
+            w.Put(static_cast<uint8_t>(width));
+            std::vector<uint64_t> offsets(rows);
+            for (size_t i = 0; i < rows; ++i)
+                offsets[i] = static_cast<uint64_t>(ints[i]) - static_cast<uint64_t>(lo);
+            PackBits(w, offsets, width);
+        } else {
+            w.Put(ENC_PLAIN);
+            w.PutBytes(ints.data(), plain);
+        }
+    }
+
+    static void SerializeStrings(const ColumnVector &col, size_t rows, ByteWriter &w)
+    {
+        std::vector<uint32_t> codes;
+        std::vector<std::string> dict;
+        if (!BuildDictionary(col, rows, rows / DICTIONARY_ROWS_PER_VALUE, codes, dict)) {
+            w.Put(ENC_PLAIN);
+            for (size_t i = 0; i < rows; ++i)
+                w.PutString(col.Str(i));
+            return;
+        }
+
+        w.Put(ENC_DICTIONARY);
+        w.Put(static_cast<uint32_t>(dict.size()));
+        for (const auto &str : dict)
+            w.PutString(str);
+
+        const unsigned width = BitWidth(dict.size() - 1);
+        w.Put(static_cast<uint8_t>(width));
+        PackBits(w, std::vector<uint64_t>(codes.begin(), codes.end()), width);
+    }
+
+    /*
+    * Rows, then every column back to back as its type, encoding and the size
+    * of its data, so a reader can step over the columns it doesn't need.
+    */
+    static void SerializeGroup(const RowGroup &g, ByteWriter &w)
+    {
+        w.Put(static_cast<uint64_t>(g.rows));
+        w.Put(static_cast<uint32_t>(g.columns.size()));
+        for (const auto &col : g.columns) {
+            w.Put(static_cast<uint8_t>(col.type));
+
+            // Encoding and data, the size is filled in once they're written
+            const size_t size_at = w.buf.size();
+            w.Put(static_cast<uint32_t>(0));
+            switch (col.type) {
+            case CT_INT:
+                SerializeInts(col.ints, g.rows, w);
+                break;
+            case CT_FLOAT:
+                w.Put(ENC_PLAIN);
+                w.PutBytes(col.floats.data(), g.rows * sizeof(double));
+                break;
+            case CT_STR:
+                SerializeStrings(col, g.rows, w);
+                break;
+            }
+
+            auto size = static_cast<uint32_t>(w.buf.size() - size_at - sizeof(uint32_t));
+            memcpy(w.buf.data() + size_at, &size, sizeof(size));
+        }
+    }
+
+    static void DeserializeColumn(ByteReader &r, size_t rows, ColumnVector &col)
+    {
+        std::vector<uint64_t> packed;
+        auto encoding = r.Get<uint8_t>();
+        switch (encoding) {
+        case ENC_PLAIN:
+            switch (col.type) {
+            case CT_INT:
+                col.ints.resize(rows);
+                r.GetBytes(col.ints.data(), rows * sizeof(int64_t));
+                break;
+            case CT_FLOAT:
+                col.floats.resize(rows);
+                r.GetBytes(col.floats.data(), rows * sizeof(double));
+                break;
+            case CT_STR:
+                col.strs.reserve(rows);
+                for (size_t i = 0; i < rows && r.ok; ++i)
+                    col.strs.push_back(r.GetString());
+                break;
+            }
+            return;
+
+        case ENC_DICTIONARY: {
+            // Stays encoded in memory, filters and grouping work on the codes
+            auto size = r.Get<uint32_t>();
+            for (uint32_t i = 0; i < size && r.ok; ++i)
+                col.dict.push_back(r.GetString());
+            unsigned width = r.Get<uint8_t>();
+            r.ok &= width <= 32;
+            UnpackBits(r, rows, r.ok ? width : 0, packed);
+            col.codes.resize(rows);
+            for (size_t i = 0; i < rows; ++i) {
+                col.codes[i] = static_cast<uint32_t>(packed[i]);
+                r.ok &= col.codes[i] < size;
+            }
+            break;
+        }
+
+        case ENC_FRAME: {
+            auto lo = static_cast<uint64_t>(r.Get<int64_t>());
+            unsigned width = r.Get<uint8_t>();
+            r.ok &= width <= 64;
+            UnpackBits(r, rows, r.ok ? width : 0, packed);
+            col.ints.resize(rows);
+            for (size_t i = 0; i < rows; ++i)
+                col.ints[i] = static_cast<int64_t>(lo + packed[i]);
+            break;
+        }
+
+        case ENC_RLE: {
+            auto runs = r.Get<uint32_t>();
+            col.ints.reserve(rows);
+            for (uint32_t i = 0; i < runs && r.ok; ++i) {
+                auto v = r.Get<int64_t>();
+                auto n = r.Get<uint32_t>();
+                r.ok &= col.ints.size() + n <= rows;
+                if (r.ok)
+                    col.ints.insert(col.ints.end(), n, v);
+            }
+            r.ok &= col.ints.size() == rows;
+            break;
+        }
+
+        default:
+            r.ok = false;
+            break;
+        }
+
+        // Only strings have a dictionary, only ints the integer encodings
+        r.ok &= encoding == ENC_DICTIONARY ? col.type == CT_STR : col.type == CT_INT;
+    }
+
+    /* Columns left out of a non-empty mask are skipped and stay empty */
+    static bool DeserializeGroup(const std::vector<char> &blob, RowGroup &g, const std::vector<bool> &mask = {})
+    {
+        ByteReader r{blob.data(), blob.size()};
+        g.rows = r.Get<uint64_t>();
+        g.columns.clear();
+
+        auto ncols = r.Get<uint32_t>();
+        for (uint32_t c = 0; c < ncols && r.ok; ++c) {
+            g.columns.emplace_back(static_cast<ColumnType>(r.Get<uint8_t>()));
+            auto size = r.Get<uint32_t>();
+            auto data = r.Take(size);
+            if (!data || (c < mask.size() && !mask[c]))
+                continue;
+
+            ByteReader column{data, size};
+            DeserializeColumn(column, g.rows, g.columns.back());
+            r.ok &= column.ok;
+        }
+
+        if (!r.ok)
+            Print("Corrupt row group\n");
+        return r.ok;
+    }
+
+    static bool WriteBlob(const std::vector<char> &blob, Extent e)
+    {
+        for (uint32_t i = 0; i < e.count; ++i) {
+            auto page = DbPool->Create(e.first + i);
+            if (!page)
+                return false;
+
+            size_t off = i * PAGE_SIZE;
+            memcpy(page, blob.data() + off, std::min(PAGE_SIZE, blob.size() - off));
+            DbPool->Unpin(e.first + i, true);
+        }
+        return true;
+    }
+
+    static bool ReadBlob(Extent e, std::vector<char> &blob)
+    {
+        blob.resize(static_cast<size_t>(e.count) * PAGE_SIZE);
+        for (uint32_t i = 0; i < e.count; ++i) {
+            auto page = DbPool->Fetch(e.first + i);
+            if (!page)
+                return false;
+
+            memcpy(blob.data() + i * PAGE_SIZE, page, PAGE_SIZE);
+            DbPool->Unpin(e.first + i, false);
+        }
+        return true;
+    }
+
+    static uint32_t PagesFor(size_t bytes)
+    {
+        return static_cast<uint32_t>(std::max<size_t>((bytes + PAGE_SIZE - 1) / PAGE_SIZE, 1));
+    }
+
+    /* Write the group to a fresh extent of the database file, freeing the one it had */
+    static bool PersistGroup(const RowGroup &g, Extent &extent)
+    {
+        ByteWriter w;
+        SerializeGroup(g, w);
+
+        DbPager->Free(extent);
+        extent = DbPager->Allocate(PagesFor(w.buf.size()));
+        return WriteBlob(w.buf, extent);
+    }
+
+    static const RowGroup* LoadGroupFrom(const RowGroup &g, RowGroup &scratch, const std::vector<bool> &columns)
+    {
+        if (g.Resident())
+            return &g;
+        if (g.segments.size())
+            return LoadImageGroup(g, scratch, columns) ? &scratch : nullptr;
+
+        std::vector<char> blob;
+        if (!ReadBlob(g.extent, blob) || !DeserializeGroup(blob, scratch, columns))
+            return nullptr;
+        return &scratch;
+    }
+
+    /* Versions */
+
+    // Guards publishing and pinning versions, only ever held for a few pointer copies
+    static std::mutex SnapshotLock;
+    // Bumped whenever a table publishes a new version
+    static uint64_t Epoch = 0;
+    // The epoch each live ReadSnapshot was taken at
+    static std::multiset<uint64_t> ActiveSnapshots;
+
+    /* A row group or index replaced at epoch, snapshots taken at or before it may still read it */
+    struct Retired {
+        uint64_t epoch;
+        std::shared_ptr<const void> object;
+        // Freed once nothing can read it anymore, the pager reuses it after the next checkpoint
+        Extent extent;
+    };
+
+    // Guarded by WriterLock like the pager's free lists
+    static std::vector<Retired> Garbage;
+    static std::atomic<size_t> GarbagePending{0};
+    static std::atomic<size_t> RetiredCount{0};
+    static std::atomic<size_t> ReclaimedCount{0};
+
+    // How long the collector leaves running snapshots to finish before looking again
+    constexpr auto COLLECT_INTERVAL = std::chrono::milliseconds(100);
+
+    /* Move what no snapshot can see anymore from Garbage to reclaimed. Needs WriterLock */
+    static void CollectGarbage(std::vector<Retired> &reclaimed)
+    {
+        uint64_t oldest;
+        {
+            std::lock_guard<std::mutex> guard{SnapshotLock};
+            oldest = ActiveSnapshots.empty() ? Epoch : *ActiveSnapshots.begin();
+        }
+
+        auto done = std::partition(Garbage.begin(), Garbage.end(), [&](const Retired &r) { return r.epoch >= oldest; });
+        for (auto it = done; it != Garbage.end(); ++it) {
+            if (DbPager)
+                DbPager->Free(it->extent);
+            reclaimed.push_back(std::move(*it));
+        }
+        ReclaimedCount += static_cast<size_t>(Garbage.end() - done);
+        Garbage.erase(done, Garbage.end());
+        GarbagePending = Garbage.size();
+    }
+
+    /*
+    * Background thread reclaiming retired versions. Asleep while there's no
+    * garbage, otherwise it looks again every COLLECT_INTERVAL. Dropping the
+    * last reference happens here, so neither queries nor writers pay for
+    * freeing the replaced groups.
+    */
+    class GarbageCollector {
+    public:
+        GarbageCollector(): thread{[this] { Loop(); }} {}
+
+        ~GarbageCollector()
+        {
+            {
+                std::lock_guard<std::mutex> guard{lock};
+                stopping = true;
+            }
+            wake.notify_one();
+            thread.join();
+        }
+
+        void Wake()
+        {
+            { std::lock_guard<std::mutex> guard{lock}; }
+            wake.notify_one();
+        }
+
+    private:
+        void Loop()
+        {
+            std::unique_lock<std::mutex> guard{lock};
+            while (true) {
+                wake.wait(guard, [this] { return stopping || GarbagePending; });
+                if (!stopping)
+                    wake.wait_for(guard, COLLECT_INTERVAL, [this] { return stopping; });
+                if (stopping)
+                    return;
+
+                guard.unlock();
+                std::vector<Retired> reclaimed;
+                {
+                    std::lock_guard<std::mutex> writer{WriterLock};
+                    CollectGarbage(reclaimed);
+                }
+                reclaimed.clear();
+                guard.lock();
+            }
+        }
+
+        std::mutex lock;
+        std::condition_variable wake;
+        bool stopping = false;
+        std::thread thread;
+    };
+
+    // Started with the first retired version, declared after the pager so it stops first
+    static std::unique_ptr<GarbageCollector> Collector;
+
+    /* Hand a replaced group or index to the collector. Needs WriterLock */
+    static void Retire(std::shared_ptr<const void> object, Extent extent = {})
+    {
+        Garbage.push_back({Epoch, std::move(object), extent});
+        RetiredCount++;
+        GarbagePending = Garbage.size();
+
+        if (!Collector)
+            Collector = std::make_unique<GarbageCollector>();
+        if (Garbage.size() == 1)
+            Collector->Wake();
+    }
+
+    ReadSnapshot::ReadSnapshot(const std::vector<TableStorage*> &storage)
+    {
+        tables.resize(storage.size());
+
+        std::lock_guard<std::mutex> guard{SnapshotLock};
+        for (size_t i = 0; i < storage.size(); ++i) {
+            tables[i].table = storage[i];
+            tables[i].version = storage[i]->published;
+            tables[i].tail_rows = storage[i]->published_rows;
+        }
+        epoch = ActiveSnapshots.insert(Epoch);
+    }
+
+    ReadSnapshot::~ReadSnapshot()
+    {
+        std::lock_guard<std::mutex> guard{SnapshotLock};
+        ActiveSnapshots.erase(epoch);
+    }
+
+    size_t TableSnapshot::RowCount() const
+    {
+        size_t count = 0;
+        for (size_t i = 0; i < GroupCount(); ++i)
+            count += Rows(i);
+        return count;
+    }
+
+    const RowGroup* TableSnapshot::LoadGroup(size_t i, RowGroup &scratch, const std::vector<bool> &columns) const
+    {
+        return LoadGroupFrom(Group(i), scratch, columns);
+    }
+
+    VersionStats GetVersionStats()
+    {
+        VersionStats stats;
+        {
+            std::lock_guard<std::mutex> guard{SnapshotLock};
+            stats.epoch = Epoch;
+            stats.snapshots = ActiveSnapshots.size();
+        }
+        stats.retired = RetiredCount;
+        stats.reclaimed = ReclaimedCount;
+        return stats;
+    }
+
+    /* Table storage */
+
+    void TableStorage::OpenTail(RowGroup &g)
+    {
+        for (auto &col : g.columns) {
+            col.DecodeDictionary();
+            col.Reserve(ROW_GROUP_SIZE);
+        }
+        tail_open = true;
+        changed = true;
+    }
+
+    RowGroup& TableStorage::WritableGroup()
+    {
+        if (tail_open && groups.back()->rows < ROW_GROUP_SIZE)
+            return *groups.back();
+
+        // Groups shrunk by a DELETE may sit on disk, only append to one in memory. Snapshots
+        // may be reading it, so it's reopened as a copy
+        if (!tail_open && groups.size() && groups.back()->rows < ROW_GROUP_SIZE && groups.back()->Resident()) {
+            auto g = std::make_shared<RowGroup>(*groups.back());
+            g->extent = {};
+            Retire(groups.back(), groups.back()->extent);
+            groups.back() = g;
+            OpenTail(*g);
+            return *g;
+        }
+
+        auto g = std::make_shared<RowGroup>();
+        g->columns.reserve(schema.size());
+        for (const auto &col : schema)
+            g->columns.emplace_back(col.second);
+        g->zones.resize(schema.size());
+        groups.push_back(g);
+        OpenTail(*g);
+        return *g;
+    }
+
+    bool TableStorage::CheckRow(const std::vector<Value> &row) const
+    {
+        if (row.size() != schema.size()) {
+            Print("Table '%s' expects %zu values, got %zu\n", name.c_str(), schema.size(), row.size());
+            return false;
+        }
+
+        for (size_t c = 0; c < row.size(); ++c) {
+            auto expected = schema.columns[c].second;
+            bool ok = row[c].type == expected || (expected == CT_FLOAT && row[c].type == CT_INT);
+            if (!ok) {
+                Print("Type mismatch for column '%s' in table '%s'\n", schema.columns[c].first.c_str(), name.c_str());
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool TableStorage::CheckRows(const RowGroup &rows) const
+    {
+        if (rows.columns.size() != schema.size()) {
+            Print("Table '%s' expects %zu columns, got %zu\n", name.c_str(), schema.size(), rows.columns.size());
+            return false;
+        }
+
+        for (size_t c = 0; c < rows.columns.size(); ++c) {
+            const auto &col = rows.columns[c];
+            size_t size = 0;
+            switch (col.type) {
+            case CT_INT:   size = col.ints.size();   break;
+            case CT_FLOAT: size = col.floats.size(); break;
+            case CT_STR:   size = col.strs.size();   break;
+            }
+
+            if (col.type != schema.columns[c].second) {
+                Print("Type mismatch for column '%s' in table '%s'\n", schema.columns[c].first.c_str(), name.c_str());
+                return false;
+            }
+            if (size != rows.rows) {
+                Print("Column '%s' has %zu values, expected %zu\n", schema.columns[c].first.c_str(), size, rows.rows);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /*
+    * A group that won't be appended to again. With a database file it's written
+    * out with its column encodings and only lives on disk, in memory its string
+    * columns with few distinct values are dictionary encoded instead. Only for
+    * groups no snapshot has seen yet.
+    */
+    static bool SealGroup(RowGroup &g)
+    {
+        if (!DbPager) {
+            for (auto &col : g.columns)
+                col.EncodeDictionary(g.rows);
+            return true;
+        }
+
+        if (!PersistGroup(g, g.extent))
+            return false;
+        g.columns.clear();
+        g.columns.shrink_to_fit();
+        return true;
+    }
+
+    bool TableStorage::SealTail()
+    {
+        auto &tail = groups.back();
+        auto sealed = std::make_shared<RowGroup>();
+        if (DbPager) {
+            sealed->rows = tail->rows;
+            sealed->zones = tail->zones;
+            if (!PersistGroup(*tail, sealed->extent))
+                return false;
+        } else {
+            *sealed = *tail;
+            if (!SealGroup(*sealed))
+                return false;
+        }
+
+        Retire(tail, tail->extent);
+        tail = sealed;
+        tail_open = false;
+        changed = true;
+        return true;
+    }
+
+    bool TableStorage::AppendRow(const std::vector<Value> &row)
+    {
+        // Type check the whole row first so a bad value doesn't leave a partial row behind
+        if (!CheckRow(row))
+            return false;
+
+        auto &g = WritableGroup();
+
+        // The on-disk copy of the group is stale from here on
+        if (g.extent.count) {
+            DbPager->Free(g.extent);
+            g.extent = {};
+        }
+
+        for (size_t c = 0; c < row.size(); ++c) {
+            g.columns[c].Append(row[c]);
+            g.zones[c].Add(g.columns[c], g.rows, g.rows + 1);
+        }
+        g.rows++;
+
+        for (auto &index : indexes)
+            index->Insert(row[index->column], MakeRowId(groups.size() - 1, g.rows - 1));
+
+        // Full groups never change again, with a database file they only live on disk
+        bool ok = g.rows < ROW_GROUP_SIZE || SealTail();
+        Publish();
+        return ok;
+    }
+
+    bool TableStorage::AppendRows(RowGroup &&rows)
+    {
+        // Nothing is appended or indexed unless every column fits
+        if (!CheckRows(rows))
+            return false;
+
+        for (size_t done = 0; done < rows.rows; ) {
+            auto &g = WritableGroup();
+            if (g.extent.count) {
+                DbPager->Free(g.extent);
+                g.extent = {};
+            }
+
+            size_t n = std::min(ROW_GROUP_SIZE - g.rows, rows.rows - done);
+            for (size_t c = 0; c < g.columns.size(); ++c) {
+                auto &to = g.columns[c];
+                auto &from = rows.columns[c];
+                switch (to.type) {
+                case CT_INT:
+                    to.ints.insert(to.ints.end(), from.ints.begin() + done, from.ints.begin() + done + n);
+                    break;
+                case CT_FLOAT:
+                    to.floats.insert(to.floats.end(), from.floats.begin() + done, from.floats.begin() + done + n);
+                    break;
+                case CT_STR:
+                    to.strs.insert(to.strs.end(), std::make_move_iterator(from.strs.begin() + done),
+                                   std::make_move_iterator(from.strs.begin() + done + n));
+                    break;
+                }
+                g.zones[c].Add(to, g.rows, g.rows + n);
+            }
+
+            for (auto &index : indexes)
+                for (size_t r = g.rows; r < g.rows + n; ++r)
+                    index->Insert(g.columns[index->column].Get(r), MakeRowId(groups.size() - 1, r));
+
+            g.rows += n;
+            done += n;
+            if (g.rows == ROW_GROUP_SIZE && !SealTail()) {
+                Publish();
+                return false;
+            }
+        }
+        Publish();
+        return true;
+    }
+
+    bool TableStorage::ReplaceGroup(size_t i, RowGroup &&group)
+    {
+        Retire(groups[i], groups[i]->extent);
+        changed = true;
+        const bool last = i + 1 == groups.size();
+
+        if (!group.rows) {
+            groups.erase(groups.begin() + static_cast<long>(i));
+            if (last)
+                tail_open = false;
+            return true;
+        }
+
+        auto g = std::make_shared<RowGroup>(std::move(group));
+        g->extent = {};
+        RebuildZones(*g);
+        groups[i] = g;
+
+        // Only the tail group stays open to be appended to
+        if (!last)
+            return SealGroup(*g);
+        OpenTail(*g);
+        return true;
+    }
+
+    bool TableStorage::BuildIndex(Index &index) const
+    {
+        index.Clear();
+
+        RowGroup scratch;
+        for (size_t i = 0; i < groups.size(); ++i) {
+            auto g = LoadGroup(i, scratch);
+            if (!g)
+                return false;
+
+            const auto &col = g->columns[index.column];
+            for (size_t r = 0; r < g->rows; ++r)
+                index.Insert(col.Get(r), MakeRowId(i, r));
+        }
+        return true;
+    }
+
+    bool TableStorage::RebuildIndexes()
+    {
+        // Snapshots keep looking up row ids in the indexes they started with
+        for (auto &index : indexes) {
+            auto rebuilt = std::make_shared<Index>(index->name, index->column, index->type);
+            if (!BuildIndex(*rebuilt))
+                return false;
+            Retire(index);
+            index = rebuilt;
+            changed = true;
+        }
+        return true;
+    }
+
+    bool TableStorage::AddIndex(IndexPtr index)
+    {
+        if (!BuildIndex(*index))
+            return false;
+        indexes.push_back(std::move(index));
+        changed = true;
+        return true;
+    }
+
+    bool TableStorage::Attach(std::vector<RowGroupPtr> &&loaded)
+    {
+        groups = std::move(loaded);
+        changed = true;
+
+        // Keep a partially filled tail group in memory so it can be appended to, images are never appended to
+        if (DbPager && groups.size() && groups.back()->rows < ROW_GROUP_SIZE) {
+            auto &tail = *groups.back();
+            std::vector<char> data;
+            if (!ReadBlob(tail.extent, data) || !DeserializeGroup(data, tail))
+                return false;
+            OpenTail(tail);
+        }
+        return true;
+    }
+
+    Index* TableStorage::FindIndex(std::string_view index_name)
+    {
+        for (auto &index : indexes)
+            if (index->name == index_name)
+                return index.get();
+        return nullptr;
+    }
+
+    const RowGroup* TableStorage::LoadGroup(size_t i, RowGroup &scratch, const std::vector<bool> &columns) const
+    {
+        return LoadGroupFrom(*groups[i], scratch, columns);
+    }
+
+    size_t TableStorage::RowCount() const
+    {
+        size_t count = 0;
+        for (const auto &g : groups)
+            count += g->rows;
+        return count;
+    }
+
+    void TableStorage::Publish()
+    {
+        std::shared_ptr<const TableVersion> version;
+        if (changed) {
+            auto next = std::make_shared<TableVersion>();
+            next->groups.assign(groups.begin(), groups.end());
+            next->indexes = indexes;
+            next->open = tail_open;
+            version = std::move(next);
+            changed = false;
+        }
+
+        // The replaced version is released after the lock
+        std::lock_guard<std::mutex> guard{SnapshotLock};
+        if (version) {
+            published.swap(version);
+            Epoch++;
+        }
+        published_rows = tail_open ? groups.back()->rows : 0;
+    }
+
+    void InitTables()
+    {
+        for (const auto &table : database_tables)
+            TableData.emplace(table.first, TableStorage{table.first, table.second});
+    }
+
+    TableStorage* GetTable(const std::string &name)
+    {
+        auto f = TableData.find(name);
+        if (f == TableData.end())
+            return nullptr;
+        return &f->second;
+    }
+
+    /* Database file */
+
+    /*
+    * Catalog layout: table count, then per table its name, columns (name, type),
+    * row groups (rows, extent, then a set flag, min and max per column) and
+    * indexes (name, column). Followed by the free extents.
+    */
+    static void SerializeCatalog(ByteWriter &w)
+    {
+        w.Put(static_cast<uint32_t>(TableData.size()));
+        for (const auto &t : TableData) {
+            const auto &table = t.second;
+            w.PutString(table.name);
+
+            w.Put(static_cast<uint32_t>(table.schema.size()));
+            for (const auto &col : table.schema) {
+                w.PutString(col.first);
+                w.Put(static_cast<uint8_t>(col.second));
+            }
+
+            w.Put(static_cast<uint32_t>(table.groups.size()));
+            for (const auto &g : table.groups) {
+                w.Put(static_cast<uint64_t>(g->rows));
+                w.Put(g->extent);
+                for (const auto &zone : g->zones) {
+                    w.Put(static_cast<uint8_t>(zone.set));
+                    PutValue(w, zone.min);
+                    PutValue(w, zone.max);
+                }
+            }
+
+            // Only index definitions are stored, the trees are rebuilt on open
+            w.Put(static_cast<uint32_t>(table.indexes.size()));
+            for (const auto &index : table.indexes) {
+                w.PutString(index->name);
+                w.Put(static_cast<uint32_t>(index->column));
+            }
+        }
+
+        // Extents freed since the last checkpoint are reusable once this one lands
+        w.Put(static_cast<uint32_t>(DbPager->free_extents.size() + DbPager->pending_free.size()));
+        for (const auto &e : DbPager->free_extents)
+            w.Put(e);
+        for (const auto &e : DbPager->pending_free)
+            w.Put(e);
+    }
+
+    static bool LoadCatalog()
+    {
+        std::vector<char> blob;
+        if (!ReadBlob(DbPager->header.catalog, blob))
+            return false;
+
+        ByteReader r{blob.data(), blob.size()};
+        auto ntables = r.Get<uint32_t>();
+        for (uint32_t t = 0; t < ntables && r.ok; ++t) {
+            auto name = r.GetString();
+
+            TableSchema schema;
+            auto ncols = r.Get<uint32_t>();
+            for (uint32_t c = 0; c < ncols && r.ok; ++c) {
+                auto col = r.GetString();
+                schema.columns.emplace_back(col, static_cast<ColumnType>(r.Get<uint8_t>()));
+            }
+
+            database_tables[name] = schema;
+            TableData.erase(name);
+            auto &table = TableData.emplace(name, TableStorage{name, schema}).first->second;
+
+            std::vector<RowGroupPtr> groups;
+            auto ngroups = r.Get<uint32_t>();
+            for (uint32_t g = 0; g < ngroups && r.ok; ++g) {
+                auto group = std::make_shared<RowGroup>();
+                group->rows = r.Get<uint64_t>();
+                group->extent = r.Get<Extent>();
+                group->zones.resize(schema.size());
+                for (auto &zone : group->zones) {
+                    zone.set = r.Get<uint8_t>() != 0;
+                    zone.min = GetValue(r);
+                    zone.max = GetValue(r);
+                }
+                groups.push_back(std::move(group));
+            }
+            if (!table.Attach(std::move(groups)))
+                return false;
+
+            auto nindexes = r.Get<uint32_t>();
+            for (uint32_t i = 0; i < nindexes && r.ok; ++i) {
+                auto index_name = r.GetString();
+                auto column = r.Get<uint32_t>();
+                if (column >= schema.size()) {
+                    r.ok = false;
+                    break;
+                }
+
+                if (!table.AddIndex(std::make_shared<Index>(index_name, column, schema.columns[column].second)))
+                    return false;
+            }
+            table.Publish();
+        }
+
+        auto nfree = r.Get<uint32_t>();
+        for (uint32_t i = 0; i < nfree && r.ok; ++i)
+            DbPager->free_extents.push_back(r.Get<Extent>());
+
+        if (!r.ok)
+            Print("Corrupt database catalog\n");
+        return r.ok;
+    }
+
+    bool OpenDatabase(const std::string &path, size_t buffer_pool_bytes, SyncMode sync)
+    {
+        auto pager = std::make_unique<Pager>();
+        if (!pager->Open(path))
+            return false;
+
+        // The log is replayed by the caller, it knows how to run the logged statements
+        auto wal = std::make_unique<WriteAheadLog>();
+        if (!wal->Open(path + "-wal", sync, pager->header.checkpoint_lsn))
+            return false;
+
+        DbPager = std::move(pager);
+        DbPool = std::make_unique<BufferPool>(*DbPager, buffer_pool_bytes);
+        DbWal = std::move(wal);
+
+        if (DbPager->header.catalog.count && !LoadCatalog()) {
+            DbWal.reset();
+            DbPool.reset();
+            DbPager.reset();
+            return false;
+        }
+        return true;
+    }
+
+    bool Checkpoint()
+    {
+        if (!DbPager)
+            return true;
+
+        // Extents only snapshots still held become free space in this catalog
+        std::vector<Retired> reclaimed;
+        CollectGarbage(reclaimed);
+
+        for (auto &t : TableData)
+            for (auto &g : t.second.groups)
+                if (g->Resident() && g->rows && !g->extent.count && !PersistGroup(*g, g->extent))
+                    return false;
+
+        auto &header = DbPager->header;
+        DbPager->Free(header.catalog);
+
+        // Allocating the catalog can only shrink the free list it records, so
+        // serializing again afterwards always fits in the extent
+        ByteWriter sizing;
+        SerializeCatalog(sizing);
+        auto catalog = DbPager->Allocate(PagesFor(sizing.buf.size()));
+
+        ByteWriter w;
+        SerializeCatalog(w);
+        if (!WriteBlob(w.buf, catalog))
+            return false;
+
+        // Data and catalog have to be on disk before the header points at them
+        if (!DbPool->Flush() || !DbPager->Sync())
+            return false;
+
+        header.catalog = catalog;
+        header.checkpoint_lsn = DbWal->LastLsn();
+        char page[PAGE_SIZE] = {};
+        memcpy(page, &header, sizeof(header));
+        if (!DbPager->WritePage(0, page) || !DbPager->Sync())
+            return false;
+
+        DbPager->CommitFrees();
+
+        // A crash before this leaves records the header already covers, replay skips them
+        return DbWal->Reset();
+    }
+
+    void CloseDatabase()
+    {
+        if (!DbPager)
+            return;
+
+        std::lock_guard<std::mutex> guard{WriterLock};
+        Checkpoint();
+
+        // Extents of groups snapshots still hold belong to this file
+        for (auto &r : Garbage)
+            r.extent = {};
+        DbWal.reset();
+        DbPool.reset();
+        DbPager.reset();
+    }
+
+    bool DatabaseCreated()
+    {
+        return DbPager && DbPager->created;
+    }
+
+    BufferPool* GetBufferPool()
+    {
+        return DbPool.get();
+    }
+
+    WriteAheadLog* GetWal()
     {
-        auto& table = TableData["employee"];
-        EmployeeTbl * ptr = new EmployeeTbl{data};
-        auto p = std::make_unique<DBTable>(sizeof(EmployeeTbl), ptr);
-        table.push_back(p);
+        return DbWal.get();
     }
-}
\ No newline at end of file
+}
@@ -1,32 +1,375 @@
 #pragma once
 
 #include <unordered_map>
+#include <initializer_list>
 #include <memory>
 #include <vector>
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <utility>
+
+#include "btree.h"
+#include "pager.h"
+#include "wal.h"
 
 
 namespace asql {
 
-    struct DBTable {
-        size_t size;
-        void * data;
-        ~DBTable() {delete data;}
+    class ByteWriter;
+    class ByteReader;
+
+    enum ColumnType: int {
+        CT_INT = 1,
+        CT_FLOAT,
+        CT_STR
+    };
+
+    using ColumnPair = std::pair<std::string, ColumnType>;
+
+    /* Ordered column list of a table. Tables are narrow so lookups are a linear scan */
+    class TableSchema {
+    public:
+        using const_iterator = std::vector<ColumnPair>::const_iterator;
+
+        TableSchema() = default;
+        TableSchema(std::initializer_list<ColumnPair> columns): columns{columns} {}
+
+        const_iterator find(std::string_view name) const;
+        const_iterator begin() const { return columns.begin(); }
+        const_iterator end() const { return columns.end(); }
+        size_t size() const { return columns.size(); }
+        int Index(std::string_view name) const;
+
+        std::vector<ColumnPair> columns;
+    };
+
+    extern std::unordered_map<std::string, TableSchema> database_tables;
+
+
+    /* A single typed value. Used for row-at-a-time inserts and evaluation */
+    struct Value {
+        ColumnType type = CT_INT;
+        int64_t i = 0;
+        double f = 0;
+        std::string s;
+
+        static Value Int(int64_t v) { Value r; r.type = CT_INT; r.i = v; return r; }
+        static Value Float(double v) { Value r; r.type = CT_FLOAT; r.f = v; return r; }
+        static Value Str(const std::string &v) { Value r; r.type = CT_STR; r.s = v; return r; }
+
+        double AsFloat() const { return type == CT_INT ? static_cast<double>(i) : f; }
+        std::string ToString() const;
+    };
+
+    /* A value tagged with its type, as stored in the log and in spill files */
+    void PutValue(ByteWriter &w, const Value &v);
+    /* Clears r.ok on an unknown type */
+    Value GetValue(ByteReader &r);
+
+    /* <0, 0, >0 like strcmp. Ints and floats compare numerically, strings compare last */
+    int CompareValues(const Value &lhs, const Value &rhs);
+
+
+    /* Rows per row group. Also the unit of work for scans */
+    constexpr size_t ROW_GROUP_SIZE = 2048;
+
+    /*
+    * Contiguous storage for one column of a row group. Only the vector matching
+    * type is used. A sealed string column with few distinct values is
+    * dictionary encoded instead: strs is empty and row i is dict[codes[i]].
+    */
+    struct ColumnVector {
+        ColumnVector(ColumnType type): type{type} {}
+
+        void Reserve(size_t n);
+        void Append(const Value &v);
+        void Append(Value &&v);
+        Value Get(size_t row) const;
+        const std::string& Str(size_t row) const { return dict.empty() ? strs[row] : dict[codes[row]]; }
+        const int64_t* Ints() const { return mapped_ints ? mapped_ints : ints.data(); }
+        const double* Floats() const { return mapped_floats ? mapped_floats : floats.data(); }
+
+        /* Dictionary encode the first rows of a string column if it has few enough distinct values */
+        bool EncodeDictionary(size_t rows);
+        /* Back to one string per row, so the column can be appended to */
+        void DecodeDictionary();
+
+        ColumnType type;
+        std::vector<int64_t> ints;
+        std::vector<double> floats;
+        std::vector<std::string> strs;
+        std::vector<uint32_t> codes;
+        std::vector<std::string> dict;
+        // Read in place from a mapped image instead of ints or floats, see image.h
+        const int64_t *mapped_ints = nullptr;
+        const double *mapped_floats = nullptr;
+    };
+
+    /* Smallest and largest value of one column of a row group, kept in the catalog so
+       a scan can rule a group out without reading it */
+    struct ZoneMap {
+        /* Widen the range to cover rows [begin, end) of col */
+        void Add(const ColumnVector &col, size_t begin, size_t end);
+
+        bool set = false;
+        Value min;
+        Value max;
+    };
+
+    /* One column of a row group in a mapped image: the raw array, or for strings the
+       offsets followed by the bytes */
+    struct ImageSegment {
+        ColumnType type;
+        const char *data;
+        size_t bytes;
+    };
+
+    /* A row group either has its columns in memory, or only lives in the database
+       file at extent, or in a mapped image at segments. Full groups are written out
+       and dropped from memory. zones has one entry per column and stays in memory
+       either way. Once published only a table's open tail group is changed, by appending */
+    struct RowGroup {
+        bool Resident() const { return columns.size() || !rows; }
+
+        size_t rows = 0;
+        std::vector<ColumnVector> columns;
+        std::vector<ZoneMap> zones;
+        Extent extent;
+        std::vector<ImageSegment> segments;
+    };
+
+    using RowGroupPtr = std::shared_ptr<RowGroup>;
+
+
+    /* A batch of values of a single type, the unit of vectorized evaluation.
+       Either points straight into a ColumnVector or at its own buffers */
+    struct Vector {
+        void Reference(const ColumnVector &col);
+        void Reference(const Vector &other);
+        void Constant(const Value &v);
+        int64_t* MakeInts(size_t n);
+        double* MakeFloats(size_t n);
+        Value Get(size_t row) const;
+        const std::string& Str(size_t row) const { return codes ? dict[codes[row]] : strs[row]; }
+
+        ColumnType type = CT_INT;
+        // A constant vector holds one value that applies to every row
+        bool constant = false;
+        const int64_t *ints = nullptr;
+        const double *floats = nullptr;
+        const std::string *strs = nullptr;
+        // Set instead of strs for a dictionary encoded column
+        const uint32_t *codes = nullptr;
+        const std::string *dict = nullptr;
+        size_t dict_size = 0;
+
+        std::vector<int64_t> int_buf;
+        std::vector<double> float_buf;
+        std::vector<std::string> str_buf;
+    };
+
+    /* Input of a vectorized evaluation. columns[slot][column] for every FROM table slot */
+    struct Batch {
+        size_t count = 0;
+        std::vector<std::vector<Vector>> columns;
+        // Values bound to the statement's '?' parameters
+        const Value *params = nullptr;
+    };
+
+
+    /* Secondary index over one column of a table, a B+tree of the column's type.
+       Lookups may run next to the inserts of appended rows */
+    class Index {
+    public:
+        Index(const std::string &name, size_t column, ColumnType type):
+            name{name},
+            column{column},
+            type{type} {}
+
+        void Insert(const Value &key, RowId row);
+        void Clear();
+
+        /*
+        * Append the rows with lo <= key <= hi to rows, a null bound is open.
+        * Returns false if a bound can't be compared exactly against the
+        * column's type (e.g. a string against an INT column).
+        */
+        bool Lookup(const Value *lo, bool lo_inclusive, const Value *hi, bool hi_inclusive, std::vector<RowId> &rows) const;
+
+        std::string name;
+        size_t column;
+        ColumnType type;
+
+    private:
+        mutable std::shared_mutex latch;
+        BPlusTree<int64_t> ints;
+        BPlusTree<double> floats;
+        BPlusTree<std::string> strs;
+    };
+
+    using IndexPtr = std::shared_ptr<Index>;
+
+
+    /* The row groups and indexes of a table at one point, never changed once published */
+    struct TableVersion {
+        std::vector<std::shared_ptr<const RowGroup>> groups;
+        std::vector<IndexPtr> indexes;
+        // The last group is the tail still being appended to, only some of its rows belong to the version
+        bool open = false;
+    };
+
+    class TableStorage;
+
+    /*
+    * A table as a reader sees it: a published version and how many rows its
+    * open tail group had then. Rows appended later, and the index entries
+    * pointing at them, aren't visible.
+    */
+    struct TableSnapshot {
+        size_t GroupCount() const { return version->groups.size(); }
+        const RowGroup& Group(size_t i) const { return *version->groups[i]; }
+        size_t Rows(size_t i) const { return Open(i) ? tail_rows : version->groups[i]->rows; }
+        size_t RowCount() const;
+        /* The group is still being appended to, so its zone maps aren't final */
+        bool Open(size_t i) const { return version->open && i + 1 == version->groups.size(); }
+        bool Visible(RowId id) const { return RowIdGroup(id) < GroupCount() && RowIdRow(id) < Rows(RowIdGroup(id)); }
+
+        /* Group i with its columns in memory, see TableStorage::LoadGroup(). Only Rows(i) of them are visible */
+        const RowGroup* LoadGroup(size_t i, RowGroup &scratch, const std::vector<bool> &columns = {}) const;
+
+        const TableStorage *table = nullptr;
+        std::shared_ptr<const TableVersion> version;
+        size_t tail_rows = 0;
+    };
+
+    /*
+    * Pins the published versions of some tables for the length of a query.
+    * They're taken together, so every table is seen as of the same moment.
+    * Writers never wait for a snapshot, they publish new versions next to it
+    * and what it still references is reclaimed once it's gone.
+    */
+    class ReadSnapshot {
+    public:
+        explicit ReadSnapshot(const std::vector<TableStorage*> &storage);
+        ReadSnapshot(const ReadSnapshot&) = delete;
+        ReadSnapshot& operator=(const ReadSnapshot&) = delete;
+        ~ReadSnapshot();
+
+        std::vector<TableSnapshot> tables;
+
+    private:
+        std::multiset<uint64_t>::iterator epoch;
     };
 
-    using DBTablePtr = std::unique_ptr<DBTable>;
 
+    /*
+    * Columnar storage for a single table, split into fixed-size row groups.
+    * groups and indexes are the live table, only touched under WriterLock.
+    * Readers go through a ReadSnapshot of the last published version instead:
+    * writers replace groups and indexes rather than change them, apart from
+    * appending rows to the open tail group, whose columns are reserved up
+    * front so appends never move the rows a snapshot references.
+    */
+    class TableStorage {
+    public:
+        TableStorage(const std::string &name, const TableSchema &schema):
+            name{name},
+            schema{schema},
+            published{std::make_shared<TableVersion>()} {}
+
+        /* Check the row has a value of the right type for every column */
+        bool CheckRow(const std::vector<Value> &row) const;
+        /* Check the batch has a column of the right type, rows long, for every column */
+        bool CheckRows(const RowGroup &rows) const;
+        bool AppendRow(const std::vector<Value> &row);
+        /* Append a batch of rows a column at a time, rejected whole unless CheckRows() passes.
+           Both publish the new rows, only failing to write out a full group stops partway */
+        bool AppendRows(RowGroup &&rows);
+        size_t RowCount() const;
+
+        /* Swap group i for a rewritten copy, an empty one removes the group */
+        bool ReplaceGroup(size_t i, RowGroup &&group);
+
+        /* Index every row */
+        bool BuildIndex(Index &index) const;
+        /* Replace every index with a rebuilt one, after the row ids have shifted */
+        bool RebuildIndexes();
+        /* Build index over the table and add it */
+        bool AddIndex(IndexPtr index);
+        Index* FindIndex(std::string_view name);
+
+        /* Take over the row groups read from a database file's catalog */
+        bool Attach(std::vector<RowGroupPtr> &&loaded);
 
-/* Fake DB. All of this will be removed */
+        /* Make the changes since the last call visible to new snapshots, all at once */
+        void Publish();
 
-struct EmployeeTbl {
-    uint64_t emp_id;
-    uint64_t emp_type_id;
-    std::string name;
-    float weight;
-};
-std::unordered_map<std::string, std::vector<DBTablePtr>> TableData;
+        /*
+        * Group i with its columns in memory. Groups on disk are read into
+        * scratch, only the columns set in a non-empty columns mask are decoded.
+        */
+        const RowGroup* LoadGroup(size_t i, RowGroup &scratch, const std::vector<bool> &columns = {}) const;
 
-void insertEmployee(EmployeeTbl data);
+        std::string name;
+        TableSchema schema;
+        std::vector<RowGroupPtr> groups;
+        std::vector<IndexPtr> indexes;
 
+    private:
+        friend class ReadSnapshot;
+
+        RowGroup& WritableGroup();
+        /* Replace the open tail with its sealed form, it won't be appended to again */
+        bool SealTail();
+        /* Prepare the last group for in-place appends */
+        void OpenTail(RowGroup &g);
+
+        // The last group is the open tail, appended to in place
+        bool tail_open = false;
+        // Groups or indexes were replaced since the last Publish()
+        bool changed = false;
+        // What new snapshots see, guarded by the snapshot lock
+        std::shared_ptr<const TableVersion> published;
+        size_t published_rows = 0;
+    };
+
+    /* All table storage, keyed by table name */
+    extern std::unordered_map<std::string, TableStorage> TableData;
+
+    /* Create empty storage for every table in database_tables */
+    void InitTables();
+    TableStorage* GetTable(const std::string &name);
+
+    /*
+    * Back the tables with a database file. Existing tables are loaded from its
+    * catalog, row groups stay on disk and are paged in through a buffer pool of
+    * buffer_pool_bytes. Without an open file everything stays in memory.
+    */
+    bool OpenDatabase(const std::string &path, size_t buffer_pool_bytes, SyncMode sync = SYNC_FULL);
+    /* Write every in-memory row group and the catalog, sync the file and empty the write-ahead log */
+    bool Checkpoint();
+    void CloseDatabase();
+    /* The open database file didn't exist before OpenDatabase() */
+    bool DatabaseCreated();
+    BufferPool* GetBufferPool();
+    /* The open database's write-ahead log, nullptr when running in memory */
+    WriteAheadLog* GetWal();
+
+    /* Held while tables are modified or checkpointed, so log order matches apply order */
+    extern std::mutex WriterLock;
+
+    /* Replaced row groups and indexes, and the extents of groups, are reclaimed by a
+       background thread once no snapshot can see them. Counts for .stats */
+    struct VersionStats {
+        uint64_t epoch = 0;
+        size_t snapshots = 0;
+        size_t retired = 0;
+        size_t reclaimed = 0;
+    };
+    VersionStats GetVersionStats();
 
 }
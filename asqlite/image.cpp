@@ -0,0 +1,334 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "image.h"
+#include "serialize.h"
+#include "output.h"
+
+
+namespace asql {
+
+    static constexpr char IMAGE_MAGIC[8] = {'A', 'S', 'Q', 'L', 'I', 'M', 'G', '1'};
+    // Footer offset and size, then the magic again
+    static constexpr size_t TRAILER_SIZE = 2 * sizeof(uint64_t) + sizeof(IMAGE_MAGIC);
+
+    // The open image, mapped until CloseImage() since snapshots may still point into it
+    static const char *ImageBase = nullptr;
+    static size_t ImageSize = 0;
+    static std::string ImageFile;
+
+    /* Export */
+
+    /* Buffered writes to the image file, tracking the offset so segments can be aligned */
+    class ImageWriter {
+    public:
+        explicit ImageWriter(FILE *file): file{file} {}
+
+        void Write(const void *data, size_t len)
+        {
+            ok = ok && fwrite(data, 1, len, file) == len;
+            offset += len;
+        }
+
+        void Align()
+        {
+            static const char zeros[IMAGE_ALIGN] = {};
+            Write(zeros, (IMAGE_ALIGN - offset % IMAGE_ALIGN) % IMAGE_ALIGN);
+        }
+
+        FILE *file;
+        uint64_t offset = 0;
+        bool ok = true;
+    };
+
+    /* Write the first rows of col as one segment and record where it went in the footer */
+    static void WriteSegment(ImageWriter &out, const ColumnVector &col, size_t rows, ByteWriter &footer,
+                             std::vector<uint64_t> &offsets)
+    {
+        out.Align();
+        const uint64_t begin = out.offset;
+        switch (col.type) {
+        case CT_INT:   out.Write(col.Ints(), rows * sizeof(int64_t));  break;
+        case CT_FLOAT: out.Write(col.Floats(), rows * sizeof(double)); break;
+        case CT_STR:
+            offsets.assign(1, 0);
+            for (size_t r = 0; r < rows; ++r)
+                offsets.push_back(offsets.back() + col.Str(r).size());
+            out.Write(offsets.data(), offsets.size() * sizeof(uint64_t));
+            for (size_t r = 0; r < rows; ++r)
+                out.Write(col.Str(r).data(), col.Str(r).size());
+            break;
+        }
+        footer.Put(begin);
+        footer.Put(out.offset - begin);
+    }
+
+    bool ExportImage(const std::string &path)
+    {
+        std::vector<TableStorage*> storage;
+        for (auto &t : TableData)
+            storage.push_back(&t.second);
+        std::sort(storage.begin(), storage.end(), [](const TableStorage *a, const TableStorage *b) { return a->name < b->name; });
+        ReadSnapshot snapshot{storage};
+
+        const std::string tmp = path + ".tmp";
+        FILE *file = fopen(tmp.c_str(), "wb");
+        if (!file) {
+            Print("Unable to create image '%s'\n", tmp.c_str());
+            return false;
+        }
+
+        ImageWriter out{file};
+        out.Write(IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+
+        ByteWriter footer;
+        footer.Put(static_cast<uint32_t>(snapshot.tables.size()));
+
+        bool loaded = true;
+        RowGroup scratch;
+        std::vector<uint64_t> offsets;
+        for (const auto &t : snapshot.tables) {
+            const auto &schema = t.table->schema;
+            footer.PutString(t.table->name);
+            footer.Put(static_cast<uint32_t>(schema.size()));
+            for (const auto &col : schema) {
+                footer.PutString(col.first);
+                footer.Put(static_cast<uint8_t>(col.second));
+            }
+
+            // An empty tail has nothing to map
+            uint32_t ngroups = 0;
+            for (size_t i = 0; i < t.GroupCount(); ++i)
+                ngroups += t.Rows(i) != 0;
+            footer.Put(ngroups);
+
+            for (size_t i = 0; i < t.GroupCount() && loaded && out.ok; ++i) {
+                const size_t rows = t.Rows(i);
+                if (!rows)
+                    continue;
+
+                auto group = t.LoadGroup(i, scratch);
+                if (!group) {
+                    loaded = false;
+                    break;
+                }
+
+                footer.Put(static_cast<uint64_t>(rows));
+                for (size_t c = 0; c < schema.size(); ++c) {
+                    // The open tail's zones may already cover rows the snapshot can't see
+                    ZoneMap zone;
+                    if (t.Open(i))
+                        zone.Add(group->columns[c], 0, rows);
+                    else
+                        zone = t.Group(i).zones[c];
+                    footer.Put(static_cast<uint8_t>(zone.set));
+                    PutValue(footer, zone.min);
+                    PutValue(footer, zone.max);
+
+                    WriteSegment(out, group->columns[c], rows, footer, offsets);
+                }
+            }
+        }
+
+        out.Align();
+        const uint64_t footer_offset = out.offset;
+        const uint64_t footer_size = footer.buf.size();
+        out.Write(footer.buf.data(), footer.buf.size());
+        out.Write(&footer_offset, sizeof(footer_offset));
+        out.Write(&footer_size, sizeof(footer_size));
+        out.Write(IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+
+        // Replace path only with a complete image
+        bool ok = loaded && out.ok && fflush(file) == 0 && fsync(fileno(file)) == 0;
+        ok &= fclose(file) == 0;
+        if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+            Print("Failed to write image '%s'\n", path.c_str());
+            unlink(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    /* Open */
+
+    struct ImageTable {
+        std::string name;
+        TableSchema schema;
+        std::vector<RowGroupPtr> groups;
+    };
+
+    /* Parse the footer of a mapped image, checking every segment lies before it */
+    static bool ReadFooter(const char *data, uint64_t footer_offset, uint64_t footer_size, std::vector<ImageTable> &tables)
+    {
+        ByteReader r{data + footer_offset, footer_size};
+        auto ntables = r.Get<uint32_t>();
+        for (uint32_t t = 0; t < ntables && r.ok; ++t) {
+            ImageTable table;
+            table.name = r.GetString();
+
+            auto ncols = r.Get<uint32_t>();
+            for (uint32_t c = 0; c < ncols && r.ok; ++c) {
+                auto col = r.GetString();
+                auto type = static_cast<ColumnType>(r.Get<uint8_t>());
+                r.ok &= type >= CT_INT && type <= CT_STR;
+                table.schema.columns.emplace_back(col, type);
+            }
+
+            auto ngroups = r.Get<uint32_t>();
+            for (uint32_t g = 0; g < ngroups && r.ok; ++g) {
+                auto group = std::make_shared<RowGroup>();
+                group->rows = r.Get<uint64_t>();
+                r.ok &= group->rows && group->rows <= ROW_GROUP_SIZE;
+
+                group->zones.resize(table.schema.size());
+                for (size_t c = 0; c < table.schema.size() && r.ok; ++c) {
+                    auto &zone = group->zones[c];
+                    zone.set = r.Get<uint8_t>() != 0;
+                    zone.min = GetValue(r);
+                    zone.max = GetValue(r);
+
+                    auto type = table.schema.columns[c].second;
+                    auto offset = r.Get<uint64_t>();
+                    auto bytes = r.Get<uint64_t>();
+                    const uint64_t fixed = (type == CT_STR ? group->rows + 1 : group->rows) * sizeof(uint64_t);
+                    r.ok &= offset % IMAGE_ALIGN == 0 && offset <= footer_offset && bytes <= footer_offset - offset &&
+                            (type == CT_STR ? bytes >= fixed : bytes == fixed);
+                    group->segments.push_back({type, data + offset, static_cast<size_t>(bytes)});
+                }
+                table.groups.push_back(std::move(group));
+            }
+            tables.push_back(std::move(table));
+        }
+        return r.ok;
+    }
+
+    bool OpenImage(const std::string &path)
+    {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            Print("Unable to open image '%s'\n", path.c_str());
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            Print("Unable to stat image '%s'\n", path.c_str());
+            return false;
+        }
+
+        const size_t size = static_cast<size_t>(st.st_size);
+        if (size < IMAGE_ALIGN + TRAILER_SIZE) {
+            close(fd);
+            Print("'%s' is not an ASQLite image\n", path.c_str());
+            return false;
+        }
+
+        // The mapping outlives the descriptor
+        void *base = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (base == MAP_FAILED) {
+            Print("Unable to map image '%s'\n", path.c_str());
+            return false;
+        }
+
+        auto data = static_cast<const char*>(base);
+        uint64_t footer_offset, footer_size;
+        memcpy(&footer_offset, data + size - TRAILER_SIZE, sizeof(footer_offset));
+        memcpy(&footer_size, data + size - TRAILER_SIZE + sizeof(footer_offset), sizeof(footer_size));
+
+        std::vector<ImageTable> tables;
+        bool valid = !memcmp(data, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) &&
+                     !memcmp(data + size - sizeof(IMAGE_MAGIC), IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) &&
+                     footer_offset % IMAGE_ALIGN == 0 && footer_offset <= size - TRAILER_SIZE &&
+                     footer_size == size - TRAILER_SIZE - footer_offset;
+        if (!valid || !ReadFooter(data, footer_offset, footer_size, tables)) {
+            munmap(base, size);
+            Print(valid ? "Corrupt image '%s'\n" : "'%s' is not an ASQLite image\n", path.c_str());
+            return false;
+        }
+
+        for (auto &t : tables) {
+            database_tables[t.name] = t.schema;
+            TableData.erase(t.name);
+            auto &table = TableData.emplace(t.name, TableStorage{t.name, t.schema}).first->second;
+            table.Attach(std::move(t.groups));
+            table.Publish();
+        }
+
+        ImageBase = data;
+        ImageSize = size;
+        ImageFile = path;
+        return true;
+    }
+
+    void CloseImage()
+    {
+        if (ImageBase)
+            munmap(const_cast<char*>(ImageBase), ImageSize);
+        ImageBase = nullptr;
+        ImageSize = 0;
+        ImageFile.clear();
+    }
+
+    bool ImageOpen()
+    {
+        return ImageBase != nullptr;
+    }
+
+    const std::string& ImagePath()
+    {
+        return ImageFile;
+    }
+
+    size_t ImageBytes()
+    {
+        return ImageSize;
+    }
+
+    bool LoadImageGroup(const RowGroup &g, RowGroup &scratch, const std::vector<bool> &columns)
+    {
+        scratch.rows = g.rows;
+        scratch.columns.clear();
+
+        for (size_t c = 0; c < g.segments.size(); ++c) {
+            const auto &seg = g.segments[c];
+            scratch.columns.emplace_back(seg.type);
+            if (c < columns.size() && !columns[c])
+                continue;
+
+            auto &col = scratch.columns.back();
+            switch (seg.type) {
+            case CT_INT:
+                col.mapped_ints = reinterpret_cast<const int64_t*>(seg.data);
+                break;
+            case CT_FLOAT:
+                col.mapped_floats = reinterpret_cast<const double*>(seg.data);
+                break;
+            case CT_STR: {
+                // Offsets were only checked to fit the segment as a whole when opening
+                auto offsets = reinterpret_cast<const uint64_t*>(seg.data);
+                auto bytes = seg.data + (g.rows + 1) * sizeof(uint64_t);
+                const uint64_t len = seg.bytes - (g.rows + 1) * sizeof(uint64_t);
+                col.strs.reserve(g.rows);
+                for (size_t r = 0; r < g.rows; ++r) {
+                    if (offsets[r] > offsets[r + 1] || offsets[r + 1] > len) {
+                        Print("Corrupt image segment\n");
+                        return false;
+                    }
+                    col.strs.emplace_back(bytes + offsets[r], offsets[r + 1] - offsets[r]);
+                }
+                break;
+            }
+            }
+        }
+        return true;
+    }
+
+}
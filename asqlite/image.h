@@ -0,0 +1,48 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "database.h"
+
+
+namespace asql {
+
+    /* Every column segment of an image starts at a multiple of this, so arrays are scanned in place */
+    constexpr size_t IMAGE_ALIGN = 64;
+
+    /*
+    * A read-only database image is a snapshot of every table written so it can
+    * be mapped and scanned without loading it. Layout:
+    *
+    *   magic, padded to IMAGE_ALIGN
+    *   column segments, each aligned: INT and FLOAT columns as plain arrays of
+    *   the group's rows, STR columns as rows + 1 offsets followed by the bytes
+    *   footer: per table its name, columns and row groups (rows, then per
+    *   column the zone map and the segment's offset and size)
+    *   trailer: footer offset and size, magic
+    *
+    * Opening one only reads the footer, the segments are paged in by the
+    * kernel as queries touch them and shared with every process mapping the
+    * same file. Indexes aren't part of the image, CREATE INDEX builds them in
+    * memory.
+    */
+
+    /* Write a snapshot of every table to path, replacing it once complete */
+    bool ExportImage(const std::string &path);
+    /* Map the image at path and serve its tables, read-only. Replaces the tables in database_tables */
+    bool OpenImage(const std::string &path);
+    /* Unmap the open image, the tables it served have to be gone */
+    void CloseImage();
+    /* An image is open, the tables can't be changed */
+    bool ImageOpen();
+    const std::string& ImagePath();
+    size_t ImageBytes();
+
+    /*
+    * The columns of a mapped group set in a non-empty columns mask into
+    * scratch. Ints and floats point into the mapping, strings are copied out.
+    */
+    bool LoadImageGroup(const RowGroup &g, RowGroup &scratch, const std::vector<bool> &columns);
+
+}
@@ -0,0 +1,262 @@
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "import.h"
+#include "threadpool.h"
+#include "output.h"
+
+
+namespace asql {
+
+    // Chunks a file is split into for parsing, a round parses a few per thread before appending them
+    static constexpr size_t MIN_CHUNK_BYTES = 64 << 10;
+    static constexpr size_t MAX_CHUNK_BYTES = 8 << 20;
+    static constexpr size_t CHUNKS_PER_THREAD = 2;
+
+    /* Lines [begin, end) of the file and the column batch parsed from them */
+    struct ImportChunk {
+        const char *begin = nullptr;
+        const char *end = nullptr;
+        RowGroup rows;
+        // Start of the line that failed to parse
+        const char *error_line = nullptr;
+        std::string error;
+    };
+
+    /* Read the field at p up to the next ',' or end. Only a quoted field with "" in it is copied into unescaped */
+    static bool NextField(const char *&p, const char *end, std::string_view &field, std::string &unescaped)
+    {
+        if (p == end || *p != '"') {
+            auto comma = static_cast<const char*>(memchr(p, ',', static_cast<size_t>(end - p)));
+            auto stop = comma ? comma : end;
+            field = {p, static_cast<size_t>(stop - p)};
+            p = stop;
+            return true;
+        }
+
+        const char *start = ++p;
+        bool escaped = false;
+        while ( true ) {
+            auto quote = static_cast<const char*>(memchr(p, '"', static_cast<size_t>(end - p)));
+            if (!quote)
+                return false;
+            if (quote + 1 < end && quote[1] == '"') {
+                escaped = true;
+                p = quote + 2;
+                continue;
+            }
+            field = {start, static_cast<size_t>(quote - start)};
+            p = quote + 1;
+            break;
+        }
+
+        if (escaped) {
+            unescaped.clear();
+            for (size_t i = 0; i < field.size(); ++i) {
+                unescaped += field[i];
+                if (field[i] == '"')
+                    ++i;
+            }
+            field = unescaped;
+        }
+        return true;
+    }
+
+    static bool ParseField(std::string_view field, ColumnVector &col)
+    {
+        const char *end = field.data() + field.size();
+        switch (col.type) {
+        case CT_INT: {
+            int64_t v;
+            auto r = std::from_chars(field.data(), end, v);
+            if (r.ec != std::errc() || r.ptr != end)
+                return false;
+            col.ints.push_back(v);
+            return true;
+        }
+        case CT_FLOAT: {
+            double v;
+            auto r = std::from_chars(field.data(), end, v);
+            if (r.ec != std::errc() || r.ptr != end)
+                return false;
+            col.floats.push_back(v);
+            return true;
+        }
+        case CT_STR:
+            col.strs.emplace_back(field);
+            return true;
+        }
+        return false;
+    }
+
+    /* The line without its '\n' or "\r\n" */
+    static const char* LineEnd(const char *p, const char *end, const char *&next)
+    {
+        auto nl = static_cast<const char*>(memchr(p, '\n', static_cast<size_t>(end - p)));
+        next = nl ? nl + 1 : end;
+        const char *eol = nl ? nl : end;
+        return eol > p && eol[-1] == '\r' ? eol - 1 : eol;
+    }
+
+    static void ParseChunk(const TableSchema &schema, ImportChunk &chunk)
+    {
+        auto &rows = chunk.rows;
+        for (const auto &col : schema)
+            rows.columns.emplace_back(col.second);
+
+        std::string_view field;
+        std::string unescaped;
+        const char *next;
+
+        for (const char *line = chunk.begin; line < chunk.end; line = next) {
+            const char *line_end = LineEnd(line, chunk.end, next);
+            if (line == line_end)
+                continue;
+
+            auto fail = [&](std::string message) {
+                chunk.error_line = line;
+                chunk.error = std::move(message);
+            };
+
+            const char *p = line;
+            for (size_t c = 0; c < rows.columns.size(); ++c) {
+                if (c && (p == line_end || *p++ != ',')) {
+                    fail("expected " + std::to_string(rows.columns.size()) + " fields");
+                    return;
+                }
+                if (!NextField(p, line_end, field, unescaped)) {
+                    fail("unterminated quoted field");
+                    return;
+                }
+                if (!ParseField(field, rows.columns[c])) {
+                    const char *type = rows.columns[c].type == CT_INT ? "INT" : "FLOAT";
+                    fail("'" + std::string(field) + "' is not a valid " + type + " for column '" + schema.columns[c].first + "'");
+                    return;
+                }
+            }
+
+            if (p != line_end) {
+                fail("expected " + std::to_string(rows.columns.size()) + " fields");
+                return;
+            }
+            rows.rows++;
+        }
+    }
+
+    /* The line names every column of the schema, in order */
+    static bool IsHeader(const TableSchema &schema, const char *p, const char *end)
+    {
+        std::string_view field;
+        std::string unescaped;
+
+        for (size_t c = 0; c < schema.size(); ++c) {
+            if (c && (p == end || *p++ != ','))
+                return false;
+            if (!NextField(p, end, field, unescaped))
+                return false;
+
+            const auto &name = schema.columns[c].first;
+            if (field.size() != name.size())
+                return false;
+            for (size_t i = 0; i < name.size(); ++i)
+                if (toupper(static_cast<unsigned char>(field[i])) != name[i])
+                    return false;
+        }
+        return p == end;
+    }
+
+    bool ImportCsv(const std::string &path, TableStorage &table, size_t &imported)
+    {
+        imported = 0;
+
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            Print("Unable to open '%s'\n", path.c_str());
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+            Print("Unable to stat '%s'\n", path.c_str());
+            close(fd);
+            return false;
+        }
+
+        const size_t size = static_cast<size_t>(st.st_size);
+        if (!size) {
+            close(fd);
+            return true;
+        }
+
+        // The mapping outlives the descriptor
+        void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+            Print("Unable to map '%s'\n", path.c_str());
+            return false;
+        }
+        madvise(map, size, MADV_SEQUENTIAL);
+
+        const char *data = static_cast<const char*>(map);
+        const char *end = data + size;
+
+        const char *start;
+        if (!IsHeader(table.schema, data, LineEnd(data, end, start)))
+            start = data;
+
+        // Split at line boundaries, small files still get a chunk per thread
+        const size_t threads = GetThreadPool().ThreadCount();
+        const size_t chunk_bytes = std::clamp(size / (threads * CHUNKS_PER_THREAD), MIN_CHUNK_BYTES, MAX_CHUNK_BYTES);
+
+        std::vector<ImportChunk> chunks;
+        for (const char *p = start; p < end; ) {
+            const char *stop = static_cast<size_t>(end - p) > chunk_bytes ? p + chunk_bytes : end;
+            if (stop < end) {
+                auto nl = static_cast<const char*>(memchr(stop, '\n', static_cast<size_t>(end - stop)));
+                stop = nl ? nl + 1 : end;
+            }
+            chunks.emplace_back();
+            chunks.back().begin = p;
+            chunks.back().end = stop;
+            p = stop;
+        }
+
+        // Parse a round of chunks in parallel, then append them in file order before parsing the next
+        bool ok = true;
+        const size_t round = threads * CHUNKS_PER_THREAD;
+        for (size_t first = 0; first < chunks.size() && ok; first += round) {
+            const size_t n = std::min(round, chunks.size() - first);
+            GetThreadPool().ParallelFor(n, [&](size_t i) { ParseChunk(table.schema, chunks[first + i]); });
+
+            std::lock_guard<std::mutex> guard{WriterLock};
+            for (size_t i = first; i < first + n && ok; ++i) {
+                auto &chunk = chunks[i];
+                if (chunk.error_line) {
+                    auto line = 1 + static_cast<size_t>(std::count(data, chunk.error_line, '\n'));
+                    Print("%s:%zu: %s\n", path.c_str(), line, chunk.error.c_str());
+                    ok = false;
+                    break;
+                }
+
+                const size_t rows = chunk.rows.rows;
+                ok = table.AppendRows(std::move(chunk.rows));
+                if (ok)
+                    imported += rows;
+                chunk.rows = RowGroup{};
+            }
+        }
+
+        munmap(map, size);
+        return ok;
+    }
+
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <string>
+
+#include "database.h"
+
+
+namespace asql {
+
+    /*
+    * Bulk load a CSV file into table, one row per line with a field for every
+    * column. Fields may be double quoted with "" as an escaped quote, but a
+    * quoted field can't span lines. A first line holding the column names is
+    * skipped. The file is mapped into memory and split at line boundaries,
+    * chunks are parsed straight into column batches on the thread pool and
+    * appended in file order. Rows of the chunks before a bad line stay imported.
+    */
+    bool ImportCsv(const std::string &path, TableStorage &table, size_t &imported);
+
+}
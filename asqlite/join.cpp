@@ -0,0 +1,352 @@
+#include <atomic>
+#include <cstring>
+#include <functional>
+
+#include "join.h"
+#include "query.h"
+#include "threadpool.h"
+
+
+namespace asql {
+
+    /* One side's values of a join key, one entry per input row. Mixed int and
+       float keys are both widened to double so 1 = 1.0 matches like the filter */
+    struct KeyColumn {
+        ColumnType type = CT_INT;
+        std::vector<int64_t> ints;
+        std::vector<double> floats;
+        std::vector<const std::string*> strs;
+    };
+
+    /* An equality filter between a joined table and the table being added */
+    struct JoinKey {
+        const VariableExpr *joined;
+        const VariableExpr *added;
+        ColumnType type;
+    };
+
+    /*
+    * Open addressing table over the build side's key hashes with linear probing.
+    * Every distinct hash owns one 16 byte slot holding the range of its build
+    * rows in a single array, so a probe reads one slot and then its matches
+    * back to back. Build rows are indexed with 32 bits to keep slots small.
+    */
+    class JoinHashTable {
+    public:
+        void Build(const std::vector<uint64_t> &hashes)
+        {
+            size_t capacity = 16;
+            while (capacity < hashes.size() * 2)
+                capacity <<= 1;
+            mask = capacity - 1;
+            slots.assign(capacity, Slot{0, 0, 0});
+
+            std::vector<uint32_t> owner(hashes.size());
+            for (size_t i = 0; i < hashes.size(); ++i) {
+                size_t s = hashes[i] & mask;
+                while (slots[s].count && slots[s].hash != hashes[i])
+                    s = (s + 1) & mask;
+                slots[s].hash = hashes[i];
+                slots[s].count++;
+                owner[i] = static_cast<uint32_t>(s);
+            }
+
+            // Point every slot past the end of its range, then fill the ranges back to front
+            uint32_t end = 0;
+            for (auto &slot : slots) {
+                end += slot.count;
+                slot.begin = end;
+            }
+
+            rows.resize(hashes.size());
+            for (size_t i = hashes.size(); i-- > 0; )
+                rows[--slots[owner[i]].begin] = static_cast<uint32_t>(i);
+        }
+
+        /* Call match(build_row) for every build row with this hash, equal hashes may still differ in key */
+        template <typename Fn>
+        void Probe(uint64_t hash, Fn match) const
+        {
+            for (size_t s = hash & mask; slots[s].count; s = (s + 1) & mask) {
+                if (slots[s].hash != hash)
+                    continue;
+                for (uint32_t i = slots[s].begin; i < slots[s].begin + slots[s].count; ++i)
+                    match(rows[i]);
+                return;
+            }
+        }
+
+    private:
+        struct Slot {
+            uint64_t hash;
+            uint32_t begin;
+            uint32_t count;
+        };
+
+        std::vector<Slot> slots;
+        std::vector<uint32_t> rows;
+        size_t mask = 0;
+    };
+
+    static inline uint64_t HashInt(uint64_t x)
+    {
+        x ^= x >> 33;
+        x *= 0xff51afd7ed558ccdULL;
+        x ^= x >> 33;
+        x *= 0xc4ceb9fe1a85ec53ULL;
+        x ^= x >> 33;
+        return x;
+    }
+
+    static inline uint64_t HashFloat(double f)
+    {
+        // -0.0 == 0.0, they have to hash the same
+        if (f == 0)
+            f = 0;
+        uint64_t bits;
+        memcpy(&bits, &f, sizeof(bits));
+        return HashInt(bits);
+    }
+
+    /* Page in the groups of a FROM slot in parallel and keep the rows passing its pushed filters */
+    static bool LoadJoinTable(const SelectQuery &query, const TableSnapshot &snapshot, size_t slot,
+                              const std::vector<Value> &params, JoinTable &table, OperatorStats *stats)
+    {
+        const auto &filter = query.join_filters[slot];
+        const size_t groups = snapshot.GroupCount();
+
+        // Sized up front, groups point into loaded
+        table.groups.resize(groups);
+        table.loaded.resize(groups);
+        std::vector<std::vector<RowId>> kept(groups);
+        std::atomic<bool> ok{true};
+
+        GetThreadPool().ParallelFor(groups, [&](size_t i) {
+            OperatorTimer timer{stats};
+            const size_t rows = snapshot.Rows(i);
+            if (stats) {
+                stats->groups++;
+                stats->rows_in += rows;
+            }
+
+            // Groups ruled out by their zone maps are never read, none of their rows join
+            if (!GroupMayMatch(query, slot, snapshot, i, params)) {
+                if (stats)
+                    stats->groups_skipped++;
+                return;
+            }
+
+            auto group = snapshot.LoadGroup(i, table.loaded[i], query.referenced[slot]);
+            table.groups[i] = group;
+            if (!group) {
+                ok = false;
+                return;
+            }
+
+            std::vector<uint8_t> keep(rows, 1);
+            if (filter.code.size()) {
+                Batch batch;
+                batch.count = rows;
+                batch.params = params.data();
+                batch.columns.resize(query.tables.size());
+                batch.columns[slot].resize(group->columns.size());
+                for (size_t c = 0; c < group->columns.size(); ++c)
+                    batch.columns[slot][c].Reference(group->columns[c]);
+
+                std::vector<Vector> regs;
+                filter.Run(batch, regs, keep);
+            }
+
+            for (size_t r = 0; r < rows; ++r)
+                if (keep[r])
+                    kept[i].push_back(MakeRowId(i, r));
+            if (stats)
+                stats->rows_out += kept[i].size();
+        });
+        if (!ok)
+            return false;
+
+        for (const auto &ids : kept)
+            table.rows.insert(table.rows.end(), ids.begin(), ids.end());
+        return true;
+    }
+
+    /* Equality filters between column slot and a table in joined, in either order */
+    static void FindKeys(const ArenaVector<Filter> &filters, const std::vector<bool> &joined, size_t slot,
+                         std::vector<JoinKey> &keys)
+    {
+        for (const auto &filter : filters) {
+            auto l = dynamic_cast<const VariableExpr*>(filter.lhs);
+            auto r = dynamic_cast<const VariableExpr*>(filter.rhs);
+            if (filter.Op != EO_EQUALS || !l || !r)
+                continue;
+
+            if (static_cast<size_t>(l->slot) == slot)
+                std::swap(l, r);
+            if (static_cast<size_t>(r->slot) != slot || !joined[l->slot])
+                continue;
+
+            // A string never equals a number, leave those to the filter
+            if ((l->type == CT_STR) != (r->type == CT_STR))
+                continue;
+
+            ColumnType type = l->type == CT_INT && r->type == CT_INT ? CT_INT : l->type == CT_STR ? CT_STR : CT_FLOAT;
+            keys.push_back({l, r, type});
+        }
+    }
+
+    /* Read column of count rows into keys, row i is ids[i * stride] */
+    static void GatherKeys(const JoinTable &table, size_t column, const RowId *ids, size_t stride, size_t count,
+                           ColumnType type, KeyColumn &keys)
+    {
+        keys.type = type;
+        for (size_t i = 0; i < count; ++i) {
+            RowId id = ids[i * stride];
+            const auto &col = table.Group(id).columns[column];
+            size_t row = RowIdRow(id);
+            switch (type) {
+            case CT_INT:   keys.ints.push_back(col.Ints()[row]); break;
+            case CT_FLOAT: keys.floats.push_back(col.type == CT_INT ? static_cast<double>(col.Ints()[row]) : col.Floats()[row]); break;
+            case CT_STR:   keys.strs.push_back(&col.Str(row)); break;
+            }
+        }
+    }
+
+    /* Fold one key column into the per row hashes */
+    static void HashKeys(const KeyColumn &keys, std::vector<uint64_t> &hashes)
+    {
+        for (size_t i = 0; i < hashes.size(); ++i) {
+            uint64_t h = 0;
+            switch (keys.type) {
+            case CT_INT:   h = HashInt(static_cast<uint64_t>(keys.ints[i])); break;
+            case CT_FLOAT: h = HashFloat(keys.floats[i]); break;
+            case CT_STR:   h = std::hash<std::string>{}(*keys.strs[i]); break;
+            }
+            hashes[i] = (hashes[i] << 5 | hashes[i] >> 59) ^ h;
+        }
+    }
+
+    static bool KeysEqual(const std::vector<KeyColumn> &l, size_t i, const std::vector<KeyColumn> &r, size_t j)
+    {
+        for (size_t k = 0; k < l.size(); ++k) {
+            switch (l[k].type) {
+            case CT_INT:   if (l[k].ints[i] != r[k].ints[j]) return false; break;
+            case CT_FLOAT: if (l[k].floats[i] != r[k].floats[j]) return false; break;
+            case CT_STR:   if (*l[k].strs[i] != *r[k].strs[j]) return false; break;
+            }
+        }
+        return true;
+    }
+
+    bool JoinTables(const SelectQuery &query, const std::vector<TableSnapshot> &tables,
+                    const std::vector<Value> &params, JoinResult &result, QueryProfile *profile)
+    {
+        const auto &filters = query.filters;
+        const size_t width = tables.size();
+        result.width = width;
+        result.tuples.clear();
+        result.tables.clear();
+        result.tables.resize(width);
+        for (size_t slot = 0; slot < width; ++slot)
+            if (!LoadJoinTable(query, tables[slot], slot, params, result.tables[slot], profile ? &profile->scans[slot] : nullptr))
+                return false;
+
+        OperatorTimer timer{profile ? &profile->join : nullptr};
+        if (profile)
+            for (const auto &table : result.tables)
+                profile->join.rows_in += table.rows.size();
+
+        auto &tuples = result.tuples;
+        std::vector<bool> joined(width);
+
+        // Start from the smallest table, every tuple is one of its rows
+        size_t first = 0;
+        for (size_t slot = 1; slot < width; ++slot)
+            if (result.tables[slot].rows.size() < result.tables[first].rows.size())
+                first = slot;
+
+        std::vector<RowId> ids = result.tables[first].rows;
+        tuples.assign(ids.size() * width, 0);
+        for (size_t i = 0; i < ids.size(); ++i)
+            tuples[i * width + first] = ids[i];
+        joined[first] = true;
+        size_t count = ids.size();
+
+        for (size_t step = 1; step < width && count; ++step) {
+            // Next is the smallest table with a join key, the smallest of the rest without one
+            size_t slot = width;
+            std::vector<JoinKey> keys;
+            for (size_t s = 0; s < width; ++s) {
+                if (joined[s])
+                    continue;
+
+                std::vector<JoinKey> k;
+                FindKeys(filters, joined, s, k);
+                bool better = slot == width || (k.size() && keys.empty()) ||
+                              ((k.size() != 0) == (keys.size() != 0) && result.tables[s].rows.size() < result.tables[slot].rows.size());
+                if (better) {
+                    slot = s;
+                    keys = std::move(k);
+                }
+            }
+
+            const auto &table = result.tables[slot];
+            ids = table.rows;
+
+            std::vector<RowId> next;
+            auto emit = [&](size_t tuple, RowId id) {
+                auto src = tuples.begin() + static_cast<long>(tuple * width);
+                next.insert(next.end(), src, src + static_cast<long>(width));
+                next[next.size() - width + slot] = id;
+            };
+
+            if (keys.empty()) {
+                // No equality filter links the table to the others, cross product
+                next.reserve(count * ids.size() * width);
+                for (size_t i = 0; i < count; ++i)
+                    for (auto id : ids)
+                        emit(i, id);
+            } else {
+                std::vector<KeyColumn> lkeys(keys.size()), rkeys(keys.size());
+                std::vector<uint64_t> lhash(count), rhash(ids.size());
+                for (size_t k = 0; k < keys.size(); ++k) {
+                    auto l = keys[k].joined, r = keys[k].added;
+                    GatherKeys(result.tables[l->slot], static_cast<size_t>(l->column), tuples.data() + l->slot, width,
+                               count, keys[k].type, lkeys[k]);
+                    GatherKeys(table, static_cast<size_t>(r->column), ids.data(), 1, ids.size(), keys[k].type, rkeys[k]);
+                    HashKeys(lkeys[k], lhash);
+                    HashKeys(rkeys[k], rhash);
+                }
+
+                // Build on the smaller input, probe with the larger one
+                JoinHashTable ht;
+                if (count <= ids.size()) {
+                    ht.Build(lhash);
+                    for (size_t j = 0; j < ids.size(); ++j)
+                        ht.Probe(rhash[j], [&](uint32_t i) {
+                            if (KeysEqual(lkeys, i, rkeys, j))
+                                emit(i, ids[j]);
+                        });
+                } else {
+                    ht.Build(rhash);
+                    for (size_t i = 0; i < count; ++i)
+                        ht.Probe(lhash[i], [&](uint32_t j) {
+                            if (KeysEqual(lkeys, i, rkeys, j))
+                                emit(i, ids[j]);
+                        });
+                }
+            }
+
+            tuples.swap(next);
+            count = tuples.size() / width;
+            joined[slot] = true;
+        }
+
+        if (!count)
+            tuples.clear();
+        if (profile)
+            profile->join.rows_out += count;
+        return true;
+    }
+
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <vector>
+
+#include "arena.h"
+#include "btree.h"
+#include "database.h"
+#include "profile.h"
+
+
+namespace asql {
+
+    class SelectQuery;
+
+    /* One FROM table with every row group held in memory for the join */
+    struct JoinTable {
+        const RowGroup& Group(RowId id) const { return *groups[RowIdGroup(id)]; }
+
+        // Null for groups whose zone maps rule out every row
+        std::vector<const RowGroup*> groups;
+        // Groups paged in from the database file with only the referenced columns, indexed like groups
+        std::vector<RowGroup> loaded;
+        // Rows that passed the filters pushed below the join, in table order
+        std::vector<RowId> rows;
+    };
+
+    /* Output of JoinTables(), tuples[i * width + slot] is tuple i's row of that FROM slot */
+    struct JoinResult {
+        size_t width = 0;
+        std::vector<RowId> tuples;
+        std::vector<JoinTable> tables;
+    };
+
+    /*
+    * Join the FROM tables of query into row id tuples. Each table's rows are
+    * first cut down by its join_filters program, then tables are added one
+    * at a time, preferring one with an equality filter against the tables
+    * joined so far. Those run as a hash join that builds on the smaller input
+    * and probes with the other, anything else is a cross product. Only the
+    * equality filters drive the join, the caller still applies the query's
+    * program to the tuples. Loading a table counts as its scan in a profile.
+    */
+    bool JoinTables(const SelectQuery &query, const std::vector<TableSnapshot> &tables,
+                    const std::vector<Value> &params, JoinResult &result, QueryProfile *profile = nullptr);
+
+}
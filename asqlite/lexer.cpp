@@ -1,4 +1,6 @@
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <vector>
 #include <unordered_map>
 #include <memory>
@@ -7,17 +9,11 @@
 
 
 #include "lexer.h"
+#include "arena.h"
+#include "output.h"
 
 namespace asql
 {
-    // Key for last tokenized item
-    static Tok CurrToken;
-
-     // The tokenized items
-    std::string LexerString  = "";
-    float       LexerFloat   = 0.0f;
-    int         LexerInteger = 0;
-
     std::unordered_map<char, int> LexerBinOpPrecedent = {
         {'+', 10},
         {'-', 10},
@@ -25,41 +21,104 @@ namespace asql
         {'*', 20}
     };
 
-    /* SQL Keywords */
-    std::unordered_map<std::string, int> LexerKeywords = {
-        {"AS",     T_KEY_AS},
-        {"BY",     T_KEY_BY},
-        {"CREATE", T_QRY_CREATE},
-        {"DELETE", T_QRY_DELETE},
-        {"FROM",   T_KEY_FROM},
-        {"GROUP",  T_KEY_GROUP},
-        {"INSERT", T_QRY_INSERT},
-        {"INTO",   T_KEY_INTO},
-        {"JOIN",   T_KEY_JOIN},
-        {"LIMIT",  T_KEY_LIMIT},
-        {"ORDER",  T_KEY_ORDER},
-        {"ON",     T_KEY_ON},
-        {"SELECT", T_QRY_SELECT},
-        {"TABLE",  T_KEY_TABLE},
-        {"UPDATE", T_QRY_UPDATE},
-        {"VALUES", T_KEY_VALUES},
-        {"WHERE",  T_KEY_WHERE}
+    /* ASCII-only classification, cheaper than the locale aware <cctype> versions */
+    static inline bool IsSpace(char c) { return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v'; }
+    static inline bool IsDigit(char c) { return static_cast<unsigned char>(c - '0') < 10; }
+    static inline bool IsAlpha(char c) { return static_cast<unsigned char>((c | 0x20) - 'a') < 26; }
+    static inline bool IsIdent(char c) { return IsAlpha(c) || IsDigit(c) || c == '_'; }
+
+    /* Compare an identifier against an upper case keyword. Clearing bit 5 upper cases
+       letters, no keyword contains a digit or '_' so those can't produce a false match */
+    static inline bool KeywordEquals(std::string_view s, const char *kw, size_t len)
+    {
+        if (s.size() != len)
+            return false;
+        for (size_t i = 0; i < len; ++i)
+            if ((s[i] & ~0x20) != kw[i])
+                return false;
+        return true;
+    }
+
+    /* SQL Keywords. Dispatch on the first letter, then compare the few candidates */
+    static Tok LookupKeyword(std::string_view s)
+    {
+#define KW(str, tok) if (KeywordEquals(s, str, sizeof(str) - 1)) return tok
+        switch (s[0] & ~0x20) {
+        case 'A': KW("AS", T_KEY_AS); KW("AND", T_KEY_AND); KW("ASC", T_KEY_ASC); break;
+        case 'B': KW("BY", T_KEY_BY); break;
+        case 'C': KW("CREATE", T_QRY_CREATE); break;
+        case 'D': KW("DELETE", T_QRY_DELETE); KW("DESC", T_KEY_DESC); break;
+        case 'E': KW("EXECUTE", T_QRY_EXECUTE); KW("EXPLAIN", T_QRY_EXPLAIN); break;
+        case 'F': KW("FROM", T_KEY_FROM); break;
+        case 'G': KW("GROUP", T_KEY_GROUP); break;
+        case 'I': KW("INSERT", T_QRY_INSERT); KW("INTO", T_KEY_INTO); KW("INDEX", T_KEY_INDEX); break;
+        case 'J': KW("JOIN", T_KEY_JOIN); break;
+        case 'L': KW("LIMIT", T_KEY_LIMIT); break;
+        case 'O': KW("ORDER", T_KEY_ORDER); KW("ON", T_KEY_ON); break;
+        case 'P': KW("PREPARE", T_QRY_PREPARE); break;
+        case 'S': KW("SELECT", T_QRY_SELECT); KW("SET", T_KEY_SET); break;
+        case 'T': KW("TABLE", T_KEY_TABLE); break;
+        case 'U': KW("UPDATE", T_QRY_UPDATE); break;
+        case 'V': KW("VALUES", T_KEY_VALUES); break;
+        case 'W': KW("WHERE", T_KEY_WHERE); break;
+        default: break;
+        }
+#undef KW
+        return T_RAW_VAR;
+    }
+
+    /* Exact powers of ten, a decimal with <= 15 significant digits divided by one
+       of these is correctly rounded */
+    static const double Pow10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
     };
-    
-    Tok GetNextToken() {
-        return CurrToken = GetToken();
+
+    static double DecodeFloat(std::string_view s, uint64_t mantissa, size_t digits, size_t frac)
+    {
+        if (digits <= 15 && frac < sizeof(Pow10) / sizeof(Pow10[0]))
+            return static_cast<double>(mantissa) / Pow10[frac];
+
+        // Slow path for long literals, strtod needs a terminated copy
+        char buf[128];
+        size_t len = std::min(s.size(), sizeof(buf) - 1);
+        memcpy(buf, s.data(), len);
+        buf[len] = 0;
+        return strtod(buf, nullptr);
+    }
+
+    void ParserContext::SetInput(std::string_view input)
+    {
+        LexerPos = input.data();
+        LexerEnd = input.data() + input.size();
+        CurrToken = T_NULL;
     }
 
-    void ClearTokenLineBuffer()
+    std::string_view ParserContext::LexerIdentifier() const
     {
-        while (CurrToken != asql::T_ENTER)
-            asql::GetNextToken();
-        
+        auto s = static_cast<char*>(arena->Allocate(LexerText.size(), 1));
+        for (size_t i = 0; i < LexerText.size(); ++i)
+            s[i] = IsAlpha(LexerText[i]) ? static_cast<char>(LexerText[i] & ~0x20) : LexerText[i];
+        return {s, LexerText.size()};
     }
 
-    Tok GetCurrentToken()
+    std::string_view ParserContext::RestOfLine()
     {
-        return CurrToken;
+        const char *start = LexerPos;
+        while (LexerPos < LexerEnd && *LexerPos != '\n' && *LexerPos != '\r')
+            ++LexerPos;
+        return std::string_view(start, LexerPos - start);
+    }
+
+    Tok ParserContext::GetNextToken() {
+        return CurrToken = GetToken();
+    }
+
+    void ParserContext::ClearTokenLineBuffer()
+    {
+        while (CurrToken != asql::T_NULL && CurrToken != asql::T_EOF)
+            GetNextToken();
+
     }
 
     /*
@@ -67,96 +126,118 @@ namespace asql
     * a string, an number (int/float), some sort of variable name, function name etc...
     * The parser is the one that figures out if it's valid SQL
     */
-    Tok GetToken() {
-        // Initialize with space to hit the isspace(...) and call getchar() initially
-        static int LastChar = ' ';
-        // Have to catch the newlines before they get eaten
-        if (LastChar == '\n' || LastChar == '\r') {
-            LastChar = ' ';
-            return T_ENTER;
+    Tok ParserContext::GetToken() {
+        const char *p = LexerPos;
+        const char *end = LexerEnd;
+
+        while (true) {
+            // strip out the initial whitespace.
+            while (p < end && IsSpace(*p))
+                ++p;
+
+            // Remove comments, until end of line.
+            if (p < end && *p == '#') {
+                while (p < end && *p != '\n' && *p != '\r')
+                    ++p;
+                continue;
+            }
+            break;
         }
-        
-        if (LastChar == ';') {
-            LastChar = ' ';
-            return T_NULL;
+
+        if (p == end) {
+            LexerPos = p;
+            return T_EOF;
         }
 
-        // strip out the initial whitespace.
-        while (isspace(LastChar))
-            LastChar = getchar();
+        const char *start = p;
 
         // Parse alphanumeric tokens
-        if (isalpha(LastChar)) {
-            char FirstChar = LastChar;
-            LexerString = ::toupper(FirstChar);
-
-            // TODO: Check for _
-            while ( isalnum((LastChar = getchar())) || LastChar == '_')
-                LexerString += ::toupper(LastChar);
+        if (IsAlpha(*p)) {
+            while (++p < end && IsIdent(*p))
+                ;
+            LexerPos = p;
+            LexerText = std::string_view(start, p - start);
 
             // check if its a keyword like SELECT etc...
-            auto keyword = LexerKeywords.find(LexerString);
-            if ( keyword != LexerKeywords.end() )
-                return static_cast<Tok>(keyword->second);
-
-            return T_RAW_VAR;
+            return LookupKeyword(LexerText);
         }
 
         // Parse string literals
-        if (LastChar == '"' || LastChar == '\'') {
-            int TermChar = LastChar;
-            LexerString.clear();
-            while ((LastChar = getchar()) != TermChar)
-                LexerString += LastChar;
-            
+        if (*p == '"' || *p == '\'') {
+            char TermChar = *p++;
+            const char *close = static_cast<const char*>(memchr(p, TermChar, end - p));
+            if (!close) {
+                Print("Unterminated string literal\n");
+                LexerPos = end;
+                return T_EOF;
+            }
+            LexerText = std::string_view(p, close - p);
+            LexerPos = close + 1;
             return T_RAW_STR;
         }
 
         // Parse numbers
-        if (isdigit(LastChar)) {
-            LexerString.clear();
-        
-            do {
-                LexerString += LastChar;
-                LastChar = getchar();
-            } while (isdigit(LastChar));
-
-            // If the token ends with 1 of these characters, assume its an int
-            if (isspace(LastChar) || LastChar == '+' || LastChar == '-' || LastChar == '/' || LastChar == '*' || LastChar == ';' || LastChar == ')' || LastChar == ',') {
-                LexerInteger = atoi(LexerString.c_str());
-                return T_RAW_INT;
+        if (IsDigit(*p)) {
+            uint64_t mantissa = 0;
+            size_t digits = 0;
+            // Integers past INT64_MAX are lexed as floats rather than wrapping
+            bool too_big = false;
+            for (; p < end && IsDigit(*p); ++p, ++digits) {
+                const auto d = static_cast<uint64_t>(*p - '0');
+                too_big |= mantissa > (static_cast<uint64_t>(INT64_MAX) - d) / 10;
+                mantissa = mantissa * 10 + d;
+            }
+
+            // Only valid option for a non int is a floating point (with 1 decimal point)
+            size_t frac = 0;
+            bool is_float = p < end && *p == '.';
+            if (is_float) {
+                for (++p; p < end && IsDigit(*p); ++p, ++frac, ++digits)
+                    mantissa = mantissa * 10 + static_cast<uint64_t>(*p - '0');
             }
 
-            // Only valid option from this point is a floating point (with 1 decimal point)
-            if (LastChar != '.') {
-                printf("Unknown token after '%s'\n", LexerString.c_str());
+            LexerText = std::string_view(start, p - start);
+            LexerPos = p;
+
+            if (p < end && (IsIdent(*p) || *p == '.')) {
+                Print("Unknown token after '%.*s'\n", static_cast<int>(LexerText.size()), LexerText.data());
                 return T_EOF;
             }
 
-            LexerFloat = strtof(LexerString.c_str(), 0);
-            return T_RAW_FLOAT;
+            if (is_float || too_big) {
+                LexerFloat = DecodeFloat(LexerText, mantissa, digits, frac);
+                return T_RAW_FLOAT;
+            }
+
+            LexerInteger = static_cast<int64_t>(mantissa);
+            return T_RAW_INT;
         }
 
-        // Remove comments
-        if (LastChar == '#') {
-            // Comment until end of line.
-            do
-                LastChar = getchar();
-            while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
-
-            // If theres more, keep parsing
-            if (LastChar != EOF)
-                return GetToken();
-            
-            return T_EOF;
+        // <=, >=, != and <>
+        if (p + 1 < end) {
+            Tok two = T_NULL;
+            if (p[1] == '=')
+                two = *p == '<' ? T_LESS_EQUAL : *p == '>' ? T_GREATER_EQUAL : *p == '!' ? T_NOT_EQUAL : T_NULL;
+            else if (*p == '<' && p[1] == '>')
+                two = T_NOT_EQUAL;
+
+            if (two != T_NULL) {
+                LexerPos = p + 2;
+                LexerText = std::string_view(start, 2);
+                return two;
+            }
         }
 
+        LexerPos = p + 1;
+        LexerText = std::string_view(start, 1);
+
+        // Statement terminator
+        if (*p == ';')
+            return T_NULL;
+
         // Otherwise, just return the character as its ascii value.
-        int PrevChar = LastChar;
-        LastChar = getchar();
-        return (Tok) PrevChar;
+        return (Tok) static_cast<unsigned char>(*p);
     }
 
-    
-}
 
+}
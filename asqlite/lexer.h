@@ -1,9 +1,14 @@
 #pragma once
 
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <cstdint>
 
 namespace asql {
 
+    class Arena;
+
     enum Tok {
         // SQL special chars
         T_COMMA       = ',',
@@ -12,6 +17,9 @@ namespace asql {
         T_SEMI_COLON  = ';',
         T_EQUALS      = '=',
         T_DOT         = '.',
+        T_PARAM       = '?',
+        T_LESS        = '<',
+        T_GREATER     = '>',
 
         // Only called at the end of the string or statement
         T_NULL        =  0,
@@ -24,6 +32,9 @@ namespace asql {
         T_QRY_UPDATE  = -5,
         T_QRY_INSERT  = -6,
         T_QRY_CREATE  = -7,
+        T_QRY_PREPARE = -8,
+        T_QRY_EXECUTE = -9,
+        T_QRY_EXPLAIN = -10,
 
         // Keywords        
         T_KEY_FROM    = -12,
@@ -38,28 +49,66 @@ namespace asql {
         T_KEY_ON      = -21,
         T_KEY_AS      = -22,
         T_KEY_TABLE   = -23,
+        T_KEY_SET     = -24,
+        T_KEY_INDEX   = -25,
+        T_KEY_AND     = -26,
+        T_KEY_ASC     = -27,
+        T_KEY_DESC    = -28,
 
         // Raw values or variables
         T_RAW_FLOAT   = -30,
         T_RAW_INT     = -31,
         T_RAW_STR     = -32,
         T_RAW_VAR     = -33,
+
+        // Two character comparisons
+        T_LESS_EQUAL    = -40,
+        T_GREATER_EQUAL = -41,
+        T_NOT_EQUAL     = -42,
     };
 
     /* Precendence for binary operations */
     extern std::unordered_map<char, int> LexerBinOpPrecedent;
-    /* SQL Keywords */
-    extern std::unordered_map<std::string, int> LexerKeywords;
-
-    /* The tokenized items */
-    extern std::string LexerString;
-    extern float       LexerFloat;
-    extern int         LexerInteger;
-
-    /* Token funtions */
-    extern Tok GetToken();
-    extern Tok GetNextToken();
-    extern Tok GetCurrentToken();
-    void       ClearTokenLineBuffer();
+
+    /*
+    * Lexer and parser state for one session. Contexts share nothing, so every
+    * thread can parse its own statements with its own context.
+    */
+    class ParserContext {
+    public:
+        /* Lex over [input.begin(), input.end()). The buffer has to outlive the tokens */
+        void SetInput(std::string_view input);
+
+        /* Token funtions */
+        Tok GetToken();
+        Tok GetNextToken();
+        Tok GetCurrentToken() const { return CurrToken; }
+        /* Skip the rest of the current statement */
+        void ClearTokenLineBuffer();
+
+        /* Raw text up to the end of the current line, used by '.' commands */
+        std::string_view RestOfLine();
+
+        /* Upper case copy of an identifier token, allocated from the statement arena */
+        std::string_view LexerIdentifier() const;
+
+        /* The tokenized items. LexerText is a span of the input buffer, for string
+           literals it excludes the quotes. Identifiers keep their original case */
+        std::string_view LexerText;
+        double           LexerFloat   = 0.0;
+        int64_t          LexerInteger = 0;
+
+        /* Arena of the statement being parsed and the number of '?' seen in it */
+        Arena *arena = nullptr;
+        int    ParamCount = 0;
+
+    private:
+        // Key for last tokenized item
+        Tok CurrToken = T_NULL;
+
+        // Input buffer and the read position inside it
+        const char *LexerPos = nullptr;
+        const char *LexerEnd = nullptr;
+    };
 
 }
\ No newline at end of file
@@ -1,33 +1,102 @@
 #include <iostream>
 #include <string>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
 
 #include "parser.h"
+#include "query.h"
 #include "database.h"
+#include "image.h"
+#include "server.h"
+#include "statement.h"
+#include "threadpool.h"
 
-/**
 
-        {"HOURS",
-            {{"EMP_ID",      CT_INT},
-             {"TIME_START",  CT_INT},
-             {"TIME_END",    CT_INT}}},
+int main(int argc, char **argv)
+{
+    const char *db_path = nullptr;
+    const char *image_path = nullptr;
+    const char *script = nullptr;
+    size_t cache_mb = 64;
+    size_t threads = 0;
+    asql::SyncMode sync = asql::SYNC_FULL;
+    bool serve = false;
+    asql::ServerOptions server;
 
-        {"EMPLOYEE_TYPE",
-            {{"EMP_TYPE_ID", CT_INT},
-             {"TYPE",        CT_STR}}},
-    };
-*/
+    // asql [--db file | --image file] [--cache-mb N] [--sync full|normal|off] [--threads N] [--work-mem-mb N] [script.sql]
+    //      [--serve [--socket path] [--port N] [--sessions N]]
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--serve"))
+            serve = true;
+        else if (!strcmp(argv[i], "--socket") && i + 1 < argc)
+            server.socket_path = argv[++i];
+        else if (!strcmp(argv[i], "--port") && i + 1 < argc)
+            server.port = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--sessions") && i + 1 < argc)
+            server.session_threads = strtoull(argv[++i], nullptr, 10);
+        else if (!strcmp(argv[i], "--db") && i + 1 < argc)
+            db_path = argv[++i];
+        else if (!strcmp(argv[i], "--image") && i + 1 < argc)
+            image_path = argv[++i];
+        else if (!strcmp(argv[i], "--cache-mb") && i + 1 < argc)
+            cache_mb = strtoull(argv[++i], nullptr, 10);
+        else if (!strcmp(argv[i], "--threads") && i + 1 < argc)
+            threads = strtoull(argv[++i], nullptr, 10);
+        else if (!strcmp(argv[i], "--work-mem-mb") && i + 1 < argc)
+            asql::WorkMemBytes = strtoull(argv[++i], nullptr, 10) << 20;
+        else if (!strcmp(argv[i], "--sync") && i + 1 < argc) {
+            if (!asql::ParseSyncMode(argv[++i], sync)) {
+                printf("Unknown sync mode '%s', expected full, normal or off\n", argv[i]);
+                return 1;
+            }
+        } else
+            script = argv[i];
+    }
 
+    if (db_path && image_path) {
+        printf("--db and --image can't be combined, an image is read-only\n");
+        return 1;
+    }
 
+    // The server takes shutdown signals through its event loop, before any thread could take them instead
+    if (serve)
+        asql::BlockShutdownSignals();
 
-int main()
-{
+    // Scans run on every core unless told otherwise
+    asql::SetThreadCount(threads);
+    asql::InitTables();
+    if (db_path && (!asql::OpenDatabase(db_path, cache_mb << 20, sync) || !asql::RecoverDatabase()))
+        return 1;
+    if (image_path && !asql::OpenImage(image_path))
+        return 1;
+
+    // Only seed a brand new database, an existing one keeps what was deleted from it
+    auto employees = asql::GetTable("EMPLOYEES");
+    if (!image_path && (!db_path || asql::DatabaseCreated()) && employees) {
+        employees->AppendRow({asql::Value::Int(0), asql::Value::Int(0), asql::Value::Str("Anu"), asql::Value::Float(140.f)});
+        employees->AppendRow({asql::Value::Int(1), asql::Value::Int(0), asql::Value::Str("Tak"), asql::Value::Float(180.f)});
+        employees->AppendRow({asql::Value::Int(2), asql::Value::Int(0), asql::Value::Str("Sav"), asql::Value::Float(120.f)});
+        employees->AppendRow({asql::Value::Int(3), asql::Value::Int(0), asql::Value::Str("Raj"), asql::Value::Float(160.f)});
+
+        // The seed rows aren't logged, make them part of the database before anything that is
+        if (db_path && !asql::Checkpoint())
+            return 1;
+    }
+
+    asql::Session session;
 
-    asql::insertEmployee({0, 0, "Anu", 140.f});
-    asql::insertEmployee({0, 0, "Tak", 180.f});
-    asql::insertEmployee({0, 0, "Sav", 120.f});
-    asql::insertEmployee({0, 0, "Raj", 160.f});
+    // A server without an address listens on a socket in the working directory
+    int ret = 0;
+    if (serve) {
+        if (server.socket_path.empty() && !server.port)
+            server.socket_path = "asql.sock";
+        ret = asql::Serve(server) ? 0 : 1;
+    } else if (script)
+        ret = asql::RunScript(session, script) < 0 ? 1 : 0;
+    else
+        asql::repl(session);
 
-    asql::repl();
-    return 0;
-}
\ No newline at end of file
+    asql::CloseDatabase();
+    return ret;
+}
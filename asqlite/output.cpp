@@ -0,0 +1,29 @@
+#include <cstdarg>
+
+#include "output.h"
+
+
+namespace asql {
+
+    static thread_local FILE *ThreadOutput = nullptr;
+
+    FILE* Output()
+    {
+        return ThreadOutput ? ThreadOutput : stdout;
+    }
+
+    void SetOutput(FILE *out)
+    {
+        ThreadOutput = out;
+    }
+
+    int Print(const char *format, ...)
+    {
+        va_list args;
+        va_start(args, format);
+        int n = vfprintf(Output(), format, args);
+        va_end(args);
+        return n;
+    }
+
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <cstdio>
+
+
+namespace asql {
+
+    /*
+    * Where the calling thread's result rows and messages go. stdout unless a
+    * server session pointed it at its connection. Tasks run on the thread
+    * pool print to the output of the thread that submitted them.
+    */
+    FILE* Output();
+    /* Redirect the calling thread, nullptr goes back to stdout */
+    void SetOutput(FILE *out);
+
+    /* printf to Output() */
+    int Print(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+}
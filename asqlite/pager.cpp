@@ -0,0 +1,260 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "pager.h"
+#include "output.h"
+
+
+namespace asql {
+
+    static const char FileMagic[8] = {'A', 'S', 'Q', 'L', 'i', 't', 'e', '3'};
+
+    /* Pager */
+
+    Pager::~Pager()
+    {
+        if (fd >= 0)
+            close(fd);
+    }
+
+    bool Pager::Open(const std::string &path)
+    {
+        fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            Print("Unable to open database '%s'\n", path.c_str());
+            return false;
+        }
+
+        // Held until the file is closed, two processes writing one database would corrupt it
+        if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+            Print("Database '%s' is open in another process\n", path.c_str());
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+            Print("Unable to stat database '%s'\n", path.c_str());
+            return false;
+        }
+
+        char page[PAGE_SIZE];
+
+        // Brand new file, write an empty header
+        if (st.st_size == 0) {
+            header = FileHeader{};
+            memcpy(header.magic, FileMagic, sizeof(FileMagic));
+            header.page_size = PAGE_SIZE;
+            header.page_count = 1;
+
+            memset(page, 0, sizeof(page));
+            memcpy(page, &header, sizeof(header));
+            created = true;
+            return WritePage(0, page);
+        }
+
+        if (!ReadPage(0, page))
+            return false;
+
+        memcpy(&header, page, sizeof(header));
+        if (memcmp(header.magic, FileMagic, sizeof(FileMagic)) != 0) {
+            Print("'%s' is not an ASQLite database\n", path.c_str());
+            return false;
+        }
+
+        if (header.page_size != PAGE_SIZE) {
+            Print("Database page size %u doesn't match the build's %zu\n", header.page_size, PAGE_SIZE);
+            return false;
+        }
+
+        return true;
+    }
+
+    bool Pager::ReadPage(PageId id, char *buf)
+    {
+        auto off = static_cast<off_t>(id) * static_cast<off_t>(PAGE_SIZE);
+        auto n = pread(fd, buf, PAGE_SIZE, off);
+        if (n < 0) {
+            Print("Failed to read page %u\n", id);
+            return false;
+        }
+
+        // Pages past the end of the file were allocated but never written
+        if (static_cast<size_t>(n) < PAGE_SIZE)
+            memset(buf + n, 0, PAGE_SIZE - static_cast<size_t>(n));
+        return true;
+    }
+
+    bool Pager::WritePage(PageId id, const char *buf)
+    {
+        auto off = static_cast<off_t>(id) * static_cast<off_t>(PAGE_SIZE);
+        if (pwrite(fd, buf, PAGE_SIZE, off) != static_cast<ssize_t>(PAGE_SIZE)) {
+            Print("Failed to write page %u\n", id);
+            return false;
+        }
+        return true;
+    }
+
+    bool Pager::Sync()
+    {
+        return fsync(fd) == 0;
+    }
+
+    Extent Pager::Allocate(uint32_t count)
+    {
+        for (size_t i = 0; i < free_extents.size(); ++i) {
+            auto &f = free_extents[i];
+            if (f.count < count)
+                continue;
+
+            Extent e{f.first, count};
+            f.first += count;
+            f.count -= count;
+            if (!f.count)
+                free_extents.erase(free_extents.begin() + static_cast<long>(i));
+            return e;
+        }
+
+        Extent e{header.page_count, count};
+        header.page_count += count;
+        return e;
+    }
+
+    void Pager::Free(Extent extent)
+    {
+        if (extent.count)
+            pending_free.push_back(extent);
+    }
+
+    void Pager::CommitFrees()
+    {
+        free_extents.insert(free_extents.end(), pending_free.begin(), pending_free.end());
+        pending_free.clear();
+    }
+
+    /* Buffer pool */
+
+    BufferPool::BufferPool(Pager &pager, size_t budget_bytes):
+        pager{pager}
+    {
+        // Scans pin a page at a time, but keep a handful of frames whatever the budget
+        size_t count = std::max<size_t>(budget_bytes / PAGE_SIZE, 8);
+        memory.reset(new char[count * PAGE_SIZE]);
+        frames.resize(count);
+        for (size_t i = 0; i < count; ++i)
+            frames[i].data = memory.get() + i * PAGE_SIZE;
+    }
+
+    BufferPool::~BufferPool()
+    {
+        Flush();
+    }
+
+    BufferPool::Frame* BufferPool::Victim()
+    {
+        // Two sweeps: the first clears reference bits, the second finds them cleared
+        for (size_t n = 0; n < frames.size() * 2; ++n) {
+            auto &f = frames[clock_hand];
+            clock_hand = (clock_hand + 1) % frames.size();
+
+            if (!f.used)
+                return &f;
+            if (f.pin_count)
+                continue;
+            if (f.referenced) {
+                f.referenced = false;
+                continue;
+            }
+
+            if (f.dirty && !pager.WritePage(f.id, f.data))
+                continue;
+
+            page_table.erase(f.id);
+            f.used = false;
+            f.dirty = false;
+            evictions++;
+            return &f;
+        }
+        return nullptr;
+    }
+
+    char* BufferPool::Pin(PageId id, bool read)
+    {
+        std::lock_guard<std::mutex> guard{lock};
+
+        if (auto f = page_table.find(id); f != page_table.end()) {
+            auto &frame = frames[f->second];
+            frame.pin_count++;
+            frame.referenced = true;
+            hits++;
+            if (!read)
+                memset(frame.data, 0, PAGE_SIZE);
+            return frame.data;
+        }
+
+        misses++;
+        auto frame = Victim();
+        if (!frame) {
+            Print("Buffer pool exhausted, all %zu frames are pinned\n", frames.size());
+            return nullptr;
+        }
+
+        if (read) {
+            if (!pager.ReadPage(id, frame->data))
+                return nullptr;
+        } else {
+            memset(frame->data, 0, PAGE_SIZE);
+        }
+
+        frame->id = id;
+        frame->used = true;
+        frame->dirty = !read;
+        frame->referenced = true;
+        frame->pin_count = 1;
+        page_table[id] = static_cast<size_t>(frame - frames.data());
+        return frame->data;
+    }
+
+    char* BufferPool::Fetch(PageId id)
+    {
+        return Pin(id, true);
+    }
+
+    char* BufferPool::Create(PageId id)
+    {
+        return Pin(id, false);
+    }
+
+    void BufferPool::Unpin(PageId id, bool dirty)
+    {
+        std::lock_guard<std::mutex> guard{lock};
+        auto f = page_table.find(id);
+        if (f == page_table.end())
+            return;
+
+        auto &frame = frames[f->second];
+        if (frame.pin_count)
+            frame.pin_count--;
+        frame.dirty |= dirty;
+    }
+
+    bool BufferPool::Flush()
+    {
+        std::lock_guard<std::mutex> guard{lock};
+        bool ok = true;
+        for (auto &f : frames) {
+            if (!f.used || !f.dirty)
+                continue;
+            if (pager.WritePage(f.id, f.data))
+                f.dirty = false;
+            else
+                ok = false;
+        }
+        return ok;
+    }
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+namespace asql {
+
+    /* Every read and write of the database file is a whole page */
+    constexpr size_t PAGE_SIZE = 4096;
+
+    using PageId = uint32_t;
+
+    /* A run of consecutive pages in the database file */
+    struct Extent {
+        PageId first = 0;
+        uint32_t count = 0;
+    };
+
+
+    /*
+    * Page 0 of the database file. The catalog (schemas, row group extents and
+    * free space) is written as one extent whenever the database is checkpointed,
+    * checkpoint_lsn is the last write-ahead log record it includes.
+    */
+    struct FileHeader {
+        char magic[8];
+        uint32_t page_size;
+        uint32_t page_count;
+        Extent catalog;
+        uint64_t checkpoint_lsn;
+    };
+
+
+    /* Raw page I/O on the database file */
+    class Pager {
+    public:
+        ~Pager();
+
+        bool Open(const std::string &path);
+        bool ReadPage(PageId id, char *buf);
+        bool WritePage(PageId id, const char *buf);
+        bool Sync();
+
+        /* Carve out count pages, reusing freed extents first */
+        Extent Allocate(uint32_t count);
+        /* Freed pages are still referenced by the last checkpoint, they become
+           reusable once CommitFrees() is called after the next one */
+        void Free(Extent extent);
+        void CommitFrees();
+
+        FileHeader header;
+        // Open() found no file, or an empty one, and wrote a fresh header
+        bool created = false;
+        std::vector<Extent> free_extents;
+        std::vector<Extent> pending_free;
+
+    private:
+        int fd = -1;
+    };
+
+
+    /*
+    * Fixed size cache of pages in front of the Pager. Pages are pinned while in
+    * use and only unpinned frames can be evicted, picked by the clock algorithm.
+    */
+    class BufferPool {
+    public:
+        BufferPool(Pager &pager, size_t budget_bytes);
+        ~BufferPool();
+
+        /* Pin a page, reading it from disk if it isn't cached. nullptr if every frame is pinned */
+        char* Fetch(PageId id);
+        /* Pin a zeroed frame for a freshly allocated page without reading it */
+        char* Create(PageId id);
+        void Unpin(PageId id, bool dirty);
+
+        /* Write back every dirty page */
+        bool Flush();
+
+        size_t FrameCount() const { return frames.size(); }
+        // Counted under lock, read by .stats from any session
+        std::atomic<size_t> hits{0};
+        std::atomic<size_t> misses{0};
+        std::atomic<size_t> evictions{0};
+
+    private:
+        struct Frame {
+            PageId id = 0;
+            bool used = false;
+            bool dirty = false;
+            bool referenced = false;
+            int pin_count = 0;
+            char *data = nullptr;
+        };
+
+        Frame* Victim();
+        char* Pin(PageId id, bool read);
+
+        Pager &pager;
+        std::mutex lock;
+        std::unique_ptr<char[]> memory;
+        std::vector<Frame> frames;
+        std::unordered_map<PageId, size_t> page_table;
+        size_t clock_hand = 0;
+    };
+
+}
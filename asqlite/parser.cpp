@@ -1,9 +1,18 @@
 #include <memory>
 #include <string>
+#include <cstdio>
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "parser.h"
 #include "lexer.h"
 #include "query.h"
+#include "statement.h"
+#include "output.h"
 
 
 namespace asql {
@@ -12,18 +21,35 @@ namespace asql {
 
     std::string FunctionExpr::GetAlias() const {
         if (alias.size())
-            return alias;
+            return std::string(alias);
 
-        std::string genName = name + "(";
-        for (const auto &a : args)
-            genName += a.GetAlias();
+        std::string genName = std::string(name) + "(";
+        for (const auto a : args)
+            genName += a->GetAlias();
         return genName + ")";
     }
 
 
+    std::string AggregateExpr::GetAlias() const {
+        // COUNT(*) has no argument
+        if (alias.empty() && args.empty())
+            return std::string(name) + "(*)";
+        return FunctionExpr::GetAlias();
+    }
+
+    std::vector<VariableExpr*> AggregateExpr::GetVariables()
+    {
+        std::vector<VariableExpr*> vars;
+        for (auto a : args) {
+            auto v = a->GetVariables();
+            vars.insert(vars.end(), v.begin(), v.end());
+        }
+        return vars;
+    }
+
     std::string BinaryExpr::GetAlias() const {
         if (alias.size())
-            return alias;
+            return std::string(alias);
 
         std::string opStr {static_cast<char>(op)};
         return "(" + lhs->GetAlias() + opStr + rhs->GetAlias() + ")";
@@ -43,7 +69,14 @@ namespace asql {
         return 0;
     }
 
-    std::vector<const Expr*> BinaryExpr::GetVariables() const
+    void BinaryExpr::EvalBatch(const Batch &batch, Vector &out) const {
+        Vector l, r;
+        lhs->EvalBatch(batch, l);
+        rhs->EvalBatch(batch, r);
+        ArithBatch(op, l, r, batch.count, out);
+    }
+
+    std::vector<VariableExpr*> BinaryExpr::GetVariables()
     {
         auto lv = lhs->GetVariables();
         auto rv = rhs->GetVariables();
@@ -51,51 +84,51 @@ namespace asql {
         return lv;
     }
     
-    static int GetTokPrecedence() {
-        if (auto f = LexerBinOpPrecedent.find(GetCurrentToken()); f != LexerBinOpPrecedent.end())
+    static int GetTokPrecedence(ParserContext &ctx) {
+        if (auto f = LexerBinOpPrecedent.find(ctx.GetCurrentToken()); f != LexerBinOpPrecedent.end())
             return f->second;
         return -1;
     }
 
     /* Parsing Functions */
-    static std::unique_ptr<Expr> ParsePrimaryExpr();
-    static std::unique_ptr<Expr> ParseExpr();
+    static Expr* ParsePrimaryExpr(ParserContext &ctx);
+    static Expr* ParseExpr(ParserContext &ctx);
 
 
-    static std::unique_ptr<Expr> ParseParenExpr()
+    static Expr* ParseParenExpr(ParserContext &ctx)
     {
         // eat the  opening parenthesis i.e (
-        GetNextToken();
+        ctx.GetNextToken();
 
         // Parse some arbitrarily long expression
-        auto e = ParseExpr();
+        auto e = ParseExpr(ctx);
         if (!e)
             return nullptr;
 
-        if (GetCurrentToken() != T_CLOSE_PAREN) {
+        if (ctx.GetCurrentToken() != T_CLOSE_PAREN) {
             // Log an error
             return nullptr;
         }
 
         // eat the closing parenthesis
-        GetNextToken();
+        ctx.GetNextToken();
         return e;
 
     }
 
-    static std::unique_ptr<Expr> ParseBinOpenRHS(int MinTokPrec, std::unique_ptr<Expr> lhs)
+    static Expr* ParseBinOpenRHS(ParserContext &ctx, int MinTokPrec, Expr *lhs)
     {
         while (true) {
-            int CurrTokPrec = GetTokPrecedence();
+            int CurrTokPrec = GetTokPrecedence(ctx);
         
             // Next operator has lower or similar precedence as previous operator
             if (CurrTokPrec <= MinTokPrec)
                 return lhs;
 
             // save the operator and advance to the next token
-            int binOp = GetCurrentToken();
-            GetNextToken();
-            auto rhs = ParsePrimaryExpr();
+            int binOp = ctx.GetCurrentToken();
+            ctx.GetNextToken();
+            auto rhs = ParsePrimaryExpr(ctx);
             
             if (!rhs)
                 return nullptr;
@@ -103,123 +136,263 @@ namespace asql {
             // Check whether the next operator has higher precendence
             // ParseExpr() would have already advanced to the next token
             // If so merge those 2 expressions into a single expression
-            int NextTokPrec = GetTokPrecedence();
+            int NextTokPrec = GetTokPrecedence(ctx);
             if (CurrTokPrec < NextTokPrec) {
-                rhs = ParseBinOpenRHS(CurrTokPrec, std::move(rhs));
+                rhs = ParseBinOpenRHS(ctx, CurrTokPrec, rhs);
                 if (!rhs)
                     return nullptr;
             }
 
-            lhs = std::make_unique<BinaryExpr>(binOp, std::move(lhs), std::move(rhs));
+            lhs = ctx.arena->New<BinaryExpr>(binOp, lhs, rhs);
         }
         
     }
 
-    static std::unique_ptr<FloatExpr> ParseFloat()
+    static FloatExpr* ParseFloat(ParserContext &ctx)
+    {
+        auto e = ctx.arena->New<FloatExpr>(ctx.LexerFloat, ctx.arena->CopyString(ctx.LexerText));
+        ctx.GetNextToken();
+        return e;
+    }
+
+    static IntExpr* ParseInt(ParserContext &ctx)
     {
-        auto e = std::make_unique<FloatExpr>(LexerFloat, LexerString);
-        GetNextToken();
+        auto e = ctx.arena->New<IntExpr>(ctx.LexerInteger, ctx.arena->CopyString(ctx.LexerText));
+        ctx.GetNextToken();
         return e;
     }
 
-    static std::unique_ptr<IntExpr> ParseInt()
+    static StringExpr* ParseStr(ParserContext &ctx)
     {
-        auto e = std::make_unique<IntExpr>(LexerInteger, LexerString);
-        GetNextToken();
+        auto e = ctx.arena->New<StringExpr>(ctx.arena->CopyString(ctx.LexerText));
+        ctx.GetNextToken();
         return e;
     }
 
-    static std::unique_ptr<StringExpr> ParseStr()
+    static ParamExpr* ParseParam(ParserContext &ctx)
     {
-        auto e = std::make_unique<StringExpr>(LexerString);
-        GetNextToken();
+        auto e = ctx.arena->New<ParamExpr>(ctx.ParamCount++);
+        ctx.GetNextToken();
         return e;
     }
 
-    static std::unique_ptr<Expr> ParseIdentifier()
+    static bool LookupAggregate(std::string_view name, AggregateKind &kind)
+    {
+        if (name == "COUNT")    kind = AGG_COUNT;
+        else if (name == "SUM") kind = AGG_SUM;
+        else if (name == "MIN") kind = AGG_MIN;
+        else if (name == "MAX") kind = AGG_MAX;
+        else if (name == "AVG") kind = AGG_AVG;
+        else return false;
+        return true;
+    }
+
+    /* name(expr) or COUNT(*), the current token is the opening parenthesis */
+    static Expr* ParseFunction(ParserContext &ctx, std::string_view name)
+    {
+        AggregateKind kind;
+        if (!LookupAggregate(name, kind)) {
+            Print("Unknown function %.*s\n", static_cast<int>(name.size()), name.data());
+            return nullptr;
+        }
+
+        auto f = ctx.arena->New<AggregateExpr>(name, kind, *ctx.arena);
+        if (ctx.GetNextToken() == '*' && kind == AGG_COUNT) {
+            ctx.GetNextToken();
+        } else {
+            auto arg = ParseExpr(ctx);
+            if (!arg) {
+                Print("Invalid argument to %.*s\n", static_cast<int>(name.size()), name.data());
+                return nullptr;
+            }
+            f->args.push_back(arg);
+        }
+
+        if (ctx.GetCurrentToken() != T_CLOSE_PAREN) {
+            Print("Expected ')' after the argument to %.*s\n", static_cast<int>(name.size()), name.data());
+            return nullptr;
+        }
+        ctx.GetNextToken();
+        return f;
+    }
+
+    static Expr* ParseIdentifier(ParserContext &ctx)
     {
-        auto first = LexerString;
+        auto first = ctx.LexerIdentifier();
 
         // Look for an expression with a qualifier e.g select a.x from a
-        auto token = GetNextToken();
+        auto token = ctx.GetNextToken();
+        if (token == T_OPEN_PAREN)
+            return ParseFunction(ctx, first);
         if (token != T_DOT)
-            return std::make_unique<VariableExpr>(first);
+            return ctx.arena->New<VariableExpr>(first);
 
         // Token after HAS to be a variable name
         // e.g 'select a.1 from a' is invalid
-        if (GetNextToken() != T_RAW_VAR) {
-            printf("Invalid expression after %s. Expected column name\n", first.c_str());
+        if (ctx.GetNextToken() != T_RAW_VAR) {
+            Print("Invalid expression after %.*s. Expected column name\n", static_cast<int>(first.size()), first.data());
             return nullptr;
         }
-        auto f = std::make_unique<VariableExpr>(LexerString);
+        auto f = ctx.arena->New<VariableExpr>(ctx.LexerIdentifier());
         f->qualifier = first;
-        GetNextToken();
+        ctx.GetNextToken();
         return f;
     }
 
 
-    static std::unique_ptr<Expr> ParsePrimaryExpr()
+    static Expr* ParsePrimaryExpr(ParserContext &ctx)
     {
-        switch(GetCurrentToken())
+        switch(ctx.GetCurrentToken())
         {
             case T_OPEN_PAREN:
-                return ParseParenExpr();
+                return ParseParenExpr(ctx);
             case T_RAW_FLOAT:
-                return ParseFloat();
+                return ParseFloat(ctx);
             case T_RAW_VAR:
-                return ParseIdentifier();
+                return ParseIdentifier(ctx);
             case T_RAW_INT:
-                return ParseInt();
+                return ParseInt(ctx);
             case T_RAW_STR:
-                return ParseStr();
+                return ParseStr(ctx);
+            case T_PARAM:
+                return ParseParam(ctx);
             default:
                 return nullptr;
         }
     }
 
-    static std::unique_ptr<Expr> ParseExpr()
+    static Expr* ParseExpr(ParserContext &ctx)
     {
-        auto e = ParsePrimaryExpr();
+        auto e = ParsePrimaryExpr(ctx);
         if (!e)
             return nullptr;
         // If its not a binary expression, it will just return e back to us
-        return ParseBinOpenRHS(0, std::move(e));
+        return ParseBinOpenRHS(ctx, 0, e);
+    }
+
+    static bool ParseComparison(Tok token, EqualityOp &op)
+    {
+        switch (token) {
+        case T_EQUALS:        op = EO_EQUALS;              return true;
+        case T_NOT_EQUAL:     op = EO_NOT_EQUAL;           return true;
+        case T_LESS:          op = EO_LESS_THAN;           return true;
+        case T_LESS_EQUAL:    op = EO_LESS_THAN_EQUAL;     return true;
+        case T_GREATER:       op = EO_GREATER_THAN;        return true;
+        case T_GREATER_EQUAL: op = EO_GREATER_THAN_EQUALS; return true;
+        default:              return false;
+        }
     }
 
-    static void ParseSelectQuery()
+    /*
+    * WHERE lhs op rhs [AND lhs op rhs ...], the current token is WHERE or ON.
+    * WHERE conditions can also be separated by ',', an ON clause ends at one
+    * since it may be followed by another FROM table.
+    */
+    static bool ParseConditions(ParserContext &ctx, ArenaVector<Filter> &filters, bool comma_separated)
     {
-        SelectQuery s;
+        const char *clause = ctx.GetCurrentToken() == T_KEY_ON ? "ON" : "WHERE";
+
+        while ( true ) {
+
+            ctx.GetNextToken();
+            auto lhs = ParseExpr(ctx);
+            if (!lhs) {
+                Print("Failed to parse %s clause expression\n", clause);
+                return false;
+            }
+
+            EqualityOp op;
+            if (!ParseComparison(ctx.GetCurrentToken(), op)) {
+                Print("Invalid %s clause expression\n", clause);
+                return false;
+            }
+
+            ctx.GetNextToken();
+            auto rhs = ParseExpr(ctx);
+            if (!rhs) {
+                Print("Failed to parse %s clause expression\n", clause);
+                return false;
+            }
+
+            filters.emplace_back(Filter{lhs, rhs, op});
+
+            auto token = ctx.GetCurrentToken();
+            if (token != T_KEY_AND && !(comma_separated && token == T_COMMA))
+                return true;
+        }
+    }
+
+    /* table [[AS] alias], the current token is the table name. Leaves the token after it current */
+    static bool ParseTable(ParserContext &ctx, ArenaVector<Table> &tables)
+    {
+        // TODO: Support raw tuples as tables?
+        if (ctx.GetCurrentToken() != T_RAW_VAR) {
+            Print("Invalid table name in FROM clause\n");
+            return false;
+        }
+
+        Table t{ctx.LexerIdentifier()};
+        // Retrieve alias if available
+        auto token = ctx.GetNextToken();
+        switch(token) {
+        case T_KEY_AS:
+            token = ctx.GetNextToken();
+            // Allow the fallthrough if the if fails
+            if (token != T_RAW_STR && token != T_RAW_VAR) {
+                Print("Unknown token after 'AS' in FROM clause: %d\n", token);
+                return false;
+            }
+        case T_RAW_STR:
+        case T_RAW_VAR:
+            t.alias = token == T_RAW_VAR ? ctx.LexerIdentifier() : ctx.arena->CopyString(ctx.LexerText);
+            ctx.GetNextToken();
+            break;
+        default:
+            break;
+        }
+
+        tables.push_back(t);
+        return true;
+    }
+
+    std::unique_ptr<SelectQuery> ParseSelectQuery(ParserContext &ctx)
+    {
+        // Every node of the statement is allocated from the query's arena
+        auto query = std::make_unique<SelectQuery>();
+        auto &s = *query;
+        ctx.arena = &s.arena;
+        ctx.ParamCount = 0;
         Tok token;
 
         /* Parse the output arguments */
         while ( true ) {
              
             // advance to the next expression and save a copy
-            GetNextToken();
-            auto e = ParseExpr();
+            ctx.GetNextToken();
+            auto e = ParseExpr(ctx);
             if (!e)
-                return;
+                return nullptr;
 
             // Parse the alias if there is one
-            token = GetCurrentToken();
+            token = ctx.GetCurrentToken();
             switch(token) {
             case T_KEY_AS:
-                token = GetNextToken();
+                token = ctx.GetNextToken();
                 // fallthrough to STR/VAR if alias is found
                 if (token != T_RAW_STR && token != T_RAW_VAR) {
-                    printf("Unknown token after 'AS' in SELECT clause: %d\n", token);
-                    return;
+                    Print("Unknown token after 'AS' in SELECT clause: %d\n", token);
+                    return nullptr;
                 }
             case T_RAW_STR:
             case T_RAW_VAR:
-                e->alias = LexerString;
-                token = GetNextToken();
+                e->alias = token == T_RAW_VAR ? ctx.LexerIdentifier() : ctx.arena->CopyString(ctx.LexerText);
+                token = ctx.GetNextToken();
             default:
                 break;
             }
 
             // Append the output variable
-            s.columns.push_back(std::move(e));
+            s.columns.push_back(e);
 
             // Parse another output arg or move onto the table
             if (token != T_COMMA)
@@ -227,134 +400,302 @@ namespace asql {
         }
 
         /* Parse the Table information if provided */
-        if (GetCurrentToken() == T_KEY_FROM) {
-            // Get list of tables to cross-join
-            while ( true ) {
-                token = GetNextToken();
-
-                // TODO: Support raw tuples as tables?
-                if (token != T_RAW_VAR) {
-                    printf("Invalid table name in FROM clause\n");
-                    return;
-                }
+        if (ctx.GetCurrentToken() == T_KEY_FROM) {
+            // Tables are joined on the ON and WHERE conditions, any table without one is cross-joined
+            ctx.GetNextToken();
+            if (!ParseTable(ctx, s.tables))
+                return nullptr;
 
-                Table t{LexerString};
-                // Retrieve alias if available
-                token = GetNextToken();
-                switch(token) {
-                case T_KEY_AS:
-                    token = GetNextToken();
-                    // Allow the fallthrough if the if fails
-                    if (token != T_RAW_STR && token != T_RAW_VAR) {
-                        printf("Unknown token after 'AS' in FROM clause: %d\n", token);
-                        return;
+            while ( true ) {
+                token = ctx.GetCurrentToken();
+                if (token == T_COMMA) {
+                    ctx.GetNextToken();
+                    if (!ParseTable(ctx, s.tables))
+                        return nullptr;
+                } else if (token == T_KEY_JOIN) {
+                    ctx.GetNextToken();
+                    if (!ParseTable(ctx, s.tables))
+                        return nullptr;
+
+                    // Inner joins only, the ON conditions filter like WHERE ones
+                    if (ctx.GetCurrentToken() != T_KEY_ON) {
+                        Print("Expected ON after JOIN table\n");
+                        return nullptr;
                     }
-                case T_RAW_STR:
-                case T_RAW_VAR:
-                    t.alias = LexerString;
-                    token = GetNextToken();
-                    break;
-                default:
+                    if (!ParseConditions(ctx, s.filters, false))
+                        return nullptr;
+                } else {
                     break;
                 }
-
-                // Parse another table or move on
-                s.tables.push_back(t);
-                if (token != T_COMMA)
-                    break;
             }
         }
 
         /* Parse where clause */
-        if (token == T_KEY_WHERE) {
-            while ( true ) {
+        if (token == T_KEY_WHERE && !ParseConditions(ctx, s.filters, true))
+            return nullptr;
 
-                token = GetNextToken();
-                auto lhs = ParseExpr();
-                if (!lhs) {
-                    printf("Failed to parse WHERE clause expression\n");
-                    return;
+        /* Group clause */
+        if (ctx.GetCurrentToken() == T_KEY_GROUP) {
+            if (ctx.GetNextToken() != T_KEY_BY) {
+                Print("Expected BY after GROUP\n");
+                return nullptr;
+            }
+
+            do {
+                ctx.GetNextToken();
+                auto e = ParseExpr(ctx);
+                if (!e) {
+                    Print("Failed to parse GROUP BY expression\n");
+                    return nullptr;
                 }
+                s.group_by.push_back(e);
+            } while (ctx.GetCurrentToken() == T_COMMA);
+        }
 
-                token = GetCurrentToken();
-                // TODO: Support other operators e.g '!='
-                if (token != T_EQUALS) {
-                    printf("Invalid WHERE clause expression");
-                    return;
+        /* Order clause */
+        if (ctx.GetCurrentToken() == T_KEY_ORDER) {
+            if (ctx.GetNextToken() != T_KEY_BY) {
+                Print("Expected BY after ORDER\n");
+                return nullptr;
+            }
+
+            do {
+                ctx.GetNextToken();
+                auto e = ParseExpr(ctx);
+                if (!e) {
+                    Print("Failed to parse ORDER BY expression\n");
+                    return nullptr;
                 }
 
-                token = GetNextToken();
-                auto rhs = ParseExpr();
-                if (!rhs) {
-                    printf("Failed to parse WHERE clause expression\n");
-                    return;
+                OrderKey key{e};
+                token = ctx.GetCurrentToken();
+                if (token == T_KEY_ASC || token == T_KEY_DESC) {
+                    key.desc = token == T_KEY_DESC;
+                    ctx.GetNextToken();
                 }
+                s.order_by.push_back(key);
+            } while (ctx.GetCurrentToken() == T_COMMA);
+        }
+
+        /* Limit clause */
+        if (ctx.GetCurrentToken() == T_KEY_LIMIT) {
+            token = ctx.GetNextToken();
+            if (token != T_RAW_INT) {
+                Print("Invalid token in LIMIT clause\n");
+                return nullptr;
+            }
+            // TODO: make a generic evaluatable expression
+            auto l = ParseInt(ctx);
+            s.limit = static_cast<int>(l->number);
+        }
 
-                s.filters.emplace_back(Filter{std::move(lhs), std::move(rhs), EO_EQUALS});
+        s.param_count = ctx.ParamCount;
+        return query;
+    }
 
-                if (GetCurrentToken() != T_COMMA) {
-                    break;
-                }
+    std::unique_ptr<ModifyQuery> ParseModifyQuery(ParserContext &ctx)
+    {
+        auto query = std::make_unique<ModifyQuery>();
+        auto &s = query->select;
+        ctx.arena = &s.arena;
+        ctx.ParamCount = 0;
+        query->is_delete = ctx.GetCurrentToken() == T_QRY_DELETE;
+
+        // UPDATE table SET ... or DELETE FROM table
+        if (query->is_delete && ctx.GetNextToken() != T_KEY_FROM) {
+            Print("Expected FROM after DELETE\n");
+            return nullptr;
+        }
+
+        if (ctx.GetNextToken() != T_RAW_VAR) {
+            Print("Invalid table name in %s statement\n", query->is_delete ? "DELETE" : "UPDATE");
+            return nullptr;
+        }
+        s.tables.push_back(Table{ctx.LexerIdentifier()});
+        auto token = ctx.GetNextToken();
+
+        /* Parse the SET assignments */
+        if (!query->is_delete) {
+            if (token != T_KEY_SET) {
+                Print("Expected SET after UPDATE table\n");
+                return nullptr;
             }
+
+            do {
+                if (ctx.GetNextToken() != T_RAW_VAR) {
+                    Print("Expected a column name in SET clause\n");
+                    return nullptr;
+                }
+                auto column = ctx.LexerIdentifier();
+
+                if (ctx.GetNextToken() != T_EQUALS) {
+                    Print("Expected '=' after column name in SET clause\n");
+                    return nullptr;
+                }
+
+                ctx.GetNextToken();
+                auto e = ParseExpr(ctx);
+                if (!e)
+                    return nullptr;
+
+                query->target_names.push_back(column);
+                s.columns.push_back(e);
+            } while (ctx.GetCurrentToken() == T_COMMA);
+            token = ctx.GetCurrentToken();
         }
 
-        /* Order clause */
+        /* Parse where clause */
+        if (token == T_KEY_WHERE && !ParseConditions(ctx, s.filters, true))
+            return nullptr;
 
-        /* Group clause */
+        // Logged statements are replayed as text, so their values have to be literals
+        if (ctx.ParamCount) {
+            Print("Parameters aren't supported in UPDATE and DELETE\n");
+            return nullptr;
+        }
+        return query;
+    }
 
-        /* Limit clause */
-        if (GetCurrentToken() == T_KEY_LIMIT) {
-            token = GetNextToken();
-            if (token != T_RAW_INT) {
-                printf("Invalid token in LIMIT clause\n");
+    /* Parse and run every statement in the current lexer input */
+    static void RunInput(Session &session)
+    {
+        auto &ctx = session.ctx;
+
+        while ( true ) {
+            auto token = ctx.GetNextToken();
+
+            switch (token)
+            {
+            case asql::T_EOF:
                 return;
+            // empty statement
+            case asql::T_NULL:
+            case asql::T_ENTER:
+                break;
+
+            case asql::T_QRY_SELECT:
+                RunSelect(session);
+                ctx.ClearTokenLineBuffer();
+                break;
+
+            case asql::T_QRY_PREPARE:
+                RunPrepare(session);
+                ctx.ClearTokenLineBuffer();
+                break;
+
+            case asql::T_QRY_EXECUTE:
+                RunExecute(session);
+                ctx.ClearTokenLineBuffer();
+                break;
+
+            case asql::T_QRY_EXPLAIN:
+                RunExplain(session);
+                ctx.ClearTokenLineBuffer();
+                break;
+
+            // '.' commands run to the end of the line
+            case asql::T_DOT:
+                RunMetaCommand(session, ctx.RestOfLine());
+                break;
+
+            case asql::T_QRY_INSERT:
+                RunInsert(session);
+                ctx.ClearTokenLineBuffer();
+                break;
+
+            case asql::T_QRY_DELETE:
+            case asql::T_QRY_UPDATE:
+                RunModify(session);
+                ctx.ClearTokenLineBuffer();
+                break;
+
+            case asql::T_QRY_CREATE:
+                RunCreate(session);
+                ctx.ClearTokenLineBuffer();
+                break;
+
+            default:
+                Print("Malformed SQL query. Only basic SELECT, CREATE, INSERT, UPDATE and DELETE supported\n");
+                Print("Token: %d, var: %.*s\n", token, static_cast<int>(ctx.LexerText.size()), ctx.LexerText.data());
+                ctx.ClearTokenLineBuffer();
+                break;
             }
-            // TODO: make a generic evaluatable expression
-            auto l = ParseInt();
-            s.limit = l->number;
         }
+    }
 
-        s.Validate();
-
+    /* A statement is complete once the input ends with ';'. Blank, comment and '.' command lines are complete too */
+    static bool StatementComplete(const std::string &input)
+    {
+        auto first = input.find_first_not_of(" \t\r\n");
+        if (first == std::string::npos || input[first] == '#' || input[first] == '.')
+            return true;
+        return input[input.find_last_not_of(" \t\r\n")] == ';';
     }
 
-int repl()
+int repl(Session &session)
 {
- 
+    std::string input;
+    char *line = nullptr;
+    size_t cap = 0;
+
     while ( true ) {
-        auto token = GetCurrentToken();
-        if (token == T_ENTER || token == T_NULL) printf("ASQL> ");
-        token = asql::GetNextToken();
+        printf(input.empty() ? "ASQL> " : "  ...> ");
+        fflush(stdout);
 
-        switch (token)
-        {
-        case asql::T_EOF:
+        // Read a whole line at a time, the lexer then works over the buffered statement
+        auto len = getline(&line, &cap, stdin);
+        if (len < 0) {
+            free(line);
             return -1;
-        // wait around for next input
-        case asql::T_NULL:
-        case asql::T_ENTER:
-            break;
+        }
 
-        case asql::T_QRY_SELECT:
-            asql::ParseSelectQuery();
-            //asql::ClearTokenLineBuffer();
-            break;
+        input.append(line, static_cast<size_t>(len));
+        if (!StatementComplete(input))
+            continue;
 
-        case asql::T_QRY_INSERT:
-        case asql::T_QRY_DELETE:
-        case asql::T_QRY_UPDATE:
-        case asql::T_QRY_CREATE:
-            printf("Query Under Construction. Come back later\n");
-            break;
-        
-        default:
-            printf("Malformed SQL query. Only basic SELECT, CREATE, INSERT, UPDATE and DELETE supported\n");
-            printf("Token: %d, var: %s\n", token, asql::LexerString.c_str());
-            asql::ClearTokenLineBuffer();
-            break;
-        }
+        session.ctx.SetInput(input);
+        RunInput(session);
+        input.clear();
     }
 
 }
 
-}
\ No newline at end of file
+void RunStatements(Session &session, std::string_view sql)
+{
+    session.ctx.SetInput(sql);
+    RunInput(session);
+}
+
+int RunScript(Session &session, const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        Print("Unable to open script '%s'\n", path);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        Print("Unable to stat script '%s'\n", path);
+        return -1;
+    }
+
+    // Lex straight out of the page cache, no copy of the script is made
+    size_t size = static_cast<size_t>(st.st_size);
+    void *data = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+    close(fd);
+    if (data == MAP_FAILED) {
+        Print("Unable to map script '%s'\n", path);
+        return -1;
+    }
+
+    session.ctx.SetInput(std::string_view(static_cast<const char*>(data), size));
+    RunInput(session);
+
+    if (data)
+        munmap(data, size);
+    return 0;
+}
+
+}
@@ -1,81 +1,153 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 #include <vector>
 #include <memory>
+#include <utility>
 
-namespace asql {
-    extern int repl();
+#include "arena.h"
+#include "database.h"
+#include "lexer.h"
 
+namespace asql {
+    class Session;
+
+    extern int repl(Session &session);
+    /* Run every statement in a script file */
+    extern int RunScript(Session &session, const char *path);
+    /* Run every statement in sql, which has to outlive the call */
+    extern void RunStatements(Session &session, std::string_view sql);
+
+    class VariableExpr;
+    class SelectQuery;
+    class ModifyQuery;
+
+    /* Parse a SELECT, the current token has to be SELECT. nullptr on a syntax error */
+    std::unique_ptr<SelectQuery> ParseSelectQuery(ParserContext &ctx);
+    /* Parse an UPDATE or DELETE, the current token is the statement keyword */
+    std::unique_ptr<ModifyQuery> ParseModifyQuery(ParserContext &ctx);
+
+    /*
+    * Expression nodes live in the query's Arena. Members are plain views and
+    * pointers into the same arena, so nodes are trivially destructible and the
+    * arena frees them without running destructors.
+    */
     class Expr {
     public:
-        Expr(const std::string& alias): alias{alias} {}
-        virtual ~Expr() = default;
+        Expr(std::string_view alias): alias{alias} {}
         virtual float eval() const { return 0; };
-        virtual std::string GetAlias() const { return alias; }
-        virtual std::vector<const Expr*> GetVariables() const {return {}; }; 
-        std::string alias;
+        /* Evaluate over every row of the batch at once */
+        virtual void EvalBatch(const Batch &, Vector &out) const { out.Constant({}); }
+        virtual std::string GetAlias() const { return std::string(alias); }
+        virtual std::vector<VariableExpr*> GetVariables() {return {}; }; 
+        std::string_view alias;
+
+    protected:
+        ~Expr() = default;
     };
 
 
     class FunctionExpr: public Expr {
     public:
-    FunctionExpr(const std::string &name): Expr{""}, name{name} {}
-    std::string GetAlias() const;
+    FunctionExpr(std::string_view name, Arena &arena): Expr{""}, name{name}, args{&arena} {}
+    std::string GetAlias() const override;
     float eval() const = 0;
-    std::string name;
-    std::vector<Expr> args;
+    std::string_view name;
+    ArenaVector<Expr*> args;
+
+    };
+
+
+    enum AggregateKind {
+        AGG_COUNT,
+        AGG_SUM,
+        AGG_MIN,
+        AGG_MAX,
+        AGG_AVG,
+    };
 
+    /* COUNT, SUM, MIN, MAX or AVG. Folded over a group's rows by the aggregation, never evaluated per batch */
+    class AggregateExpr: public FunctionExpr {
+    public:
+        AggregateExpr(std::string_view name, AggregateKind kind, Arena &arena): FunctionExpr{name, arena}, kind{kind} {}
+        float eval() const override { return 0; }
+        std::string GetAlias() const override;
+        std::vector<VariableExpr*> GetVariables() override;
+
+        AggregateKind kind;
+        /* Result type, set by SelectQuery::Validate() */
+        ColumnType type = CT_INT;
     };
 
 
     class VariableExpr: public Expr {
     public:
-        VariableExpr(const std::string &name): Expr{name}, name{name} {}
-        std::string name;
-        std::string qualifier;
-        std::vector<const Expr*> GetVariables() const { return {this}; }
+        VariableExpr(std::string_view name): Expr{name}, name{name} {}
+        void EvalBatch(const Batch &batch, Vector &out) const override { out.Reference(batch.columns[slot][column]); }
+        std::string_view name;
+        std::string_view qualifier;
+        std::vector<VariableExpr*> GetVariables() override { return {this}; }
+
+        /* Resolved by SelectQuery::Validate() */
+        int slot = -1;
+        int column = -1;
+        ColumnType type = CT_INT;
     };
 
 
     class StringExpr: public Expr {
     public:
-        StringExpr(const std::string &str): Expr{"'" + str + "'"}, str{str} {}
-        std::string str;
+        StringExpr(std::string_view str): Expr{""}, str{str} {}
+        void EvalBatch(const Batch &, Vector &out) const override { out.Constant(Value::Str(std::string(str))); }
+        std::string GetAlias() const override { return alias.size() ? std::string(alias) : "'" + std::string(str) + "'"; }
+        std::string_view str;
+    };
+
+
+    /* A '?' placeholder, its value is bound when the statement is executed */
+    class ParamExpr: public Expr {
+    public:
+        ParamExpr(int index): Expr{"?"}, index{index} {}
+        void EvalBatch(const Batch &batch, Vector &out) const override { out.Constant(batch.params[index]); }
+        int index;
     };
 
 
     class FloatExpr: public Expr {
     public:
-        FloatExpr(float number, const std::string &numstr): Expr{numstr}, number{number} {}
-        float eval() const override { return number;}
+        FloatExpr(double number, std::string_view numstr): Expr{numstr}, number{number} {}
+        float eval() const override { return static_cast<float>(number);}
+        void EvalBatch(const Batch &, Vector &out) const override { out.Constant(Value::Float(number)); }
 
-        float number;
+        double number;
     };
 
 
     class IntExpr: public Expr {
     public:
-        IntExpr(int number, const std::string &numstr): Expr{numstr}, number{number} {}
-        int number;
-        float eval() const override { return number;}
+        IntExpr(int64_t number, std::string_view numstr): Expr{numstr}, number{number} {}
+        int64_t number;
+        float eval() const override { return static_cast<float>(number);}
+        void EvalBatch(const Batch &, Vector &out) const override { out.Constant(Value::Int(number)); }
     };
 
 
     class BinaryExpr: public Expr {
     public:
-        BinaryExpr(int op, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs):
+        BinaryExpr(int op, Expr *lhs, Expr *rhs):
             Expr{""},
             op{op},
-            lhs{std::move(lhs)},
-            rhs{std::move(rhs)} {}
+            lhs{lhs},
+            rhs{rhs} {}
         
         float eval() const;
+        void EvalBatch(const Batch &batch, Vector &out) const override;
         std::string GetAlias() const;
-        std::vector<const Expr*> GetVariables() const;
+        std::vector<VariableExpr*> GetVariables() override;
         
         int op;
-        std::unique_ptr<Expr> lhs;
-        std::unique_ptr<Expr> rhs;
+        Expr *lhs;
+        Expr *rhs;
     };
 }
@@ -0,0 +1,27 @@
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "profile.h"
+
+
+namespace asql {
+
+    thread_local uint64_t AllocatedBytes = 0;
+    bool CountingAllocations = false;
+
+    uint64_t CycleCount()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return 0;
+#endif
+    }
+
+    uint64_t ThreadAllocatedBytes()
+    {
+        return AllocatedBytes;
+    }
+
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+
+namespace asql {
+
+    /* Cycle counter, the time stamp counter on x86. Always 0 where there is none */
+    uint64_t CycleCount();
+    constexpr bool HAS_CYCLE_COUNTER =
+#if defined(__x86_64__) || defined(__i386__)
+        true;
+#else
+        false;
+#endif
+
+    /*
+    * Bytes the calling thread has requested from operator new since it
+    * started. Only the asql binary counts them, with the replacement operator
+    * new in allocator.cpp; benchmarks and libasql keep the default allocator,
+    * CountingAllocations tells which.
+    */
+    uint64_t ThreadAllocatedBytes();
+    // One counter per thread so counting costs no synchronization
+    extern thread_local uint64_t AllocatedBytes;
+    extern bool CountingAllocations;
+
+    /* What one operator did during an EXPLAIN ANALYZE run. Workers add to it concurrently */
+    struct OperatorStats {
+        std::atomic<uint64_t> rows_in{0};
+        std::atomic<uint64_t> rows_out{0};
+        // From the first thread starting the operator to the last one finishing it
+        std::atomic<uint64_t> first_start{UINT64_MAX};
+        std::atomic<uint64_t> last_end{0};
+        // Summed over the threads that ran the operator
+        std::atomic<uint64_t> nanos{0};
+        std::atomic<uint64_t> cycles{0};
+        std::atomic<uint64_t> bytes{0};
+        // Scans only, the row groups of the table and how many of them zone maps ruled out
+        std::atomic<uint64_t> groups{0};
+        std::atomic<uint64_t> groups_skipped{0};
+    };
+
+    /* Adds the time, cycles and allocations of its scope to stats. Does nothing without stats */
+    class OperatorTimer {
+    public:
+        OperatorTimer(OperatorStats *stats):
+            stats{stats}
+        {
+            if (!stats)
+                return;
+            bytes = ThreadAllocatedBytes();
+            cycles = CycleCount();
+            start = std::chrono::steady_clock::now();
+        }
+        OperatorTimer(const OperatorTimer&) = delete;
+        OperatorTimer& operator=(const OperatorTimer&) = delete;
+
+        ~OperatorTimer()
+        {
+            if (!stats)
+                return;
+            auto end = std::chrono::steady_clock::now();
+            stats->nanos += Nanos(end - start);
+
+            const uint64_t from = Nanos(start.time_since_epoch()), to = Nanos(end.time_since_epoch());
+            for (auto v = stats->first_start.load(); from < v && !stats->first_start.compare_exchange_weak(v, from); )
+                ;
+            for (auto v = stats->last_end.load(); to > v && !stats->last_end.compare_exchange_weak(v, to); )
+                ;
+            stats->cycles += CycleCount() - cycles;
+            stats->bytes += ThreadAllocatedBytes() - bytes;
+        }
+
+    private:
+        static uint64_t Nanos(std::chrono::steady_clock::duration d)
+        {
+            return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(d).count());
+        }
+
+        OperatorStats *stats;
+        uint64_t bytes = 0;
+        uint64_t cycles = 0;
+        std::chrono::steady_clock::time_point start;
+    };
+
+    /*
+    * Counters of one execution of a SELECT for EXPLAIN ANALYZE, one entry per
+    * operator of the plan. A cached plan is shared, so the profile is passed
+    * to Execute() rather than kept in it.
+    */
+    struct QueryProfile {
+        QueryProfile(size_t tables): scans(tables) {}
+
+        // One per FROM slot
+        std::vector<OperatorStats> scans;
+        OperatorStats join;
+        OperatorStats filter;
+        OperatorStats project;
+        OperatorStats aggregate;
+        OperatorStats sort;
+        OperatorStats limit;
+        // The single table scan went through an index
+        bool index_scan = false;
+        // Rows the query returned, and how often aggregation and sorting wrote their state out to temporary files
+        uint64_t rows = 0;
+        uint64_t spills = 0;
+    };
+
+}
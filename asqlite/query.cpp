@@ -1,11 +1,19 @@
 #include <algorithm>
-#include <unordered_set>
+#include <atomic>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include "aggregate.h"
+#include "join.h"
 #include "query.h"
+#include "sort.h"
+#include "threadpool.h"
+#include "output.h"
 
 
 namespace asql {
 
-    std::unordered_map<std::string, std::unordered_map<std::string, ColumnType>> database_tables {
+    std::unordered_map<std::string, TableSchema> database_tables {
         {"EMPLOYEES",
             {{"EMP_ID",      CT_INT},
              {"EMP_TYPE_ID", CT_INT},
@@ -22,99 +30,1168 @@ namespace asql {
              {"TYPE",        CT_STR}}},
     };
 
-    void SelectQuery::Validate()
+    size_t WorkMemBytes = 256 << 20;
+
+    // Rough size of a formatted row and its sort key, decides whether a LIMIT fits a top-K heap
+    static constexpr size_t TOP_K_ROW_BYTES = 256;
+
+    /* Result type of a bound expression */
+    static ColumnType ExprType(const Expr *expr)
     {
-        /* First check if the tables exist. */
-        std::unordered_map<std::string, std::string> table_aliases;
+        if (auto v = dynamic_cast<const VariableExpr*>(expr))
+            return v->type;
+        if (auto agg = dynamic_cast<const AggregateExpr*>(expr))
+            return agg->type;
+        if (dynamic_cast<const StringExpr*>(expr))
+            return CT_STR;
+        if (dynamic_cast<const FloatExpr*>(expr))
+            return CT_FLOAT;
+        if (auto b = dynamic_cast<const BinaryExpr*>(expr))
+            return ExprType(b->lhs) == CT_INT && ExprType(b->rhs) == CT_INT ? CT_INT : CT_FLOAT;
+        return CT_INT;
+    }
 
-        for (const auto &table : tables) {
-            if (auto f = database_tables.find(table.name); f == database_tables.end()) {
-                printf("Unknown table %s\n", table.name.c_str());
-                return;
+    static bool ContainsAggregate(const Expr *expr)
+    {
+        if (dynamic_cast<const AggregateExpr*>(expr))
+            return true;
+        if (auto b = dynamic_cast<const BinaryExpr*>(expr))
+            return ContainsAggregate(b->lhs) || ContainsAggregate(b->rhs);
+        return false;
+    }
+
+    /* Both bound expressions compute the same value, used to match columns against GROUP BY and ORDER BY */
+    static bool SameExpr(const Expr *a, const Expr *b)
+    {
+        if (auto aa = dynamic_cast<const AggregateExpr*>(a)) {
+            auto ab = dynamic_cast<const AggregateExpr*>(b);
+            return ab && aa->kind == ab->kind && aa->args.size() == ab->args.size() &&
+                   (aa->args.empty() || SameExpr(aa->args[0], ab->args[0]));
+        }
+        if (auto va = dynamic_cast<const VariableExpr*>(a)) {
+            auto vb = dynamic_cast<const VariableExpr*>(b);
+            return vb && va->slot == vb->slot && va->column == vb->column;
+        }
+        if (auto ia = dynamic_cast<const IntExpr*>(a)) {
+            auto ib = dynamic_cast<const IntExpr*>(b);
+            return ib && ia->number == ib->number;
+        }
+        if (auto fa = dynamic_cast<const FloatExpr*>(a)) {
+            auto fb = dynamic_cast<const FloatExpr*>(b);
+            return fb && fa->number == fb->number;
+        }
+        if (auto sa = dynamic_cast<const StringExpr*>(a)) {
+            auto sb = dynamic_cast<const StringExpr*>(b);
+            return sb && sa->str == sb->str;
+        }
+        if (auto pa = dynamic_cast<const ParamExpr*>(a)) {
+            auto pb = dynamic_cast<const ParamExpr*>(b);
+            return pb && pa->index == pb->index;
+        }
+        if (auto ba = dynamic_cast<const BinaryExpr*>(a)) {
+            auto bb = dynamic_cast<const BinaryExpr*>(b);
+            return bb && ba->op == bb->op && SameExpr(ba->lhs, bb->lhs) && SameExpr(ba->rhs, bb->rhs);
+        }
+        return false;
+    }
+
+    bool SelectQuery::Validate()
+    {
+        /* First check if the tables exist. Names are looked up once here, binding works on the slots */
+        std::unordered_map<std::string_view, int> table_aliases;
+        std::vector<const TableSchema*> schemas;
+
+        for (size_t i = 0; i < tables.size(); ++i) {
+            const auto &table = tables[i];
+            auto f = database_tables.find(std::string(table.name));
+            if (f == database_tables.end()) {
+                Print("Unknown table %.*s\n", static_cast<int>(table.name.size()), table.name.data());
+                return false;
             }
+            schemas.push_back(&f->second);
 
             /* Create an alias helper table at the same time */
-            if (auto f = table_aliases.find(table.alias); f != table_aliases.end()) {
-                printf("Duplicate table alias '%s' found\n", table.alias.c_str());
-                return;
+            if (auto a = table_aliases.find(table.alias); a != table_aliases.end()) {
+                Print("Duplicate table alias '%.*s' found\n", static_cast<int>(table.alias.size()), table.alias.data());
+                return false;
             }
 
-            table_aliases.emplace(table.alias, table.name);
+            table_aliases.emplace(table.alias, static_cast<int>(i));
         }
 
-        /* Check that all the columns listed can be found in the FROM tables */
-        std::unordered_map<std::string, std::unordered_set<std::string>> table_references;
-        for (const auto &column: columns) {
+        referenced.assign(tables.size(), {});
+        for (size_t i = 0; i < tables.size(); ++i)
+            referenced[i].assign(schemas[i]->size(), false);
 
-            const auto& is_binary_expression = dynamic_cast<const BinaryExpr*>(column.get());
+        /* Check that all the variables can be found in the FROM tables and bind them to a table slot */
+        auto bind = [&](VariableExpr *var_expr, size_t slot, TableSchema::const_iterator col) {
+            var_expr->slot = static_cast<int>(slot);
+            var_expr->column = static_cast<int>(col - schemas[slot]->begin());
+            var_expr->type = col->second;
+            referenced[slot][static_cast<size_t>(var_expr->column)] = true;
+        };
+        auto resolve = [&](Expr *expr) {
+            const bool is_binary_expression = dynamic_cast<const BinaryExpr*>(expr) != nullptr;
 
-            for (const auto var: column->GetVariables()) {
+            for (auto var_expr: expr->GetVariables()) {
                 // Check the qualified tables first i.e select a.x from a
-                auto var_expr = dynamic_cast<const VariableExpr*>(var);
                 if (var_expr->qualifier.size()) {
                     auto f = table_aliases.find(var_expr->qualifier);
                     if (f == table_aliases.end()) {
-                        printf("Unknown qualifier '%s'\n", var_expr->qualifier.c_str());
-                        return;
+                        Print("Unknown qualifier '%.*s'\n", static_cast<int>(var_expr->qualifier.size()), var_expr->qualifier.data());
+                        return false;
                     }
 
-                    // Table has to be present, dont bother checking for end()
-                    auto dt = database_tables.find(f->second);
-                    auto cols = dt->second;
-                    
-                    auto col = cols.find(var_expr->name);
-                    if (col == cols.end()) {
-                        printf("Unknown column '%s' in table '%s'\n", var_expr->name.c_str(), dt->first.c_str());
-                        return;
+                    const auto slot = static_cast<size_t>(f->second);
+                    auto col = schemas[slot]->find(var_expr->name);
+                    if (col == schemas[slot]->end()) {
+                        const auto &name = tables[slot].name;
+                        Print("Unknown column '%.*s' in table '%.*s'\n", static_cast<int>(var_expr->name.size()), var_expr->name.data(),
+                              static_cast<int>(name.size()), name.data());
+                        return false;
                     }
+                    bind(var_expr, slot, col);
 
-                    // If part of a binary expression, the column type can't be a string
-
-                    auto& t = table_references[dt->first];
-                    t.emplace(var_expr->name);
-                    
                 } else { // unqualified column names i.e select x from a
-                    
+
                     /* Check if multiple columns with same name exist */
                     bool found = false;
-                    for (const auto& table: tables) {
-                        const auto& dt = database_tables[table.name];
-                        auto col = dt.find(var_expr->name);
-                        if (col != dt.end()) {
+                    for (size_t i = 0; i < tables.size(); ++i) {
+                        auto col = schemas[i]->find(var_expr->name);
+                        if (col != schemas[i]->end()) {
                             if (found) {
-                                printf("Ambiguous reference to column '%s'\n", var_expr->name.c_str());
-                                return;
+                                Print("Ambiguous reference to column '%.*s'\n", static_cast<int>(var_expr->name.size()), var_expr->name.data());
+                                return false;
                             }
 
                             found = true;
-                            auto& table_ref = table_references[table.name];
-                            table_ref.emplace(var_expr->name);
+                            bind(var_expr, i, col);
                         }
                     }
 
                     // TODO: If (count != 1) to prevent branches?
                     if (!found) {
-                        printf("Unknown column '%s' in SELECT clause\n", var_expr->name.c_str()); //
-                        return;
+                        Print("Unknown column '%.*s'\n", static_cast<int>(var_expr->name.size()), var_expr->name.data());
+                        return false;
+                    }
+                }
+
+                // If part of a binary expression, the column type can't be a string
+                if (is_binary_expression && var_expr->type == CT_STR) {
+                    Print("String column '%.*s' can't be used in an arithmetic expression\n", static_cast<int>(var_expr->name.size()), var_expr->name.data());
+                    return false;
+                }
+            }
+            return true;
+        };
+
+        for (auto &column: columns)
+            if (!resolve(column))
+                return false;
+
+        for (auto &filter: filters)
+            if (!resolve(filter.lhs) || !resolve(filter.rhs))
+                return false;
+
+        for (auto &expr: group_by)
+            if (!resolve(expr))
+                return false;
+
+        for (const auto &filter: filters) {
+            if (ContainsAggregate(filter.lhs) || ContainsAggregate(filter.rhs)) {
+                Print("Aggregate functions can't be used in WHERE\n");
+                return false;
+            }
+        }
+
+        bool aggregating = !group_by.empty();
+        for (const auto &expr: group_by) {
+            if (ContainsAggregate(expr)) {
+                Print("Aggregate functions can't be used in GROUP BY\n");
+                return false;
+            }
+        }
+        for (const auto &column: columns)
+            aggregating |= ContainsAggregate(column);
+
+        /* ORDER BY sorts by an output column where it can: a 1-based position, a column alias or the same expression */
+        for (auto &key: order_by) {
+            key.column = -1;
+            if (auto pos = dynamic_cast<const IntExpr*>(key.expr)) {
+                if (pos->number < 1 || pos->number > static_cast<int64_t>(columns.size())) {
+                    Print("ORDER BY position %lld is out of range\n", static_cast<long long>(pos->number));
+                    return false;
+                }
+                key.column = static_cast<int>(pos->number - 1);
+                continue;
+            }
+
+            auto var = dynamic_cast<const VariableExpr*>(key.expr);
+            for (size_t i = 0; var && var->qualifier.empty() && i < columns.size() && key.column < 0; ++i)
+                if (columns[i]->alias == var->name)
+                    key.column = static_cast<int>(i);
+            if (key.column >= 0)
+                continue;
+
+            if (!resolve(key.expr))
+                return false;
+            for (size_t i = 0; i < columns.size() && key.column < 0; ++i)
+                if (SameExpr(columns[i], key.expr))
+                    key.column = static_cast<int>(i);
+
+            // Otherwise the key is evaluated next to the columns, only possible before rows are folded into groups
+            if (key.column < 0 && (aggregating || ContainsAggregate(key.expr))) {
+                Print("ORDER BY '%s' has to be one of the output columns of an aggregating query\n", key.expr->GetAlias().c_str());
+                return false;
+            }
+        }
+
+        /* Every column of an aggregating query is an aggregate, a GROUP BY expression or a constant */
+        aggregates.clear();
+        outputs.clear();
+        if (!aggregating) {
+            CompileQuery(*this);
+            return true;
+        }
+
+        for (size_t i = 0; i < columns.size(); ++i) {
+            if (auto agg = dynamic_cast<AggregateExpr*>(columns[i])) {
+                auto name = agg->GetAlias();
+                if (agg->args.size() && ContainsAggregate(agg->args[0])) {
+                    Print("Aggregate functions can't be nested in %s\n", name.c_str());
+                    return false;
+                }
+                if (agg->args.size() && !resolve(agg->args[0]))
+                    return false;
+
+                auto arg_type = agg->args.size() ? ExprType(agg->args[0]) : CT_INT;
+                if ((agg->kind == AGG_SUM || agg->kind == AGG_AVG) && arg_type == CT_STR) {
+                    Print("%s needs a numeric argument\n", name.c_str());
+                    return false;
+                }
+
+                agg->type = agg->kind == AGG_COUNT ? CT_INT : agg->kind == AGG_AVG ? CT_FLOAT : arg_type;
+                outputs.push_back({OS_AGGREGATE, aggregates.size()});
+                aggregates.push_back(agg);
+                continue;
+            }
+
+            if (ContainsAggregate(columns[i])) {
+                Print("Aggregate functions can't be used inside an expression\n");
+                return false;
+            }
+
+            size_t key = 0;
+            while (key < group_by.size() && !SameExpr(columns[i], group_by[key]))
+                ++key;
+
+            if (key < group_by.size()) {
+                outputs.push_back({OS_GROUP_KEY, key});
+            } else if (columns[i]->GetVariables().empty()) {
+                outputs.push_back({OS_CONSTANT, i});
+            } else {
+                Print("Column '%s' has to be in GROUP BY or inside an aggregate function\n", columns[i]->GetAlias().c_str());
+                return false;
+            }
+        }
+
+        CompileQuery(*this);
+        return true;
+    }
+
+    /* Fill batch with morsel i of a scan, scratch holds a row group paged in from disk. False on a read error */
+    using MorselLoader = std::function<bool(size_t i, Batch &batch, RowGroup &scratch)>;
+
+    /* The FROM tables split into morsels. The loader reads the join and index rows or the row groups held here */
+    struct MorselSource {
+        size_t count = 0;
+        MorselLoader load;
+        JoinResult join;
+        std::vector<RowId> rows;
+        std::vector<size_t> groups;
+    };
+
+    /* Output rows of one morsel, row k of text ends at row_ends[k] */
+    struct MorselOutput {
+        bool ok = false;
+        std::string text;
+        std::vector<size_t> row_ends;
+    };
+
+    /* Point the batch vectors at the gathered buffers, they may have moved while appending */
+    static void SealGathered(Batch &batch)
+    {
+        for (auto &slot : batch.columns) {
+            for (auto &v : slot) {
+                v.ints = v.int_buf.data();
+                v.floats = v.float_buf.data();
+                v.strs = v.str_buf.data();
+            }
+        }
+    }
+
+    /* Copy one row of a group into the batch's gather buffers for slot, only the columns the query reads */
+    static void GatherRow(Batch &batch, size_t slot, const RowGroup &group, size_t row, const std::vector<bool> &referenced)
+    {
+        for (size_t c = 0; c < group.columns.size(); ++c) {
+            if (!referenced[c])
+                continue;
+            auto &v = batch.columns[slot][c];
+            const auto &col = group.columns[c];
+            switch (col.type) {
+            case CT_INT:   v.int_buf.push_back(col.Ints()[row]);     break;
+            case CT_FLOAT: v.float_buf.push_back(col.Floats()[row]); break;
+            case CT_STR:   v.str_buf.push_back(col.Str(row));        break;
+            }
+        }
+    }
+
+    /* Size the batch for the FROM tables, every column gathered into a typed buffer */
+    static void PrepareGathered(Batch &batch, const std::vector<TableSnapshot> &tables)
+    {
+        batch.columns.resize(tables.size());
+        for (size_t slot = 0; slot < tables.size(); ++slot) {
+            const auto &schema = tables[slot].table->schema;
+            batch.columns[slot].resize(schema.size());
+            for (size_t c = 0; c < schema.size(); ++c)
+                batch.columns[slot][c].type = schema.columns[c].second;
+        }
+    }
+
+    void EncodeResultValue(const Value &v, std::string &out)
+    {
+        out += static_cast<char>(v.type);
+        switch (v.type) {
+        case CT_INT:
+            out.append(reinterpret_cast<const char*>(&v.i), sizeof(v.i));
+            break;
+        case CT_FLOAT:
+            out.append(reinterpret_cast<const char*>(&v.f), sizeof(v.f));
+            break;
+        case CT_STR: {
+            auto len = static_cast<uint32_t>(v.s.size());
+            out.append(reinterpret_cast<const char*>(&len), sizeof(len));
+            out += v.s;
+            break;
+        }
+        }
+    }
+
+    /* Append one output row, columns separated by " | ", or encoded for a ResultRows */
+    static void FormatRow(const Program &program, const std::vector<Vector> &regs, size_t row, bool encode, std::string &out)
+    {
+        for (size_t i = 0; i < program.columns.size(); ++i) {
+            if (encode) {
+                EncodeResultValue(regs[program.columns[i]].Get(row), out);
+                continue;
+            }
+            if (i)
+                out += " | ";
+            out += regs[program.columns[i]].Get(row).ToString();
+        }
+        if (!encode)
+            out += '\n';
+    }
+
+    static void FormatRow(const std::vector<Value> &row, bool encode, std::string &out)
+    {
+        for (size_t i = 0; i < row.size(); ++i) {
+            if (encode) {
+                EncodeResultValue(row[i], out);
+                continue;
+            }
+            if (i)
+                out += " | ";
+            out += row[i].ToString();
+        }
+        if (!encode)
+            out += '\n';
+    }
+
+    /* Run the query's program over a batch. Profiled, its filters and projections count as two operators */
+    static bool RunProgram(const Program &program, const Batch &batch, std::vector<Vector> &regs,
+                           std::vector<uint8_t> &keep, QueryProfile *profile)
+    {
+        if (!profile)
+            return program.Run(batch, regs, keep);
+
+        uint64_t kept = batch.count;
+        if (program.filter_end) {
+            OperatorTimer timer{&profile->filter};
+            bool any = program.RunFilters(batch, regs, keep);
+            kept = any ? static_cast<uint64_t>(std::count(keep.begin(), keep.end(), 1)) : 0;
+            profile->filter.rows_in += batch.count;
+            profile->filter.rows_out += kept;
+            if (!any)
+                return false;
+        } else {
+            program.RunFilters(batch, regs, keep);
+        }
+
+        OperatorTimer timer{&profile->project};
+        program.RunProjections(batch, regs, keep);
+        profile->project.rows_in += kept;
+        profile->project.rows_out += kept;
+        return true;
+    }
+
+    /* Filter and project a batch, formatting up to max_rows surviving rows into out */
+    static void ProjectBatch(const SelectQuery &query, const Batch &batch, size_t max_rows, bool encode, MorselOutput &out,
+                             QueryProfile *profile)
+    {
+        out.ok = true;
+        std::vector<Vector> regs;
+        std::vector<uint8_t> keep;
+        if (!RunProgram(query.program, batch, regs, keep, profile))
+            return;
+
+        OperatorTimer timer{profile ? &profile->project : nullptr};
+        for (size_t row = 0; row < batch.count && out.row_ends.size() < max_rows; ++row) {
+            if (!keep[row])
+                continue;
+
+            FormatRow(query.program, regs, row, encode, out.text);
+            out.row_ends.push_back(out.text.size());
+        }
+    }
+
+    /*
+    * Filter a batch and turn its rows into SortRows. Keys end with the row's
+    * position in the scan so equal keys keep their serial order. Only the
+    * max_rows smallest keys are formatted, a top-K never needs more from one morsel.
+    */
+    static void SortBatch(const SelectQuery &query, const Batch &batch, size_t morsel, size_t max_rows, bool encode,
+                          std::vector<SortRow> &out, QueryProfile *profile)
+    {
+        const auto &program = query.program;
+        std::vector<Vector> regs;
+        std::vector<uint8_t> keep;
+        if (!RunProgram(program, batch, regs, keep, profile))
+            return;
+
+        OperatorTimer timer{profile ? &profile->sort : nullptr};
+        std::vector<size_t> rows;
+        std::vector<std::string> keys(batch.count);
+        for (size_t row = 0; row < batch.count; ++row) {
+            if (!keep[row])
+                continue;
+
+            for (size_t k = 0; k < query.order_by.size(); ++k)
+                EncodeSortKey(regs[program.order_keys[k]].Get(row), query.order_by[k].desc, keys[row]);
+            EncodeSortKey(Value::Int(static_cast<int64_t>(morsel << 32 | row)), false, keys[row]);
+            rows.push_back(row);
+        }
+
+        if (rows.size() > max_rows) {
+            std::nth_element(rows.begin(), rows.begin() + max_rows, rows.end(),
+                             [&](size_t a, size_t b) { return keys[a] < keys[b]; });
+            rows.resize(max_rows);
+        }
+
+        for (auto row : rows) {
+            SortRow r;
+            r.key = std::move(keys[row]);
+            FormatRow(program, regs, row, encode, r.line);
+            out.push_back(std::move(r));
+        }
+    }
+
+    /* Load morsel i. Profiled, that counts as the scan of a single table or as part of the join building the tuples */
+    static bool LoadMorsel(const MorselSource &source, size_t i, Batch &batch, RowGroup &scratch, QueryProfile *profile)
+    {
+        if (!profile || profile->scans.empty())
+            return source.load(i, batch, scratch);
+
+        const bool join = profile->scans.size() > 1;
+        auto &stats = join ? profile->join : profile->scans[0];
+        OperatorTimer timer{&stats};
+        if (!source.load(i, batch, scratch))
+            return false;
+        if (!join)
+            stats.rows_out += batch.count;
+        return true;
+    }
+
+    /* Hand every morsel to consume() on the thread pool, in no particular order. False once one fails */
+    static bool ScanMorsels(const MorselSource &source, const std::vector<Value> &params, QueryProfile *profile,
+                            const std::function<bool(size_t morsel, const Batch&)> &consume)
+    {
+        std::atomic<bool> ok{true};
+        GetThreadPool().ParallelFor(source.count, [&](size_t i) {
+            if (!ok)
+                return;
+
+            Batch batch;
+            batch.params = params.data();
+            RowGroup scratch;
+            if (!LoadMorsel(source, i, batch, scratch, profile) || !consume(i, batch))
+                ok = false;
+        });
+        return ok;
+    }
+
+    /*
+    * Run every morsel through the filters and projections on the thread pool.
+    * Finished morsels are printed in morsel order by whichever thread completes
+    * the next one in line, so the output matches a serial scan. Once LIMIT rows
+    * are printed, or a morsel fails to load, the morsels not yet started are skipped.
+    * Profiled, the rows are counted instead of printed. With a result they're collected into it.
+    */
+    static void RunMorsels(const SelectQuery &query, const MorselSource &source, const std::vector<Value> &params,
+                           QueryProfile *profile, ResultRows *result)
+    {
+        const size_t count = source.count;
+        const size_t max_rows = query.limit >= 0 ? static_cast<size_t>(query.limit) : SIZE_MAX;
+
+        std::mutex lock;
+        std::vector<MorselOutput> outputs(count);
+        std::vector<uint8_t> done(count);
+        size_t next = 0, emitted = 0;
+        std::atomic<bool> stop{false};
+
+        GetThreadPool().ParallelFor(count, [&](size_t i) {
+            MorselOutput out;
+            if (!stop) {
+                Batch batch;
+                batch.params = params.data();
+                RowGroup scratch;
+                if (LoadMorsel(source, i, batch, scratch, profile))
+                    ProjectBatch(query, batch, max_rows, result != nullptr, out, profile);
+            }
+
+            std::lock_guard<std::mutex> guard{lock};
+            outputs[i] = std::move(out);
+            done[i] = 1;
+
+            OperatorTimer timer{profile && query.limit >= 0 ? &profile->limit : nullptr};
+            for (; next < count && done[next]; ++next) {
+                auto &o = outputs[next];
+                if (stop || !o.ok) {
+                    stop = true;
+                    continue;
+                }
+
+                size_t rows = std::min(o.row_ends.size(), max_rows - emitted);
+                if (result) {
+                    const size_t base = result->data.size();
+                    result->data.append(o.text, 0, rows ? o.row_ends[rows - 1] : 0);
+                    for (size_t r = 0; r < rows; ++r)
+                        result->ends.push_back(base + o.row_ends[r]);
+                } else if (rows && !profile) {
+                    fwrite(o.text.data(), 1, o.row_ends[rows - 1], Output());
+                }
+                if (profile && query.limit >= 0) {
+                    profile->limit.rows_in += o.row_ends.size();
+                    profile->limit.rows_out += rows;
+                }
+                emitted += rows;
+                o = MorselOutput{};
+
+                if (emitted >= max_rows)
+                    stop = true;
+            }
+        });
+        if (profile)
+            profile->rows = emitted;
+    }
+
+    /* The filter compares a column against a literal or parameter, sets the column and the op as seen from it */
+    static bool ColumnComparison(const Filter &filter, const std::vector<Value> &params,
+                                 const VariableExpr *&column, Value &value, EqualityOp &op)
+    {
+        auto constant = [&](const Expr *e) {
+            if (auto i = dynamic_cast<const IntExpr*>(e))
+                value = Value::Int(i->number);
+            else if (auto f = dynamic_cast<const FloatExpr*>(e))
+                value = Value::Float(f->number);
+            else if (auto str = dynamic_cast<const StringExpr*>(e))
+                value = Value::Str(std::string(str->str));
+            else if (auto p = dynamic_cast<const ParamExpr*>(e); p && static_cast<size_t>(p->index) < params.size())
+                value = params[static_cast<size_t>(p->index)];
+            else
+                return false;
+            return true;
+        };
+        auto is_column = [&](const Expr *e) {
+            column = dynamic_cast<const VariableExpr*>(e);
+            return column != nullptr;
+        };
+
+        op = filter.Op;
+        if (is_column(filter.lhs) && constant(filter.rhs))
+            return true;
+        if (!is_column(filter.rhs) || !constant(filter.lhs))
+            return false;
+
+        // literal < column is column > literal
+        switch (op) {
+        case EO_LESS_THAN:           op = EO_GREATER_THAN;        break;
+        case EO_LESS_THAN_EQUAL:     op = EO_GREATER_THAN_EQUALS; break;
+        case EO_GREATER_THAN:        op = EO_LESS_THAN;           break;
+        case EO_GREATER_THAN_EQUALS: op = EO_LESS_THAN_EQUAL;     break;
+        default: break;
+        }
+        return true;
+    }
+
+    /* Some value in the zone could compare op against v */
+    static bool ZoneMayMatch(const ZoneMap &zone, EqualityOp op, const Value &v)
+    {
+        switch (op) {
+        case EO_LESS_THAN:           return CompareValues(zone.min, v) < 0;
+        case EO_LESS_THAN_EQUAL:     return CompareValues(zone.min, v) <= 0;
+        case EO_EQUALS:              return CompareValues(zone.min, v) <= 0 && CompareValues(zone.max, v) >= 0;
+        case EO_NOT_EQUAL:           return CompareValues(zone.min, v) != 0 || CompareValues(zone.max, v) != 0;
+        case EO_GREATER_THAN:        return CompareValues(zone.max, v) > 0;
+        case EO_GREATER_THAN_EQUALS: return CompareValues(zone.max, v) >= 0;
+        }
+        return true;
+    }
+
+    bool GroupMayMatch(const SelectQuery &query, size_t slot, const TableSnapshot &table, size_t i,
+                       const std::vector<Value> &params)
+    {
+        if (table.Open(i))
+            return true;
+
+        const auto &group = table.Group(i);
+        for (const auto &filter : query.filters) {
+            const VariableExpr *column;
+            Value v;
+            EqualityOp op;
+            if (!ColumnComparison(filter, params, column, v, op) || static_cast<size_t>(column->slot) != slot)
+                continue;
+
+            const auto &zone = group.zones[static_cast<size_t>(column->column)];
+            if (zone.set && !ZoneMayMatch(zone, op, v))
+                return false;
+        }
+        return true;
+    }
+
+    /*
+    * Find the rows of a single table scan through an index. Every filter on the
+    * indexed column narrows the key range, indexes with an equality filter are
+    * preferred. The filters are still applied to the fetched rows afterwards.
+    * Returns false when no index applies and the table has to be scanned.
+    */
+    static bool IndexRows(const ArenaVector<Filter> &filters, const TableSnapshot &table,
+                          const std::vector<Value> &params, std::vector<RowId> &rows)
+    {
+        const Index *best = nullptr;
+        Value best_lo, best_hi;
+        bool best_has_lo = false, best_has_hi = false, best_lo_inc = true, best_hi_inc = true, best_eq = false;
+
+        for (const auto &index : table.version->indexes) {
+            Value lo, hi;
+            bool has_lo = false, has_hi = false, lo_inc = true, hi_inc = true, eq = false;
+
+            for (const auto &filter : filters) {
+                const VariableExpr *column;
+                Value v;
+                EqualityOp op;
+                if (!ColumnComparison(filter, params, column, v, op) || static_cast<size_t>(column->column) != index->column)
+                    continue;
+
+                bool lower = op == EO_EQUALS || op == EO_GREATER_THAN || op == EO_GREATER_THAN_EQUALS;
+                bool upper = op == EO_EQUALS || op == EO_LESS_THAN || op == EO_LESS_THAN_EQUAL;
+                bool inclusive = op == EO_EQUALS || op == EO_GREATER_THAN_EQUALS || op == EO_LESS_THAN_EQUAL;
+                eq |= op == EO_EQUALS;
+
+                // Keep the tighter of two bounds on the same side
+                if (lower) {
+                    int c = has_lo ? CompareValues(v, lo) : 1;
+                    if (c > 0 || (c == 0 && !inclusive)) {
+                        lo = v;
+                        lo_inc = inclusive;
+                    }
+                    has_lo = true;
+                }
+                if (upper) {
+                    int c = has_hi ? CompareValues(v, hi) : -1;
+                    if (c < 0 || (c == 0 && !inclusive)) {
+                        hi = v;
+                        hi_inc = inclusive;
                     }
+                    has_hi = true;
+                }
+            }
+
+            if ((!has_lo && !has_hi) || (best && (best_eq || !eq)))
+                continue;
+
+            best = index.get();
+            best_lo = lo, best_hi = hi;
+            best_has_lo = has_lo, best_has_hi = has_hi;
+            best_lo_inc = lo_inc, best_hi_inc = hi_inc;
+            best_eq = eq;
+        }
+
+        if (!best || !best->Lookup(best_has_lo ? &best_lo : nullptr, best_lo_inc,
+                                   best_has_hi ? &best_hi : nullptr, best_hi_inc, rows))
+            return false;
+
+        // Rows appended after the snapshot are already in the index
+        rows.erase(std::remove_if(rows.begin(), rows.end(), [&](RowId id) { return !table.Visible(id); }), rows.end());
+
+        // Back in table order, which also reads every row group once
+        std::sort(rows.begin(), rows.end());
+        return true;
+    }
+
+    /* Split the FROM tables into morsels: joined tuples, index hits or whole row groups */
+    static bool PlanMorsels(const SelectQuery &query, const std::vector<TableSnapshot> &tables,
+                            const std::vector<Value> &params, QueryProfile *profile, MorselSource &source)
+    {
+        // No tables, evaluate the expressions once e.g select 1 + 2
+        if (tables.empty()) {
+            source.count = 1;
+            source.load = [](size_t, Batch &batch, RowGroup&) {
+                batch.count = 1;
+                return true;
+            };
+            return true;
+        }
 
+        if (tables.size() > 1) {
+            if (!JoinTables(query, tables, params, source.join, profile))
+                return false;
+
+            // Joined tuples are gathered ROW_GROUP_SIZE at a time
+            const auto &join = source.join;
+            const size_t tuples = join.tuples.size() / join.width;
+            source.count = (tuples + ROW_GROUP_SIZE - 1) / ROW_GROUP_SIZE;
+            source.load = [&query, &join, &tables, tuples](size_t i, Batch &batch, RowGroup&) {
+                PrepareGathered(batch, tables);
+                const size_t end = std::min(tuples, (i + 1) * ROW_GROUP_SIZE);
+                for (size_t t = i * ROW_GROUP_SIZE; t < end; ++t) {
+                    const auto *tuple = &join.tuples[t * join.width];
+                    for (size_t slot = 0; slot < join.width; ++slot)
+                        GatherRow(batch, slot, join.tables[slot].Group(tuple[slot]), RowIdRow(tuple[slot]), query.referenced[slot]);
                 }
+                batch.count = end - i * ROW_GROUP_SIZE;
+                SealGathered(batch);
+                return true;
+            };
+            return true;
+        }
+
+        const auto &table = tables[0];
+        auto scan = profile ? &profile->scans[0] : nullptr;
+        OperatorTimer timer{scan};
+        if (scan) {
+            scan->groups += table.GroupCount();
+            scan->rows_in += table.RowCount();
+        }
 
-                /* Read rows from DB */
-                for (const auto& table: table_references) {
-                    printf("In table: %s\n", table.first.c_str());
-                    for (const auto& col: table.second) {
-                        printf("\tCOL: %s\n", col.c_str());
+        if (IndexRows(query.filters, table, params, source.rows)) {
+            if (profile)
+                profile->index_scan = true;
+
+            // Index hits are gathered ROW_GROUP_SIZE at a time, in table order
+            const auto &rows = source.rows;
+            source.count = (rows.size() + ROW_GROUP_SIZE - 1) / ROW_GROUP_SIZE;
+            source.load = [&query, &rows, &table, &tables](size_t i, Batch &batch, RowGroup &scratch) {
+                PrepareGathered(batch, tables);
+                const RowGroup *group = nullptr;
+                size_t loaded = SIZE_MAX;
+                const size_t end = std::min(rows.size(), (i + 1) * ROW_GROUP_SIZE);
+
+                for (size_t r = i * ROW_GROUP_SIZE; r < end; ++r) {
+                    if (RowIdGroup(rows[r]) != loaded) {
+                        loaded = RowIdGroup(rows[r]);
+                        group = table.LoadGroup(loaded, scratch, query.referenced[0]);
+                        if (!group)
+                            return false;
                     }
+                    GatherRow(batch, 0, *group, RowIdRow(rows[r]), query.referenced[0]);
                 }
+                batch.count = end - i * ROW_GROUP_SIZE;
+                SealGathered(batch);
+                return true;
+            };
+            return true;
+        }
+
+        // A full scan references row groups in place, one morsel each. Zone maps rule groups
+        // out before they're read, groups on disk only decode the columns read
+        for (size_t i = 0; i < table.GroupCount(); ++i)
+            if (GroupMayMatch(query, 0, table, i, params))
+                source.groups.push_back(i);
+        if (scan)
+            scan->groups_skipped += table.GroupCount() - source.groups.size();
+
+        const auto &groups = source.groups;
+        source.count = groups.size();
+        source.load = [&query, &table, &groups](size_t i, Batch &batch, RowGroup &scratch) {
+            auto group = table.LoadGroup(groups[i], scratch, query.referenced[0]);
+            if (!group)
+                return false;
+
+            batch.columns.resize(1);
+            batch.columns[0].resize(group->columns.size());
+            for (size_t c = 0; c < group->columns.size(); ++c)
+                batch.columns[0][c].Reference(group->columns[c]);
+            batch.count = table.Rows(groups[i]);
+            return true;
+        };
+        return true;
+    }
+
+    void SelectQuery::Execute(const std::vector<Value> &params, QueryProfile *profile, ResultRows *result) const
+    {
+        // Every table as of now, rows written while the query runs aren't seen
+        std::vector<TableStorage*> storage;
+        for (const auto &table : tables)
+            storage.push_back(GetTable(std::string(table.name)));
+        ReadSnapshot snapshot{storage};
+
+        if (!profile && !result) {
+            for (size_t i = 0; i < columns.size(); ++i)
+                Print("%s%s", i ? " | " : "", columns[i]->GetAlias().c_str());
+            Print("\n");
+        }
+
+        if (limit == 0)
+            return;
+
+        MorselSource source;
+        if (!PlanMorsels(*this, snapshot.tables, params, profile, source))
+            return;
+
+        if (!IsAggregate() && order_by.empty()) {
+            RunMorsels(*this, source, params, profile, result);
+            return;
+        }
+
+        size_t emitted = 0;
+        auto print = [&](const std::string &line) {
+            if (result) {
+                result->data += line;
+                result->ends.push_back(result->data.size());
+            } else if (!profile) {
+                fwrite(line.data(), 1, line.size(), Output());
+            }
+            emitted++;
+            return limit < 0 || emitted < static_cast<size_t>(limit);
+        };
+        // The operator feeding print() and, under a LIMIT, the limit see every row it printed
+        auto printed = [&](OperatorStats &from) {
+            profile->rows = emitted;
+            from.rows_out += emitted;
+            if (limit >= 0) {
+                profile->limit.rows_in += emitted;
+                profile->limit.rows_out += emitted;
+            }
+        };
 
+        // A LIMIT whose rows fit the budget keeps a top-K heap, anything else goes through the external sort
+        const bool top_k = limit >= 0 && static_cast<size_t>(limit) * TOP_K_ROW_BYTES <= WorkMemBytes;
+        const size_t max_rows = top_k ? static_cast<size_t>(limit) : SIZE_MAX;
+        TopK heap{top_k ? static_cast<size_t>(limit) : 0};
+        ExternalSorter sorter{WorkMemBytes};
+        auto add = [&](std::vector<SortRow> &&rows) {
+            if (!top_k)
+                return sorter.Add(std::move(rows));
+            heap.Add(std::move(rows));
+            return true;
+        };
 
+        if (!IsAggregate()) {
+            bool ok = ScanMorsels(source, params, profile, [&](size_t morsel, const Batch &batch) {
+                std::vector<SortRow> rows;
+                SortBatch(*this, batch, morsel, max_rows, result != nullptr, rows, profile);
+                OperatorTimer timer{profile ? &profile->sort : nullptr};
+                return add(std::move(rows));
+            });
+            if (!ok)
+                return;
+            if (profile)
+                profile->sort.rows_in += profile->project.rows_out;
+        } else {
+            HashAggregation aggregation{*this, params, WorkMemBytes};
+            bool scanned = ScanMorsels(source, params, profile, [&](size_t, const Batch &batch) {
+                std::vector<Vector> regs;
+                std::vector<uint8_t> keep;
+                if (!RunProgram(program, batch, regs, keep, profile))
+                    return true;
+                OperatorTimer timer{profile ? &profile->aggregate : nullptr};
+                return aggregation.Consume(batch, regs, keep);
+            });
+            if (!scanned)
+                return;
 
+            OperatorTimer timer{profile ? &profile->aggregate : nullptr};
+            if (profile) {
+                profile->aggregate.rows_in += profile->project.rows_out;
+                profile->spills += aggregation.spills;
             }
-            
+
+            if (order_by.empty()) {
+                aggregation.Finish([&](const std::vector<Value> &row) {
+                    std::string line;
+                    FormatRow(row, result != nullptr, line);
+                    return print(line);
+                });
+                if (profile)
+                    printed(profile->aggregate);
+                return;
+            }
+
+            // Groups come out of the hash table in no order, sort them like any other rows
+            std::vector<SortRow> rows;
+            int64_t seq = 0;
+            bool ok = true;
+            bool finished = aggregation.Finish([&](const std::vector<Value> &row) {
+                SortRow r;
+                for (const auto &key : order_by)
+                    EncodeSortKey(row[key.column], key.desc, r.key);
+                EncodeSortKey(Value::Int(seq++), false, r.key);
+                FormatRow(row, result != nullptr, r.line);
+                rows.push_back(std::move(r));
+                if (rows.size() < ROW_GROUP_SIZE)
+                    return true;
+
+                ok = add(std::move(rows));
+                rows.clear();
+                return ok;
+            });
+            if (!finished || !ok || !add(std::move(rows)))
+                return;
+            if (profile) {
+                profile->aggregate.rows_out += static_cast<uint64_t>(seq);
+                profile->sort.rows_in += static_cast<uint64_t>(seq);
+            }
+        }
+
+        {
+            OperatorTimer timer{profile ? &profile->sort : nullptr};
+            if (top_k)
+                heap.Finish(print);
+            else
+                sorter.Finish(print);
         }
+        if (profile) {
+            printed(profile->sort);
+            profile->spills += sorter.RunCount();
+        }
+    }
 
+    /* One line of the operator tree, indented by depth, with its counters when it ran */
+    static void PrintOperator(int depth, const std::string &label, const OperatorStats *stats, bool scan = false)
+    {
+        Print("%*s%s", depth * 2, "", label.c_str());
+        if (!stats) {
+            Print("\n");
+            return;
+        }
 
+        // Wall time from the operator's first start to its last finish, thread time adds up every thread's share
+        const uint64_t first = stats->first_start.load(), last = stats->last_end.load();
+        const double wall = last > first ? static_cast<double>(last - first) / 1e6 : 0;
+        int pad = 48 - depth * 2 - static_cast<int>(label.size());
+        Print("%*s rows %llu -> %llu, %.3f ms, %.3f ms thread time", pad > 0 ? pad : 0, "",
+              static_cast<unsigned long long>(stats->rows_in.load()), static_cast<unsigned long long>(stats->rows_out.load()),
+              wall, static_cast<double>(stats->nanos.load()) / 1e6);
+        if (HAS_CYCLE_COUNTER)
+            Print(", %llu cycles", static_cast<unsigned long long>(stats->cycles.load()));
+        if (CountingAllocations)
+            Print(", %llu bytes allocated", static_cast<unsigned long long>(stats->bytes.load()));
+        if (scan)
+            Print(", %llu of %llu row groups skipped",
+                  static_cast<unsigned long long>(stats->groups_skipped.load()), static_cast<unsigned long long>(stats->groups.load()));
+        Print("\n");
+    }
+
+    /* The index IndexRows() would try first for a single table scan, judging only by which columns the filters compare */
+    static IndexPtr CandidateIndex(const SelectQuery &query)
+    {
+        auto storage = GetTable(std::string(query.tables[0].name));
+        if (!storage)
+            return nullptr;
+        ReadSnapshot snapshot{{storage}};
+
+        auto literal = [](const Expr *e) {
+            return dynamic_cast<const IntExpr*>(e) || dynamic_cast<const FloatExpr*>(e) ||
+                   dynamic_cast<const StringExpr*>(e) || dynamic_cast<const ParamExpr*>(e);
+        };
+
+        IndexPtr best;
+        bool best_eq = false;
+        for (const auto &index : snapshot.tables[0].version->indexes) {
+            bool used = false, eq = false;
+            for (const auto &filter : query.filters) {
+                auto l = dynamic_cast<const VariableExpr*>(filter.lhs), r = dynamic_cast<const VariableExpr*>(filter.rhs);
+                auto column = l && literal(filter.rhs) ? l : r && literal(filter.lhs) ? r : nullptr;
+                if (!column || static_cast<size_t>(column->column) != index->column)
+                    continue;
+                used = true;
+                eq |= filter.Op == EO_EQUALS;
+            }
+
+            if (!used || (best && (best_eq || !eq)))
+                continue;
+            best = index;
+            best_eq = eq;
+        }
+        return best;
+    }
+
+    void PrintPlan(const SelectQuery &query, const QueryProfile *profile)
+    {
+        const auto &program = query.program;
+        auto stats = [&](OperatorStats QueryProfile::*op) { return profile ? &(profile->*op) : nullptr; };
+        int depth = 0;
+
+        if (query.limit >= 0)
+            PrintOperator(depth++, "LIMIT " + std::to_string(query.limit), stats(&QueryProfile::limit));
+        if (query.order_by.size()) {
+            const bool top_k = query.limit >= 0 &&
+                               static_cast<size_t>(query.limit) * TOP_K_ROW_BYTES <= WorkMemBytes;
+            PrintOperator(depth++, "SORT " + std::to_string(query.order_by.size()) + (top_k ? " keys, top-K" : " keys"),
+                          stats(&QueryProfile::sort));
+        }
+        if (query.IsAggregate())
+            PrintOperator(depth++, "AGGREGATE " + std::to_string(query.group_by.size()) + " keys, " +
+                                   std::to_string(query.aggregates.size()) + " aggregates", stats(&QueryProfile::aggregate));
+
+        const size_t exprs = program.columns.size() + program.group_keys.size() + program.aggregate_args.size();
+        PrintOperator(depth++, "PROJECT " + std::to_string(exprs) + " expressions", stats(&QueryProfile::project));
+        if (program.filter_end)
+            PrintOperator(depth++, "FILTER", stats(&QueryProfile::filter));
+        if (query.tables.size() > 1)
+            PrintOperator(depth++, "JOIN " + std::to_string(query.tables.size()) + " tables", stats(&QueryProfile::join));
+
+        for (size_t slot = 0; slot < query.tables.size(); ++slot) {
+            const auto &table = query.tables[slot];
+            std::string label = profile && profile->index_scan ? "INDEX SCAN " : "SCAN ";
+            label += std::string(table.name);
+            if (table.alias != table.name)
+                label += " AS " + std::string(table.alias);
+            if (slot < query.join_filters.size() && query.join_filters[slot].code.size())
+                label += ", filtered";
+            // Whether the index applies depends on the bound values, EXPLAIN ANALYZE shows what was used
+            if (!profile && query.tables.size() == 1)
+                if (auto index = CandidateIndex(query))
+                    label += ", index " + index->name + " if its bounds apply";
+            PrintOperator(depth, label, profile ? &profile->scans[slot] : nullptr, true);
+        }
+    }
+
+    bool ModifyQuery::Validate()
+    {
+        if (!select.Validate())
+            return false;
+
+        if (select.IsAggregate()) {
+            Print("Aggregate functions can't be used in SET\n");
+            return false;
+        }
+
+        const auto &schema = database_tables.find(std::string(select.tables[0].name))->second;
+        targets.clear();
+        for (size_t i = 0; i < target_names.size(); ++i) {
+            auto name = target_names[i];
+            auto col = schema.find(name);
+            if (col == schema.end()) {
+                Print("Unknown column '%.*s'\n", static_cast<int>(name.size()), name.data());
+                return false;
+            }
+
+            auto type = ExprType(select.columns[i]);
+            if (type != col->second && !(col->second == CT_FLOAT && type == CT_INT)) {
+                Print("Type mismatch for column '%.*s'\n", static_cast<int>(name.size()), name.data());
+                return false;
+            }
+            targets.push_back(static_cast<size_t>(col - schema.begin()));
+        }
+        return true;
+    }
+
+    size_t ModifyQuery::Execute() const
+    {
+        auto storage = GetTable(std::string(select.tables[0].name));
+        size_t ncols = storage->schema.size();
+
+        Batch batch;
+        batch.columns.resize(1);
+        batch.columns[0].resize(ncols);
+
+        // Rows are read from the version readers see, which under WriterLock is the live table. Group
+        // j of it is group i of the live table, they drift apart as emptied groups are removed
+        ReadSnapshot snapshot{{storage}};
+        const auto &table = snapshot.tables[0];
+
+        RowGroup scratch;
+        std::vector<uint8_t> keep;
+        std::vector<Vector> regs;
+        size_t changed = 0;
+        size_t i = 0;
+
+        for (size_t j = 0; j < table.GroupCount(); ++j, ++i) {
+            if (!GroupMayMatch(select, 0, table, j, {}))
+                continue;
+
+            auto group = table.LoadGroup(j, scratch);
+            if (!group)
+                break;
+
+            const size_t rows = table.Rows(j);
+            for (size_t c = 0; c < ncols; ++c)
+                batch.columns[0][c].Reference(group->columns[c]);
+            batch.count = rows;
+
+            if (!select.program.Run(batch, regs, keep))
+                continue;
+
+            size_t matched = 0;
+            for (auto k : keep)
+                matched += k;
+
+            // Deleted rows are dropped, updated ones take their SET values
+            RowGroup next;
+            next.rows = is_delete ? rows - matched : rows;
+            for (size_t c = 0; c < ncols; ++c) {
+                next.columns.emplace_back(storage->schema.columns[c].second);
+                next.columns.back().Reserve(next.rows);
+            }
+
+            for (size_t row = 0; row < rows; ++row) {
+                if (is_delete && keep[row])
+                    continue;
+                for (size_t c = 0; c < ncols; ++c)
+                    next.columns[c].Append(group->columns[c].Get(row));
+            }
+
+            if (!is_delete) {
+                for (size_t t = 0; t < targets.size(); ++t) {
+                    auto &col = next.columns[targets[t]];
+                    for (size_t row = 0; row < rows; ++row) {
+                        if (!keep[row])
+                            continue;
+                        auto v = regs[select.program.columns[t]].Get(row);
+                        switch (col.type) {
+                        case CT_INT:   col.ints[row] = v.i;           break;
+                        case CT_FLOAT: col.floats[row] = v.AsFloat(); break;
+                        case CT_STR:   col.strs[row] = std::move(v.s); break;
+                        }
+                    }
+                }
+            }
+
+            changed += matched;
+            bool removed = !next.rows;
+            if (!storage->ReplaceGroup(i, std::move(next)))
+                break;
+            if (removed)
+                --i;
+        }
+        // Row ids have moved, deleted rows shift everything after them
+        if (changed)
+            storage->RebuildIndexes();
 
+        // Readers see the whole statement or none of it
+        storage->Publish();
+        return changed;
     }
-}
\ No newline at end of file
+}
@@ -5,8 +5,13 @@
 #include <string>
 #include <memory>
 #include <utility>
+#include <cstdint>
 
+#include "arena.h"
 #include "parser.h"
+#include "database.h"
+#include "profile.h"
+#include "vm.h"
 
 
 namespace asql {
@@ -20,44 +25,139 @@ namespace asql {
         EO_GREATER_THAN_EQUALS,
     };
 
-    enum ColumnType: int {
-        CT_INT = 1,
-        CT_FLOAT,
-        CT_STR
-    };
-
     class Table {
     public:
-        Table(const std::string& name):
+        Table(std::string_view name):
             name{name},
             alias{name} {}
-        std::string name;
-        std::string alias; 
+        std::string_view name;
+        std::string_view alias;
     };
 
 
     class Filter {
     public:
-        Filter(std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs, EqualityOp Op):
-            lhs{std::move(lhs)},
-            rhs{std::move(rhs)},
+        Filter(Expr *lhs, Expr *rhs, EqualityOp Op):
+            lhs{lhs},
+            rhs{rhs},
             Op{Op} {}
-        std::unique_ptr<Expr> lhs;
-        std::unique_ptr<Expr> rhs;
+        Expr *lhs;
+        Expr *rhs;
         EqualityOp Op;
     };
 
 
+    /* ORDER BY expression. Validate() points it at the output column it sorts by, if there is one */
+    struct OrderKey {
+        OrderKey(Expr *expr): expr{expr} {}
+        Expr *expr;
+        bool desc = false;
+        int column = -1;
+    };
+
+    /* Memory one aggregation or sort may hold before it spills to temporary files */
+    extern size_t WorkMemBytes;
+
+    /* Where an output column of an aggregating SELECT comes from */
+    enum OutputSource {
+        OS_GROUP_KEY,  // index into group_by
+        OS_AGGREGATE,  // index into aggregates
+        OS_CONSTANT,   // evaluated once, e.g. a literal
+    };
+
+    struct AggregateOutput {
+        OutputSource source;
+        size_t index;
+    };
+
+
+    /*
+    * Result rows of SelectQuery::Execute() collected instead of printed, for
+    * the embedding API. Row i is data from ends[i - 1] (or 0) up to ends[i],
+    * its values one after another as EncodeResultValue() wrote them.
+    */
+    struct ResultRows {
+        std::string data;
+        std::vector<size_t> ends;
+    };
+
+    /* A type byte, then the int or double's 8 bytes or a 4 byte length and the string, host byte order */
+    void EncodeResultValue(const Value &v, std::string &out);
+
+    /* A parsed SELECT. The query and its first arena block are a single allocation,
+       every Expr, Table, Filter and string it references lives in the arena */
     class SelectQuery {
     public:
-        void Validate();
-        std::vector<std::unique_ptr<Expr>> columns;
-        std::vector<Table> tables;
-        std::vector<Filter> filters;
+        SelectQuery():
+            columns{&arena},
+            tables{&arena},
+            filters{&arena},
+            group_by{&arena},
+            order_by{&arena} {}
+
+        bool Validate();
+        /* Has aggregates or a GROUP BY, rows are folded into groups before output */
+        bool IsAggregate() const { return !outputs.empty(); }
+        /*
+        * Run the validated query, params holds one value per '?'. With a profile
+        * the operators count into it and the result rows are dropped instead of
+        * printed, with a result they're collected into it.
+        */
+        void Execute(const std::vector<Value> &params = {}, QueryProfile *profile = nullptr, ResultRows *result = nullptr) const;
+
+        // Declared first so it outlives the containers below
+        Arena arena;
+        ArenaVector<Expr*> columns;
+        ArenaVector<Table> tables;
+        ArenaVector<Filter> filters;
+        ArenaVector<Expr*> group_by;
+        ArenaVector<OrderKey> order_by;
         int limit = -1;
+        int param_count = 0;
+
+        /* Set by Validate() for aggregating queries, one output per column */
+        std::vector<const AggregateExpr*> aggregates;
+        std::vector<AggregateOutput> outputs;
+        /* Set by Validate(), referenced[slot][column] is set for every column the query reads */
+        std::vector<std::vector<bool>> referenced;
+        /* Compiled by Validate(). A join runs join_filters[slot] on the slot's rows before joining them */
+        Program program;
+        std::vector<Program> join_filters;
     };
 
-    using ColumnPair = std::pair<std::string, ColumnType>;
-    extern std::unordered_map<std::string, std::unordered_map<std::string, ColumnType>> database_tables;
+
+    /*
+    * False when the zone maps of group i of table prove that none of its rows
+    * passes the query's comparisons of a slot column against a literal or
+    * parameter, so the group doesn't have to be read at all. The open tail's
+    * zone maps are still changing, it's always read.
+    */
+    bool GroupMayMatch(const SelectQuery &query, size_t slot, const TableSnapshot &table, size_t i,
+                       const std::vector<Value> &params);
+
+
+    /*
+    * Print the operator tree of the validated query, the root first and every
+    * operator above its input. With a profile from Execute() each operator
+    * has its counters from that run next to it, otherwise a single table scan
+    * names the index it will try, which only applies if the bound values can
+    * be looked up in it.
+    */
+    void PrintPlan(const SelectQuery &query, const QueryProfile *profile = nullptr);
+
+
+    /* A parsed UPDATE or DELETE. The SET values and WHERE clause are bound like a
+       SELECT over the one table, targets are the columns the SET values replace */
+    class ModifyQuery {
+    public:
+        bool Validate();
+        /* Rewrite every row group holding a matching row, returns the rows changed */
+        size_t Execute() const;
+
+        SelectQuery select;
+        ArenaVector<std::string_view> target_names{&select.arena};
+        std::vector<size_t> targets;
+        bool is_delete = false;
+    };
 
 }
\ No newline at end of file
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+
+namespace asql {
+
+    /* Append-only byte buffer for the on-disk formats. Values are stored in host byte order */
+    class ByteWriter {
+    public:
+        template <typename T>
+        void Put(T v)
+        {
+            static_assert(std::is_trivially_copyable_v<T>, "Put() copies raw bytes");
+            auto p = reinterpret_cast<const char*>(&v);
+            buf.insert(buf.end(), p, p + sizeof(T));
+        }
+
+        void PutBytes(const void *data, size_t len)
+        {
+            auto p = static_cast<const char*>(data);
+            buf.insert(buf.end(), p, p + len);
+        }
+
+        void PutString(std::string_view s)
+        {
+            Put(static_cast<uint32_t>(s.size()));
+            PutBytes(s.data(), s.size());
+        }
+
+        std::vector<char> buf;
+    };
+
+
+    /* Reads back what ByteWriter wrote. Running off the end clears ok instead of crashing */
+    class ByteReader {
+    public:
+        ByteReader(const char *data, size_t len): pos{data}, end{data + len} {}
+
+        template <typename T>
+        T Get()
+        {
+            T v{};
+            GetBytes(&v, sizeof(T));
+            return v;
+        }
+
+        void GetBytes(void *out, size_t len)
+        {
+            if (static_cast<size_t>(end - pos) < len) {
+                ok = false;
+                pos = end;
+                return;
+            }
+            memcpy(out, pos, len);
+            pos += len;
+        }
+
+        /* The next len bytes in place, null if there aren't that many */
+        const char* Take(size_t len)
+        {
+            if (static_cast<size_t>(end - pos) < len) {
+                ok = false;
+                pos = end;
+                return nullptr;
+            }
+            pos += len;
+            return pos - len;
+        }
+
+        void Skip(size_t len) { Take(len); }
+
+        std::string GetString()
+        {
+            auto len = Get<uint32_t>();
+            if (static_cast<size_t>(end - pos) < len) {
+                ok = false;
+                pos = end;
+                return {};
+            }
+            std::string s(pos, len);
+            pos += len;
+            return s;
+        }
+
+        bool ok = true;
+
+    private:
+        const char *pos;
+        const char *end;
+    };
+
+}
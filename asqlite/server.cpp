@@ -0,0 +1,484 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "server.h"
+#include "output.h"
+#include "parser.h"
+#include "statement.h"
+
+
+namespace asql {
+
+    static constexpr size_t FRAME_HEADER_BYTES = 5;
+
+    /* Frames */
+
+    /* All of data, waiting for the socket to drain when it is non-blocking */
+    static bool SendAll(int fd, const char *data, size_t size)
+    {
+        while (size) {
+            ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+            if (n >= 0) {
+                data += n;
+                size -= static_cast<size_t>(n);
+                continue;
+            }
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                pollfd p{fd, POLLOUT, 0};
+                if (poll(&p, 1, -1) < 0 && errno != EINTR)
+                    return false;
+            } else if (errno != EINTR) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static bool RecvAll(int fd, char *data, size_t size)
+    {
+        while (size) {
+            ssize_t n = recv(fd, data, size, 0);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            data += n;
+            size -= static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    static uint32_t FrameLength(const char *header)
+    {
+        uint32_t len = 0;
+        for (int i = 3; i >= 0; --i)
+            len = len << 8 | static_cast<uint8_t>(header[i]);
+        return len;
+    }
+
+    bool WriteFrame(int fd, MessageType type, std::string_view payload)
+    {
+        // Header and payload leave in one send, so a small frame is a single packet
+        const uint32_t len = static_cast<uint32_t>(payload.size() + 1);
+        std::string frame;
+        frame.reserve(FRAME_HEADER_BYTES + payload.size());
+        for (int i = 0; i < 4; ++i)
+            frame += static_cast<char>(len >> (8 * i));
+        frame += static_cast<char>(type);
+        frame += payload;
+        return SendAll(fd, frame.data(), frame.size());
+    }
+
+    bool ReadFrame(int fd, MessageType &type, std::string &payload)
+    {
+        char header[FRAME_HEADER_BYTES];
+        if (!RecvAll(fd, header, sizeof(header)))
+            return false;
+
+        const uint32_t len = FrameLength(header);
+        if (len == 0 || len > MAX_FRAME_BYTES + 1)
+            return false;
+
+        type = static_cast<MessageType>(header[4]);
+        payload.resize(len - 1);
+        return RecvAll(fd, payload.data(), payload.size());
+    }
+
+    int ConnectServer(const char *path, int port)
+    {
+        int fd;
+        if (path && *path) {
+            sockaddr_un addr{};
+            addr.sun_family = AF_UNIX;
+            if (strlen(path) >= sizeof(addr.sun_path))
+                return -1;
+            strcpy(addr.sun_path, path);
+            fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (fd >= 0 && connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0)
+                return fd;
+        } else {
+            sockaddr_in addr{};
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(static_cast<uint16_t>(port));
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            int one = 1;
+            if (fd >= 0 && connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0 &&
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) == 0)
+                return fd;
+        }
+
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    /* Connections */
+
+    /* A client. The event loop owns it while it is open, a session thread holds it while running its queries */
+    struct Connection {
+        Connection(int fd): fd{fd} {}
+        ~Connection() { close(fd); }
+
+        const int fd;
+        Session session;
+        // Bytes of frames not read completely yet, only touched by the event loop
+        std::string input;
+
+        std::mutex lock;
+        std::deque<std::string> queries;
+        // A session thread is working through queries
+        bool running = false;
+        // Sending failed, the client is gone. Set by whichever thread flushed the output
+        std::atomic<bool> failed{false};
+    };
+
+    using ConnectionPtr = std::shared_ptr<Connection>;
+
+    /* stdio write hook of a connection's output stream, every buffer flushed is one MSG_OUTPUT frame */
+    static ssize_t WriteOutput(void *cookie, const char *data, size_t size)
+    {
+        auto conn = static_cast<Connection*>(cookie);
+        if (!conn->failed && !WriteFrame(conn->fd, MSG_OUTPUT, {data, size}))
+            conn->failed = true;
+        // Output for a client that went away is dropped, the statement still runs to completion
+        return static_cast<ssize_t>(size);
+    }
+
+    /* Run the connection's queued queries until there are none left, the session's output goes to the client */
+    static void RunQueries(Connection &conn)
+    {
+        cookie_io_functions_t io{nullptr, WriteOutput, nullptr, nullptr};
+        FILE *out = fopencookie(&conn, "w", io);
+        if (out)
+            setvbuf(out, nullptr, _IOFBF, OUTPUT_FRAME_BYTES);
+        else
+            conn.failed = true;
+        SetOutput(out);
+
+        while ( true ) {
+            std::string sql;
+            {
+                std::lock_guard<std::mutex> guard{conn.lock};
+                if (conn.queries.empty() || conn.failed) {
+                    conn.queries.clear();
+                    conn.running = false;
+                    break;
+                }
+                sql = std::move(conn.queries.front());
+                conn.queries.pop_front();
+            }
+
+            RunStatements(conn.session, sql);
+            fflush(out);
+            if (!conn.failed && !WriteFrame(conn.fd, MSG_DONE, {}))
+                conn.failed = true;
+        }
+
+        SetOutput(nullptr);
+        if (out)
+            fclose(out);
+    }
+
+    /* Threads running the queries of connections, a connection is worked on by one thread at a time */
+    class SessionPool {
+    public:
+        SessionPool(size_t threads)
+        {
+            for (size_t i = 0; i < threads; ++i)
+                workers.emplace_back([this] { WorkerLoop(); });
+        }
+
+        /* Waits for the queries running, connections still waiting are dropped */
+        ~SessionPool()
+        {
+            {
+                std::lock_guard<std::mutex> guard{lock};
+                stopping = true;
+            }
+            wake.notify_all();
+            for (auto &t : workers)
+                t.join();
+        }
+
+        void Submit(ConnectionPtr conn)
+        {
+            {
+                std::lock_guard<std::mutex> guard{lock};
+                ready.push_back(std::move(conn));
+            }
+            wake.notify_one();
+        }
+
+    private:
+        void WorkerLoop()
+        {
+            while ( true ) {
+                ConnectionPtr conn;
+                {
+                    std::unique_lock<std::mutex> guard{lock};
+                    wake.wait(guard, [&] { return stopping || !ready.empty(); });
+                    if (stopping)
+                        return;
+                    conn = std::move(ready.front());
+                    ready.pop_front();
+                }
+                RunQueries(*conn);
+            }
+        }
+
+        std::vector<std::thread> workers;
+        std::mutex lock;
+        std::condition_variable wake;
+        std::deque<ConnectionPtr> ready;
+        bool stopping = false;
+    };
+
+    /*
+    * Read what the client sent and queue its complete queries. False once the
+    * connection is closed or broken, queries it completed before that still run.
+    */
+    static bool ReadConnection(const ConnectionPtr &conn, SessionPool &pool)
+    {
+        bool open = true;
+        char buf[64 << 10];
+        while ( true ) {
+            ssize_t n = recv(conn->fd, buf, sizeof(buf), 0);
+            if (n > 0) {
+                conn->input.append(buf, static_cast<size_t>(n));
+                continue;
+            }
+            if (n < 0 && errno == EINTR)
+                continue;
+            open = n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+            break;
+        }
+
+        std::vector<std::string> queries;
+        size_t pos = 0;
+        auto &input = conn->input;
+        while (input.size() - pos >= FRAME_HEADER_BYTES) {
+            const uint32_t len = FrameLength(input.data() + pos);
+            if (len == 0 || len > MAX_FRAME_BYTES + 1 || input[pos + 4] != MSG_QUERY) {
+                open = false;
+                break;
+            }
+            if (input.size() - pos < 4 + static_cast<size_t>(len))
+                break;
+
+            queries.emplace_back(input, pos + FRAME_HEADER_BYTES, len - 1);
+            pos += 4 + static_cast<size_t>(len);
+        }
+        input.erase(0, pos);
+
+        if (queries.size()) {
+            std::lock_guard<std::mutex> guard{conn->lock};
+            for (auto &q : queries)
+                conn->queries.push_back(std::move(q));
+            if (!conn->running) {
+                conn->running = true;
+                pool.Submit(conn);
+            }
+        }
+        return open;
+    }
+
+    /* Server */
+
+    static int ListenUnix(const std::string &path)
+    {
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path)) {
+            Print("Socket path '%s' is too long\n", path.c_str());
+            return -1;
+        }
+        strcpy(addr.sun_path, path.c_str());
+
+        // A socket file left behind by a server that didn't shut down cleanly
+        unlink(path.c_str());
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0 || bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+            Print("Unable to listen on '%s': %s\n", path.c_str(), strerror(errno));
+            if (fd >= 0)
+                close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    static int ListenTcp(int port)
+    {
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(static_cast<uint16_t>(port));
+        // Loopback only, there is no authentication
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        int one = 1;
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+            bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+            Print("Unable to listen on 127.0.0.1:%d: %s\n", port, strerror(errno));
+            if (fd >= 0)
+                close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    static sigset_t ShutdownSignals()
+    {
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        return signals;
+    }
+
+    void BlockShutdownSignals()
+    {
+        auto signals = ShutdownSignals();
+        pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    }
+
+    bool Serve(const ServerOptions &options)
+    {
+        std::vector<std::pair<int, bool>> listeners;  // fd, is tcp
+        auto close_all = [&] {
+            for (auto l : listeners)
+                close(l.first);
+        };
+
+        if (options.socket_path.size()) {
+            int fd = ListenUnix(options.socket_path);
+            if (fd < 0)
+                return false;
+            listeners.push_back({fd, false});
+        }
+        if (options.port) {
+            int fd = ListenTcp(options.port);
+            if (fd < 0) {
+                close_all();
+                return false;
+            }
+            listeners.push_back({fd, true});
+        }
+
+        // Shutdown signals arrive through the event loop like everything else. Every thread has to
+        // have them blocked, one that doesn't would take them and the process dies without a checkpoint
+        auto signals = ShutdownSignals();
+        sigset_t blocked;
+        pthread_sigmask(SIG_BLOCK, nullptr, &blocked);
+        if (!sigismember(&blocked, SIGINT) || !sigismember(&blocked, SIGTERM)) {
+            Print("Shutdown signals aren't blocked, call BlockShutdownSignals() before starting threads\n");
+            close_all();
+            return false;
+        }
+        int sigfd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+
+        int epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (epfd < 0 || sigfd < 0) {
+            Print("Unable to set up the event loop: %s\n", strerror(errno));
+            close_all();
+            return false;
+        }
+
+        auto watch = [&](int fd) {
+            epoll_event ev{};
+            ev.events = EPOLLIN;
+            ev.data.fd = fd;
+            return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == 0;
+        };
+        watch(sigfd);
+        for (auto l : listeners)
+            watch(l.first);
+
+        // Session threads block on queries and the thread pool, so they're separate from its workers
+        size_t threads = options.session_threads ? options.session_threads : std::max(std::thread::hardware_concurrency(), 1u);
+        std::unordered_map<int, ConnectionPtr> connections;
+        {
+            SessionPool pool{threads};
+            if (options.socket_path.size())
+                Print("Listening on %s\n", options.socket_path.c_str());
+            if (options.port)
+                Print("Listening on 127.0.0.1:%d\n", options.port);
+            Print("%zu session threads\n", threads);
+            fflush(Output());
+
+            epoll_event events[64];
+            bool stop = false;
+            while (!stop) {
+                int n = epoll_wait(epfd, events, 64, -1);
+                if (n < 0 && errno != EINTR) {
+                    Print("epoll_wait failed: %s\n", strerror(errno));
+                    break;
+                }
+
+                for (int i = 0; i < n; ++i) {
+                    int fd = events[i].data.fd;
+                    if (fd == sigfd) {
+                        // Consume it, it'd be delivered once unblocked again
+                        signalfd_siginfo info;
+                        stop = read(sigfd, &info, sizeof(info)) == sizeof(info);
+                        continue;
+                    }
+
+                    auto listener = std::find_if(listeners.begin(), listeners.end(), [&](const auto &l) { return l.first == fd; });
+                    if (listener != listeners.end()) {
+                        int client;
+                        while ((client = accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                            int one = 1;
+                            if (listener->second)
+                                setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                            auto conn = std::make_shared<Connection>(client);
+                            if (!watch(client))
+                                continue;
+                            connections.emplace(client, std::move(conn));
+                        }
+                        continue;
+                    }
+
+                    auto f = connections.find(fd);
+                    if (f != connections.end() && !ReadConnection(f->second, pool)) {
+                        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+                        connections.erase(f);
+                    }
+                }
+            }
+            Print("Shutting down\n");
+            fflush(Output());
+        }
+
+        connections.clear();
+        close_all();
+        if (options.socket_path.size())
+            unlink(options.socket_path.c_str());
+        close(epfd);
+        close(sigfd);
+        return true;
+    }
+
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+
+namespace asql {
+
+    /*
+    * Wire protocol of asql --serve. Every message is a frame of a 4 byte
+    * little endian length, a 1 byte type and length - 1 bytes of payload.
+    * A client sends MSG_QUERY with one or more statements as text, the server
+    * answers with any number of MSG_OUTPUT frames carrying the result rows
+    * and messages as they are produced, then MSG_DONE. A connection runs one
+    * query at a time, queries sent before the last one finished are queued.
+    */
+    enum MessageType : uint8_t {
+        MSG_QUERY = 1,
+        MSG_OUTPUT = 2,
+        MSG_DONE = 3,
+    };
+
+    // Frames claiming to be longer than this close the connection
+    constexpr size_t MAX_FRAME_BYTES = 64 << 20;
+    // Output is flushed to the client in frames of at most this many bytes
+    constexpr size_t OUTPUT_FRAME_BYTES = 64 << 10;
+
+    /* Blocking frame I/O, shared by the server's sessions and clients. False once the connection fails */
+    bool WriteFrame(int fd, MessageType type, std::string_view payload);
+    bool ReadFrame(int fd, MessageType &type, std::string &payload);
+
+    /* A connected socket to a server, the Unix socket at path or else loopback TCP port. -1 on failure */
+    int ConnectServer(const char *path, int port);
+
+    struct ServerOptions {
+        // Unix domain socket to listen on, none when empty
+        std::string socket_path;
+        // Loopback TCP port to listen on, none when 0
+        int port = 0;
+        // Threads running sessions' statements, 0 picks the number of cores
+        size_t session_threads = 0;
+    };
+
+    /*
+    * Block SIGINT and SIGTERM in the calling thread, before it starts any
+    * other. Threads inherit the mask, so none of them can take a shutdown
+    * signal and kill the process before the database is closed.
+    */
+    void BlockShutdownSignals();
+
+    /*
+    * Serve clients until SIGINT or SIGTERM, which BlockShutdownSignals() has
+    * to have blocked. One epoll loop accepts connections and reads their
+    * frames, complete queries are handed to a pool of session threads, which
+    * write the results back themselves. Returns false if a listening socket
+    * can't be set up.
+    */
+    bool Serve(const ServerOptions &options);
+
+}
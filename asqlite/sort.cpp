@@ -0,0 +1,222 @@
+#include <algorithm>
+#include <cstring>
+
+#include "serialize.h"
+#include "sort.h"
+#include "output.h"
+
+
+namespace asql {
+
+    void EncodeSortKey(const Value &v, bool desc, std::string &key)
+    {
+        const size_t start = key.size();
+        auto put64 = [&](uint64_t u) {
+            for (int shift = 56; shift >= 0; shift -= 8)
+                key += static_cast<char>(u >> shift);
+        };
+
+        switch (v.type) {
+        case CT_INT:
+            put64(static_cast<uint64_t>(v.i) ^ (1ULL << 63));
+            break;
+        case CT_FLOAT: {
+            // Negative floats order backwards, flip all their bits. -0.0 sorts as 0.0
+            double f = v.f == 0 ? 0 : v.f;
+            uint64_t u;
+            memcpy(&u, &f, sizeof(u));
+            put64(u & (1ULL << 63) ? ~u : u ^ (1ULL << 63));
+            break;
+        }
+        case CT_STR:
+            for (unsigned char c : v.s) {
+                if (c <= 1) {
+                    key += '\x01';
+                    key += static_cast<char>(c + 1);
+                } else {
+                    key += static_cast<char>(c);
+                }
+            }
+            key += '\0';
+            break;
+        }
+
+        if (desc)
+            for (size_t i = start; i < key.size(); ++i)
+                key[i] = static_cast<char>(~key[i]);
+    }
+
+    /* Indices of rows in key order */
+    static std::vector<uint32_t> SortOrder(const std::vector<SortRow> &rows)
+    {
+        struct Entry {
+            uint64_t prefix;
+            uint32_t index;
+        };
+
+        std::vector<Entry> entries(rows.size());
+        for (size_t i = 0; i < rows.size(); ++i) {
+            const auto &key = rows[i].key;
+            uint64_t prefix = 0;
+            for (size_t b = 0; b < 8; ++b)
+                prefix = prefix << 8 | (b < key.size() ? static_cast<unsigned char>(key[b]) : 0);
+            entries[i] = {prefix, static_cast<uint32_t>(i)};
+        }
+
+        std::sort(entries.begin(), entries.end(), [&](const Entry &a, const Entry &b) {
+            if (a.prefix != b.prefix)
+                return a.prefix < b.prefix;
+            return rows[a.index].key < rows[b.index].key;
+        });
+
+        std::vector<uint32_t> order(entries.size());
+        for (size_t i = 0; i < entries.size(); ++i)
+            order[i] = entries[i].index;
+        return order;
+    }
+
+    /* Runs hold (key, line) pairs in the ByteWriter string layout */
+    static bool ReadRow(FILE *f, SortRow &row)
+    {
+        for (auto s : {&row.key, &row.line}) {
+            uint32_t len;
+            if (fread(&len, sizeof(len), 1, f) != 1)
+                return false;
+            s->resize(len);
+            if (len && fread(&(*s)[0], 1, len, f) != len)
+                return false;
+        }
+        return true;
+    }
+
+    ExternalSorter::~ExternalSorter()
+    {
+        for (auto f : runs)
+            fclose(f);
+    }
+
+    bool ExternalSorter::WriteRun(std::vector<SortRow> &rows)
+    {
+        auto f = tmpfile();
+        if (!f) {
+            Print("Unable to create a temporary file for sorting\n");
+            return false;
+        }
+
+        ByteWriter w;
+        bool ok = true;
+        for (auto i : SortOrder(rows)) {
+            w.PutString(rows[i].key);
+            w.PutString(rows[i].line);
+            if (w.buf.size() >= (1 << 20)) {
+                ok &= fwrite(w.buf.data(), 1, w.buf.size(), f) == w.buf.size();
+                w.buf.clear();
+            }
+        }
+        ok &= fwrite(w.buf.data(), 1, w.buf.size(), f) == w.buf.size();
+        rows.clear();
+
+        std::lock_guard<std::mutex> guard{lock};
+        runs.push_back(f);
+        if (!ok)
+            Print("Unable to write sort run\n");
+        return ok;
+    }
+
+    bool ExternalSorter::Add(std::vector<SortRow> &&rows)
+    {
+        std::vector<SortRow> full;
+        {
+            std::lock_guard<std::mutex> guard{lock};
+            for (auto &row : rows) {
+                bytes += row.key.size() + row.line.size() + sizeof(SortRow);
+                buffer.push_back(std::move(row));
+            }
+            if (bytes <= budget)
+                return true;
+
+            // Sort and write the full buffer outside the lock, other threads keep filling a fresh one
+            full.swap(buffer);
+            bytes = 0;
+        }
+        return WriteRun(full);
+    }
+
+    bool ExternalSorter::Finish(const SortEmit &emit)
+    {
+        if (runs.empty()) {
+            for (auto i : SortOrder(buffer))
+                if (!emit(buffer[i].line))
+                    break;
+            return true;
+        }
+
+        if (!buffer.empty() && !WriteRun(buffer))
+            return false;
+
+        // k-way merge, the heap holds the next row of every run
+        struct Head {
+            SortRow row;
+            size_t run;
+        };
+        auto later = [](const Head &a, const Head &b) { return b.row.key < a.row.key; };
+
+        std::vector<Head> heads;
+        for (size_t r = 0; r < runs.size(); ++r) {
+            rewind(runs[r]);
+            Head h{{}, r};
+            if (ReadRow(runs[r], h.row))
+                heads.push_back(std::move(h));
+        }
+        std::make_heap(heads.begin(), heads.end(), later);
+
+        while (!heads.empty()) {
+            std::pop_heap(heads.begin(), heads.end(), later);
+            auto &h = heads.back();
+            if (!emit(h.row.line))
+                return true;
+
+            if (ReadRow(runs[h.run], h.row))
+                std::push_heap(heads.begin(), heads.end(), later);
+            else
+                heads.pop_back();
+        }
+
+        for (auto f : runs) {
+            if (ferror(f)) {
+                Print("Unable to read sort run\n");
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static bool KeyLess(const SortRow &a, const SortRow &b)
+    {
+        return a.key < b.key;
+    }
+
+    void TopK::Add(std::vector<SortRow> &&rows)
+    {
+        std::lock_guard<std::mutex> guard{lock};
+        for (auto &row : rows) {
+            if (heap.size() < k) {
+                heap.push_back(std::move(row));
+                std::push_heap(heap.begin(), heap.end(), KeyLess);
+            } else if (k && row.key < heap.front().key) {
+                std::pop_heap(heap.begin(), heap.end(), KeyLess);
+                heap.back() = std::move(row);
+                std::push_heap(heap.begin(), heap.end(), KeyLess);
+            }
+        }
+    }
+
+    void TopK::Finish(const SortEmit &emit)
+    {
+        std::sort_heap(heap.begin(), heap.end(), KeyLess);
+        for (const auto &row : heap)
+            if (!emit(row.line))
+                return;
+    }
+
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "database.h"
+
+
+namespace asql {
+
+    /* An output row waiting to be sorted. key compares with memcmp, line is the formatted row */
+    struct SortRow {
+        std::string key;
+        std::string line;
+    };
+
+    /*
+    * Append v to key so that keys compare with memcmp in ORDER BY order.
+    * Numbers are stored big endian with the sign flipped, strings escape
+    * 0x00 and 0x01 and end with 0x00 so a prefix sorts first. A descending
+    * column has its bytes inverted.
+    */
+    void EncodeSortKey(const Value &v, bool desc, std::string &key);
+
+    /* Sink for sorted rows, return false to stop */
+    using SortEmit = std::function<bool(const std::string &line)>;
+
+    /*
+    * Sorts rows that may not fit in memory. Rows are buffered until they
+    * outgrow the budget, then the buffer is sorted and written to a temporary
+    * file as a run. Finish() sorts what is left and k-way merges the runs.
+    * In memory rows are sorted through (8 byte key prefix, index) pairs so
+    * most comparisons never leave the array being sorted.
+    */
+    class ExternalSorter {
+    public:
+        ExternalSorter(size_t memory_budget): budget{memory_budget} {}
+        ExternalSorter(const ExternalSorter&) = delete;
+        ExternalSorter& operator=(const ExternalSorter&) = delete;
+        ~ExternalSorter();
+
+        /* Safe to call from several threads */
+        bool Add(std::vector<SortRow> &&rows);
+        bool Finish(const SortEmit &emit);
+
+        size_t RunCount() const { return runs.size(); }
+
+    private:
+        bool WriteRun(std::vector<SortRow> &rows);
+
+        const size_t budget;
+        std::mutex lock;
+        std::vector<SortRow> buffer;
+        size_t bytes = 0;
+        std::vector<FILE*> runs;
+    };
+
+    /* Keeps the k smallest keys for ORDER BY ... LIMIT k, nothing else is ever held */
+    class TopK {
+    public:
+        TopK(size_t k): k{k} {}
+
+        /* Safe to call from several threads */
+        void Add(std::vector<SortRow> &&rows);
+        void Finish(const SortEmit &emit);
+
+    private:
+        const size_t k;
+        std::mutex lock;
+        // Max heap on key, the front is the first row to give up
+        std::vector<SortRow> heap;
+    };
+
+}
@@ -0,0 +1,890 @@
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <string>
+
+#include "serialize.h"
+
+#include "statement.h"
+#include "image.h"
+#include "import.h"
+#include "parser.h"
+#include "threadpool.h"
+#include "output.h"
+
+
+namespace asql {
+
+    PlanCache QueryPlanCache{256};
+
+    // Checkpoint once the write-ahead log grows past this
+    static constexpr size_t WAL_CHECKPOINT_BYTES = 64 << 20;
+
+    /* Plan cache */
+
+    PlanPtr PlanCache::Lookup(const std::string &key)
+    {
+        std::lock_guard<std::mutex> guard{lock};
+        auto f = index.find(key);
+        if (f == index.end()) {
+            misses++;
+            return nullptr;
+        }
+
+        hits++;
+        entries.splice(entries.begin(), entries, f->second);
+        return f->second->second;
+    }
+
+    void PlanCache::Insert(const std::string &key, PlanPtr plan)
+    {
+        std::lock_guard<std::mutex> guard{lock};
+        if (auto f = index.find(key); f != index.end()) {
+            f->second->second = std::move(plan);
+            entries.splice(entries.begin(), entries, f->second);
+            return;
+        }
+
+        entries.emplace_front(key, std::move(plan));
+        index.emplace(key, entries.begin());
+
+        // Evict the least recently used plan, anyone still executing it holds a reference
+        if (entries.size() > capacity) {
+            index.erase(entries.back().first);
+            entries.pop_back();
+        }
+    }
+
+    void PlanCache::Clear()
+    {
+        std::lock_guard<std::mutex> guard{lock};
+        entries.clear();
+        index.clear();
+    }
+
+    size_t PlanCache::Size()
+    {
+        std::lock_guard<std::mutex> guard{lock};
+        return entries.size();
+    }
+
+    /* Statements */
+
+    static std::string Upper(std::string_view s)
+    {
+        std::string u(s);
+        for (auto &c : u)
+            c = static_cast<char>(toupper(static_cast<unsigned char>(c)));
+        return u;
+    }
+
+    /*
+    * Consume the rest of the statement and build its cache key. With parameterize
+    * set, literals in the WHERE clause are replaced by '?' and returned in params.
+    * Literals elsewhere name output columns or set the LIMIT, so they stay in the key.
+    */
+    static void Normalize(ParserContext &ctx, bool parameterize, std::string &key, std::vector<Value> &params)
+    {
+        bool in_where = false;
+
+        for (auto token = ctx.GetCurrentToken(); token != T_NULL && token != T_EOF; token = ctx.GetNextToken()) {
+            if (key.size())
+                key += ' ';
+
+            switch (token) {
+            case T_KEY_WHERE:
+                in_where = true;
+                break;
+            case T_KEY_LIMIT:
+            case T_KEY_ORDER:
+            case T_KEY_GROUP:
+                in_where = false;
+                break;
+            default:
+                break;
+            }
+
+            bool literal = token == T_RAW_INT || token == T_RAW_FLOAT || token == T_RAW_STR;
+            if (parameterize && in_where && literal) {
+                if (token == T_RAW_INT)
+                    params.push_back(Value::Int(ctx.LexerInteger));
+                else if (token == T_RAW_FLOAT)
+                    params.push_back(Value::Float(ctx.LexerFloat));
+                else
+                    params.push_back(Value::Str(std::string(ctx.LexerText)));
+                key += '?';
+                continue;
+            }
+
+            if (token == T_RAW_STR) {
+                // The lexer has no escapes, so a literal holding one quote kind was written with the other
+                char quote = ctx.LexerText.find('\'') == std::string_view::npos ? '\'' : '"';
+                key += quote;
+                key += ctx.LexerText;
+                key += quote;
+            } else {
+                key += Upper(ctx.LexerText);
+            }
+        }
+    }
+
+    /* Parse and validate normalized SQL text */
+    static PlanPtr Compile(const std::string &sql)
+    {
+        ParserContext pc;
+        pc.SetInput(sql);
+        pc.GetNextToken();
+
+        auto query = ParseSelectQuery(pc);
+        if (!query)
+            return nullptr;
+
+        if (pc.GetCurrentToken() != T_EOF) {
+            Print("Unexpected '%.*s' after SELECT statement\n", static_cast<int>(pc.LexerText.size()), pc.LexerText.data());
+            return nullptr;
+        }
+
+        if (!query->Validate())
+            return nullptr;
+
+        return PlanPtr{std::move(query)};
+    }
+
+    static PlanPtr GetPlan(const std::string &key)
+    {
+        auto plan = QueryPlanCache.Lookup(key);
+        if (plan)
+            return plan;
+
+        // Failed statements aren't cached, they print their error every time
+        plan = Compile(key);
+        if (plan)
+            QueryPlanCache.Insert(key, plan);
+        return plan;
+    }
+
+    static bool CheckParams(const SelectQuery &plan, size_t bound)
+    {
+        if (static_cast<size_t>(plan.param_count) == bound)
+            return true;
+
+        Print("Statement has %d parameters, %zu values bound\n", plan.param_count, bound);
+        return false;
+    }
+
+    void RunSelect(Session &session)
+    {
+        std::string key;
+        std::vector<Value> params;
+        Normalize(session.ctx, true, key, params);
+
+        auto plan = GetPlan(key);
+        if (!plan || !CheckParams(*plan, params.size()))
+            return;
+
+        plan->Execute(params);
+    }
+
+    PlanPtr PrepareSelect(ParserContext &ctx)
+    {
+        std::string key;
+        std::vector<Value> params;
+        Normalize(ctx, false, key, params);
+        return GetPlan(key);
+    }
+
+    void RunPrepare(Session &session)
+    {
+        auto &ctx = session.ctx;
+
+        // PREPARE name AS SELECT ...
+        if (ctx.GetNextToken() != T_RAW_VAR) {
+            Print("Expected a statement name after PREPARE\n");
+            return;
+        }
+        auto name = Upper(ctx.LexerText);
+
+        if (ctx.GetNextToken() != T_KEY_AS || ctx.GetNextToken() != T_QRY_SELECT) {
+            Print("Only 'PREPARE name AS SELECT ...' is supported\n");
+            return;
+        }
+
+        if (auto plan = PrepareSelect(ctx))
+            session.prepared[name] = plan;
+    }
+
+    /* (literal, ...), the current token is '('. Leaves the token after ')' current */
+    static bool ParseLiterals(ParserContext &ctx, const char *what, std::vector<Value> &values,
+                              std::vector<size_t> *params = nullptr)
+    {
+        while ( true ) {
+            auto token = ctx.GetNextToken();
+            bool negative = token == '-';
+            if (negative)
+                token = ctx.GetNextToken();
+
+            // A '?' is a placeholder value, params records where it is
+            if (token == T_PARAM && params && !negative) {
+                params->push_back(values.size());
+                values.emplace_back();
+            } else if (token == T_RAW_INT)
+                values.push_back(Value::Int(negative ? -ctx.LexerInteger : ctx.LexerInteger));
+            else if (token == T_RAW_FLOAT)
+                values.push_back(Value::Float(negative ? -ctx.LexerFloat : ctx.LexerFloat));
+            else if (token == T_RAW_STR && !negative)
+                values.push_back(Value::Str(std::string(ctx.LexerText)));
+            else {
+                Print("%s have to be literals\n", what);
+                return false;
+            }
+
+            token = ctx.GetNextToken();
+            if (token == T_CLOSE_PAREN)
+                break;
+            if (token != T_COMMA) {
+                Print("Expected ',' or ')' in %s\n", what);
+                return false;
+            }
+        }
+        ctx.GetNextToken();
+        return true;
+    }
+
+    void RunExecute(Session &session)
+    {
+        auto &ctx = session.ctx;
+
+        // EXECUTE name [(value, ...)]
+        if (ctx.GetNextToken() != T_RAW_VAR) {
+            Print("Expected a statement name after EXECUTE\n");
+            return;
+        }
+
+        auto name = Upper(ctx.LexerText);
+        auto f = session.prepared.find(name);
+        if (f == session.prepared.end()) {
+            Print("Unknown prepared statement '%s'\n", name.c_str());
+            return;
+        }
+
+        std::vector<Value> params;
+        if (ctx.GetNextToken() == T_OPEN_PAREN && !ParseLiterals(ctx, "EXECUTE parameters", params))
+            return;
+
+        if (!CheckParams(*f->second, params.size()))
+            return;
+
+        f->second->Execute(params);
+    }
+
+    void RunExplain(Session &session)
+    {
+        auto &ctx = session.ctx;
+
+        // EXPLAIN [ANALYZE] SELECT ...
+        auto token = ctx.GetNextToken();
+        const bool analyze = token == T_RAW_VAR && Upper(ctx.LexerText) == "ANALYZE";
+        if (analyze)
+            token = ctx.GetNextToken();
+        if (token != T_QRY_SELECT) {
+            Print("Only EXPLAIN [ANALYZE] SELECT is supported\n");
+            return;
+        }
+
+        // Same key as running the statement, so this shows the cached plan it would use
+        std::string key;
+        std::vector<Value> params;
+        Normalize(ctx, true, key, params);
+
+        auto plan = GetPlan(key);
+        if (!plan)
+            return;
+
+        if (analyze) {
+            if (!CheckParams(*plan, params.size()))
+                return;
+
+            QueryProfile profile{plan->tables.size()};
+            auto start = std::chrono::steady_clock::now();
+            plan->Execute(params, &profile);
+            auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+            PrintPlan(*plan, &profile);
+            Print("%llu rows in %.3f ms on %zu threads, %llu spills\n", static_cast<unsigned long long>(profile.rows),
+                  elapsed, GetThreadPool().ThreadCount(), static_cast<unsigned long long>(profile.spills));
+            return;
+        }
+
+        PrintPlan(*plan);
+
+        // Filters pushed below a join run first, on their table's rows
+        for (size_t slot = 0; slot < plan->join_filters.size(); ++slot) {
+            if (plan->join_filters[slot].code.empty())
+                continue;
+            const auto &alias = plan->tables[slot].alias;
+            Print("-- filter on %.*s before the join\n", static_cast<int>(alias.size()), alias.data());
+            plan->join_filters[slot].Print();
+        }
+        plan->program.Print();
+    }
+
+    /* Modifications */
+
+    /* Wait for the statement's log record to be durable, checkpoint if the log has grown too big */
+    static void CommitWrite(Lsn lsn)
+    {
+        auto wal = GetWal();
+        if (!wal || !wal->Commit(lsn) || wal->Size() < WAL_CHECKPOINT_BYTES)
+            return;
+
+        std::lock_guard<std::mutex> guard{WriterLock};
+        if (wal->Size() >= WAL_CHECKPOINT_BYTES && !Checkpoint())
+            Print("Checkpoint failed\n");
+    }
+
+    static Lsn LogRecord(const ByteWriter &w)
+    {
+        auto wal = GetWal();
+        return wal ? wal->Append(w.buf) : 0;
+    }
+
+    /* Changes to a mapped image would be lost, refuse them */
+    static bool CheckWritable()
+    {
+        if (!ImageOpen())
+            return true;
+        Print("The database is a read-only image\n");
+        return false;
+    }
+
+    /* A batch of rows for the log: row and column counts, then each column's type and values */
+    static void PutRows(ByteWriter &w, const RowGroup &rows)
+    {
+        w.Put(static_cast<uint64_t>(rows.rows));
+        w.Put(static_cast<uint32_t>(rows.columns.size()));
+        for (const auto &col : rows.columns) {
+            w.Put(static_cast<uint8_t>(col.type));
+            switch (col.type) {
+            case CT_INT:   w.PutBytes(col.ints.data(), rows.rows * sizeof(int64_t));  break;
+            case CT_FLOAT: w.PutBytes(col.floats.data(), rows.rows * sizeof(double)); break;
+            case CT_STR:
+                for (const auto &str : col.strs)
+                    w.PutString(str);
+                break;
+            }
+        }
+    }
+
+    static bool GetRows(ByteReader &r, RowGroup &rows)
+    {
+        rows.rows = r.Get<uint64_t>();
+        auto ncols = r.Get<uint32_t>();
+        for (uint32_t c = 0; c < ncols && r.ok; ++c) {
+            auto &col = rows.columns.emplace_back(static_cast<ColumnType>(r.Get<uint8_t>()));
+            switch (col.type) {
+            case CT_INT:
+                if (auto data = r.Take(rows.rows * sizeof(int64_t))) {
+                    col.ints.resize(rows.rows);
+                    memcpy(col.ints.data(), data, rows.rows * sizeof(int64_t));
+                }
+                break;
+            case CT_FLOAT:
+                if (auto data = r.Take(rows.rows * sizeof(double))) {
+                    col.floats.resize(rows.rows);
+                    memcpy(col.floats.data(), data, rows.rows * sizeof(double));
+                }
+                break;
+            case CT_STR:
+                for (size_t i = 0; i < rows.rows && r.ok; ++i)
+                    col.strs.push_back(r.GetString());
+                break;
+            default:
+                r.ok = false;
+                break;
+            }
+        }
+        return r.ok;
+    }
+
+    /* A single row needs no batch, it's logged and appended as is */
+    static bool InsertRow(TableStorage &table, const std::vector<Value> &row)
+    {
+        ByteWriter w;
+        w.Put(WAL_INSERT);
+        w.PutString(table.name);
+        w.Put(static_cast<uint32_t>(row.size()));
+        for (const auto &v : row)
+            PutValue(w, v);
+
+        Lsn lsn;
+        bool ok;
+        {
+            std::lock_guard<std::mutex> guard{WriterLock};
+            lsn = LogRecord(w);
+            ok = table.AppendRow(row);
+        }
+        CommitWrite(lsn);
+        return ok;
+    }
+
+    bool InsertRows(TableStorage &table, RowGroup &&rows)
+    {
+        // AppendRows() checks again, but a batch it would reject mustn't reach the log
+        if (!CheckWritable() || !table.CheckRows(rows))
+            return false;
+        if (!rows.rows)
+            return true;
+
+        ByteWriter w;
+        if (GetWal()) {
+            w.Put(WAL_ROWS);
+            w.PutString(table.name);
+            PutRows(w, rows);
+        }
+
+        Lsn lsn;
+        bool ok;
+        {
+            std::lock_guard<std::mutex> guard{WriterLock};
+            lsn = LogRecord(w);
+            ok = table.AppendRows(std::move(rows));
+        }
+        CommitWrite(lsn);
+        return ok;
+    }
+
+    bool InsertRows(TableStorage &table, const std::vector<ColumnSpan> &columns)
+    {
+        const auto &schema = table.schema;
+        if (columns.size() != schema.size()) {
+            Print("Table '%s' expects %zu columns, got %zu\n", table.name.c_str(), schema.size(), columns.size());
+            return false;
+        }
+
+        RowGroup rows;
+        rows.rows = columns.empty() ? 0 : columns[0].size;
+        for (size_t c = 0; c < columns.size(); ++c) {
+            const auto &span = columns[c];
+            auto expected = schema.columns[c].second;
+            if (span.type != expected && !(expected == CT_FLOAT && span.type == CT_INT)) {
+                Print("Type mismatch for column '%s' in table '%s'\n", schema.columns[c].first.c_str(), table.name.c_str());
+                return false;
+            }
+            if (span.size != rows.rows) {
+                Print("Column '%s' has %zu values, expected %zu\n", schema.columns[c].first.c_str(), span.size, rows.rows);
+                return false;
+            }
+
+            auto &col = rows.columns.emplace_back(expected);
+            switch (span.type) {
+            case CT_INT:
+                if (expected == CT_FLOAT)
+                    col.floats.assign(span.ints, span.ints + span.size);
+                else
+                    col.ints.assign(span.ints, span.ints + span.size);
+                break;
+            case CT_FLOAT: col.floats.assign(span.floats, span.floats + span.size); break;
+            case CT_STR:   col.strs.assign(span.strs, span.strs + span.size);       break;
+            }
+        }
+        return InsertRows(table, std::move(rows));
+    }
+
+    /* (column, ...) naming every column of table once, the current token is '('. order[c] is
+       where schema column c is in the list. Leaves the token after ')' current */
+    static bool ParseColumnList(ParserContext &ctx, const TableStorage &table, std::vector<size_t> &order)
+    {
+        const auto &schema = table.schema;
+        std::vector<bool> listed(schema.size());
+        size_t count = 0;
+
+        while ( true ) {
+            if (ctx.GetNextToken() != T_RAW_VAR) {
+                Print("Expected a column name in the INSERT column list\n");
+                return false;
+            }
+
+            auto name = Upper(ctx.LexerText);
+            int c = schema.Index(name);
+            if (c < 0) {
+                Print("Unknown column '%s' in table '%s'\n", name.c_str(), table.name.c_str());
+                return false;
+            }
+            if (listed[c]) {
+                Print("Column '%s' is listed twice\n", name.c_str());
+                return false;
+            }
+            listed[c] = true;
+            order[c] = count++;
+
+            auto token = ctx.GetNextToken();
+            if (token == T_CLOSE_PAREN)
+                break;
+            if (token != T_COMMA) {
+                Print("Expected ',' or ')' in the INSERT column list\n");
+                return false;
+            }
+        }
+
+        // There are no NULLs, every column needs a value
+        if (count != schema.size()) {
+            Print("INSERT has to give a value for every column of %s\n", table.name.c_str());
+            return false;
+        }
+        ctx.GetNextToken();
+        return true;
+    }
+
+    bool ParseInsert(ParserContext &ctx, InsertStatement &insert, bool allow_params)
+    {
+        // INSERT INTO table [(column, ...)] VALUES (value, ...), ...
+        if (ctx.GetNextToken() != T_KEY_INTO || ctx.GetNextToken() != T_RAW_VAR) {
+            Print("Expected 'INSERT INTO table'\n");
+            return false;
+        }
+
+        auto name = Upper(ctx.LexerText);
+        auto table = GetTable(name);
+        if (!table) {
+            Print("Unknown table %s\n", name.c_str());
+            return false;
+        }
+
+        const auto &schema = table->schema;
+        std::vector<size_t> order(schema.size());
+        for (size_t c = 0; c < order.size(); ++c)
+            order[c] = c;
+        if (ctx.GetNextToken() == T_OPEN_PAREN && !ParseColumnList(ctx, *table, order))
+            return false;
+
+        if (ctx.GetCurrentToken() != T_KEY_VALUES || ctx.GetNextToken() != T_OPEN_PAREN) {
+            Print("Expected VALUES (...) after INSERT INTO %s\n", name.c_str());
+            return false;
+        }
+
+        insert.table = table;
+        insert.values.clear();
+        insert.params.clear();
+
+        // Tuples are stored in schema order, a parameter moves with its value
+        std::vector<Value> tuple;
+        std::vector<size_t> params, column_of(schema.size());
+        for (size_t c = 0; c < schema.size(); ++c)
+            column_of[order[c]] = c;
+
+        while ( true ) {
+            tuple.clear();
+            params.clear();
+            if (!ParseLiterals(ctx, "INSERT values", tuple, allow_params ? &params : nullptr))
+                return false;
+            if (tuple.size() != schema.size()) {
+                Print("Table '%s' expects %zu values, got %zu\n", name.c_str(), schema.size(), tuple.size());
+                return false;
+            }
+
+            const size_t first = insert.values.size();
+            insert.values.resize(first + schema.size());
+            for (size_t c = 0; c < schema.size(); ++c)
+                insert.values[first + c] = std::move(tuple[order[c]]);
+            for (auto p : params)
+                insert.params.push_back(first + column_of[p]);
+
+            if (ctx.GetCurrentToken() != T_COMMA)
+                break;
+            if (ctx.GetNextToken() != T_OPEN_PAREN) {
+                Print("Expected '(' after ',' in INSERT values\n");
+                return false;
+            }
+        }
+
+        auto token = ctx.GetCurrentToken();
+        if (token != T_NULL && token != T_EOF) {
+            Print("Unexpected '%.*s' after INSERT values\n", static_cast<int>(ctx.LexerText.size()), ctx.LexerText.data());
+            return false;
+        }
+        return true;
+    }
+
+    bool ApplyInsert(TableStorage &table, std::vector<Value> &&values)
+    {
+        if (!CheckWritable())
+            return false;
+
+        // Every row is type checked before anything is logged, moved out and back rather than copied
+        const auto &schema = table.schema;
+        const size_t count = values.size() / schema.size();
+        std::vector<Value> row(schema.size());
+        for (size_t r = 0; r < count; ++r) {
+            auto at = values.begin() + static_cast<long>(r * schema.size());
+            std::move(at, at + static_cast<long>(schema.size()), row.begin());
+            const bool ok = table.CheckRow(row);
+            std::move(row.begin(), row.end(), at);
+            if (!ok)
+                return false;
+        }
+
+        if (count == 1)
+            return InsertRow(table, values);
+
+        // Columns are sized for the batch up front, strings are moved rather than copied
+        RowGroup rows;
+        rows.rows = count;
+        for (const auto &col : schema) {
+            rows.columns.emplace_back(col.second);
+            rows.columns.back().Reserve(count);
+        }
+        for (size_t r = 0; r < count; ++r)
+            for (size_t c = 0; c < schema.size(); ++c)
+                rows.columns[c].Append(std::move(values[r * schema.size() + c]));
+        return InsertRows(table, std::move(rows));
+    }
+
+    void RunInsert(Session &session)
+    {
+        if (!CheckWritable())
+            return;
+
+        InsertStatement insert;
+        if (ParseInsert(session.ctx, insert, false))
+            ApplyInsert(*insert.table, std::move(insert.values));
+    }
+
+    /* Parse, validate and apply an UPDATE or DELETE held as normalized text */
+    static bool ApplyModify(const std::string &sql, bool log)
+    {
+        ParserContext pc;
+        pc.SetInput(sql);
+        pc.GetNextToken();
+
+        auto query = ParseModifyQuery(pc);
+        if (!query)
+            return false;
+
+        if (pc.GetCurrentToken() != T_EOF) {
+            Print("Unexpected '%.*s' after statement\n", static_cast<int>(pc.LexerText.size()), pc.LexerText.data());
+            return false;
+        }
+
+        if (!query->Validate())
+            return false;
+
+        Lsn lsn = 0;
+        {
+            std::lock_guard<std::mutex> guard{WriterLock};
+            if (log) {
+                ByteWriter w;
+                w.Put(WAL_STATEMENT);
+                w.PutString(sql);
+                lsn = LogRecord(w);
+            }
+            query->Execute();
+        }
+
+        if (log)
+            CommitWrite(lsn);
+        return true;
+    }
+
+    void RunModify(Session &session)
+    {
+        if (!CheckWritable())
+            return;
+
+        // The normalized text is what gets logged, replaying it reparses the statement
+        std::string sql;
+        std::vector<Value> unused;
+        Normalize(session.ctx, false, sql, unused);
+        ApplyModify(sql, true);
+    }
+
+    void RunCreate(Session &session)
+    {
+        auto &ctx = session.ctx;
+
+        // CREATE INDEX name ON table(column)
+        if (ctx.GetNextToken() != T_KEY_INDEX) {
+            Print("Only CREATE INDEX is supported\n");
+            return;
+        }
+
+        if (ctx.GetNextToken() != T_RAW_VAR) {
+            Print("Expected an index name after CREATE INDEX\n");
+            return;
+        }
+        auto name = Upper(ctx.LexerText);
+
+        if (ctx.GetNextToken() != T_KEY_ON || ctx.GetNextToken() != T_RAW_VAR) {
+            Print("Expected 'ON table(column)' after the index name\n");
+            return;
+        }
+        auto table_name = Upper(ctx.LexerText);
+
+        if (ctx.GetNextToken() != T_OPEN_PAREN || ctx.GetNextToken() != T_RAW_VAR) {
+            Print("Expected '(column)' after the table name\n");
+            return;
+        }
+        auto column_name = Upper(ctx.LexerText);
+
+        if (ctx.GetNextToken() != T_CLOSE_PAREN) {
+            Print("Only single column indexes are supported\n");
+            return;
+        }
+        ctx.GetNextToken();
+
+        auto table = GetTable(table_name);
+        if (!table) {
+            Print("Unknown table %s\n", table_name.c_str());
+            return;
+        }
+
+        auto col = table->schema.find(column_name);
+        if (col == table->schema.end()) {
+            Print("Unknown column '%s' in table '%s'\n", column_name.c_str(), table_name.c_str());
+            return;
+        }
+
+        std::lock_guard<std::mutex> guard{WriterLock};
+        for (auto &t : TableData) {
+            if (t.second.FindIndex(name)) {
+                Print("Index %s already exists\n", name.c_str());
+                return;
+            }
+        }
+
+        if (!table->AddIndex(std::make_shared<Index>(name, static_cast<size_t>(col - table->schema.begin()), col->second)))
+            return;
+        table->Publish();
+
+        // Index definitions live in the catalog, checkpoint instead of logging them
+        if (GetWal() && !Checkpoint())
+            Print("Checkpoint failed\n");
+    }
+
+    bool RecoverDatabase()
+    {
+        auto wal = GetWal();
+        if (!wal)
+            return true;
+
+        size_t replayed = 0;
+        bool ok = wal->Replay([&](ByteReader &r) {
+            replayed++;
+            auto kind = r.Get<uint8_t>();
+
+            if (kind == WAL_STATEMENT)
+                return ApplyModify(r.GetString(), false);
+
+            if (kind == WAL_ROWS) {
+                auto table = GetTable(r.GetString());
+                RowGroup rows;
+                return GetRows(r, rows) && table && table->AppendRows(std::move(rows));
+            }
+
+            if (kind == WAL_INSERT) {
+                auto table = GetTable(r.GetString());
+                std::vector<Value> row(r.Get<uint32_t>());
+                for (auto &v : row)
+                    v = GetValue(r);
+                return r.ok && table && table->AppendRow(row);
+            }
+
+            Print("Unknown write-ahead log record %u\n", kind);
+            return false;
+        });
+
+        if (!ok) {
+            Print("Write-ahead log replay failed after %zu records\n", replayed);
+            return false;
+        }
+
+        if (!replayed)
+            return true;
+
+        Print("Recovered %zu write-ahead log records\n", replayed);
+        std::lock_guard<std::mutex> guard{WriterLock};
+        return Checkpoint();
+    }
+
+    void RunMetaCommand(Session &session, std::string_view line)
+    {
+        auto end = line.find_first_of(" \t");
+        auto command = line.substr(0, end);
+
+        if (command == "stats") {
+            Print("plan cache: %zu entries, %zu hits, %zu misses\n",
+                  QueryPlanCache.Size(), QueryPlanCache.hits.load(), QueryPlanCache.misses.load());
+            Print("prepared statements: %zu\n", session.prepared.size());
+            Print("thread pool: %zu threads, %zu steals\n", GetThreadPool().ThreadCount(), GetThreadPool().steals.load());
+            if (auto pool = GetBufferPool())
+                Print("buffer pool: %zu frames, %zu hits, %zu misses, %zu evictions\n",
+                      pool->FrameCount(), pool->hits.load(), pool->misses.load(), pool->evictions.load());
+            if (auto wal = GetWal())
+                Print("write-ahead log: sync %s, %zu bytes, %zu commits, %zu syncs\n",
+                      SyncModeName(wal->mode), wal->Size(), wal->commits.load(), wal->syncs.load());
+            auto versions = GetVersionStats();
+            Print("versions: epoch %llu, %zu snapshots, %zu retired, %zu reclaimed\n",
+                  static_cast<unsigned long long>(versions.epoch), versions.snapshots, versions.retired, versions.reclaimed);
+            if (ImageOpen())
+                Print("image: %s, %zu bytes mapped\n", ImagePath().c_str(), ImageBytes());
+            return;
+        }
+
+        if (command == "checkpoint") {
+            std::lock_guard<std::mutex> guard{WriterLock};
+            if (!GetBufferPool())
+                Print("No database file is open\n");
+            else if (!Checkpoint())
+                Print("Checkpoint failed\n");
+            return;
+        }
+
+        if (command == "export") {
+            // .export file
+            std::string args{end == std::string_view::npos ? "" : line.substr(end)};
+            char path[4096];
+            if (sscanf(args.c_str(), "%4095s", path) != 1) {
+                Print("Usage: .export file\n");
+                return;
+            }
+            if (ExportImage(path))
+                Print("Exported an image of every table to %s\n", path);
+            return;
+        }
+
+        if (command == "import") {
+            // .import file.csv TABLE
+            if (!CheckWritable())
+                return;
+            std::string args{end == std::string_view::npos ? "" : line.substr(end)};
+            char path[4096], table_name[256];
+            if (sscanf(args.c_str(), "%4095s %255s", path, table_name) != 2) {
+                Print("Usage: .import file.csv TABLE\n");
+                return;
+            }
+
+            auto name = Upper(table_name);
+            auto table = GetTable(name);
+            if (!table) {
+                Print("Unknown table %s\n", name.c_str());
+                return;
+            }
+
+            size_t imported = 0;
+            bool ok = ImportCsv(path, *table, imported);
+
+            // Imported rows aren't logged, checkpoint to make them durable
+            if (imported && GetWal()) {
+                std::lock_guard<std::mutex> guard{WriterLock};
+                if (!Checkpoint())
+                    Print("Checkpoint failed\n");
+            }
+            Print("%s %zu rows into %s\n", ok ? "Imported" : "Failed after importing", imported, name.c_str());
+            return;
+        }
+
+        Print("Unknown command '.%.*s'\n", static_cast<int>(command.size()), command.data());
+    }
+}
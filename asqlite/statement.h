@@ -0,0 +1,128 @@
+#pragma once
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "database.h"
+#include "lexer.h"
+#include "query.h"
+
+
+namespace asql {
+
+    /* A parsed and validated SELECT. Immutable once cached, parameters are passed to Execute() */
+    using PlanPtr = std::shared_ptr<const SelectQuery>;
+
+    /*
+    * LRU cache of validated plans keyed by normalized SQL text. Normalizing
+    * upper cases identifiers, collapses whitespace and turns WHERE clause
+    * literals into '?', so statements that only differ in those literals
+    * share a plan.
+    */
+    class PlanCache {
+    public:
+        PlanCache(size_t capacity): capacity{capacity} {}
+
+        PlanPtr Lookup(const std::string &key);
+        void Insert(const std::string &key, PlanPtr plan);
+        void Clear();
+
+        size_t Size();
+        // Counted under lock, read by .stats from any session
+        std::atomic<size_t> hits{0};
+        std::atomic<size_t> misses{0};
+
+    private:
+        using Entry = std::pair<std::string, PlanPtr>;
+
+        size_t capacity;
+        std::mutex lock;
+        // Most recently used at the front
+        std::list<Entry> entries;
+        std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    };
+
+    extern PlanCache QueryPlanCache;
+
+
+    /* Per connection state, the parser context and the statements it has prepared */
+    class Session {
+    public:
+        ParserContext ctx;
+        std::unordered_map<std::string, PlanPtr> prepared;
+    };
+
+    /* The plan of the SELECT in ctx, through the plan cache. Its literals stay, only '?' are parameters */
+    PlanPtr PrepareSelect(ParserContext &ctx);
+
+    /* Statement runners, the current token is the statement's first keyword */
+    void RunSelect(Session &session);
+    void RunPrepare(Session &session);
+    void RunExecute(Session &session);
+    /*
+    * EXPLAIN SELECT prints the plan's operators and program without running it.
+    * EXPLAIN ANALYZE SELECT runs it, dropping the rows, and prints every
+    * operator's rows, wall and thread time, cycles, allocations and skipped
+    * row groups.
+    */
+    void RunExplain(Session &session);
+    /* INSERT INTO table [(column, ...)] VALUES (...), (...), ... as one batch */
+    void RunInsert(Session &session);
+
+    /*
+    * A parsed INSERT, every tuple's values back to back in schema order.
+    * params holds where each '?' went, numbered from 0 in statement order,
+    * their values are filled in before ApplyInsert().
+    */
+    struct InsertStatement {
+        TableStorage *table = nullptr;
+        std::vector<Value> values;
+        std::vector<size_t> params;
+    };
+    /* The current token is INSERT. '?' are only accepted with allow_params, values aren't type checked yet */
+    bool ParseInsert(ParserContext &ctx, InsertStatement &insert, bool allow_params);
+    /* Type check and insert values, rows of table in schema order. One row is logged as is, more as a batch */
+    bool ApplyInsert(TableStorage &table, std::vector<Value> &&values);
+    /* UPDATE and DELETE */
+    void RunModify(Session &session);
+    /* CREATE INDEX */
+    void RunCreate(Session &session);
+
+    /* One column of values for InsertRows(), a span over the caller's array of the column's type */
+    struct ColumnSpan {
+        ColumnSpan(const int64_t *ints, size_t size): type{CT_INT}, ints{ints}, size{size} {}
+        ColumnSpan(const double *floats, size_t size): type{CT_FLOAT}, floats{floats}, size{size} {}
+        ColumnSpan(const std::string *strs, size_t size): type{CT_STR}, strs{strs}, size{size} {}
+        template <typename T>
+        ColumnSpan(const std::vector<T> &values): ColumnSpan(values.data(), values.size()) {}
+
+        ColumnType type;
+        const int64_t *ints = nullptr;
+        const double *floats = nullptr;
+        const std::string *strs = nullptr;
+        size_t size = 0;
+    };
+
+    /*
+    * Append a batch of rows to table as a single logged write, readers see all
+    * of them or none. rows needs a column of the schema's type per schema
+    * column, see TableStorage::CheckRows(), otherwise nothing is logged or
+    * appended. Its strings are moved.
+    */
+    bool InsertRows(TableStorage &table, RowGroup &&rows);
+    /* The same for columns of values in schema order, INT values may go into FLOAT columns */
+    bool InsertRows(TableStorage &table, const std::vector<ColumnSpan> &columns);
+
+    /* Replay the open database's write-ahead log and checkpoint what it recovered */
+    bool RecoverDatabase();
+
+    /* '.' commands, line is the text after the '.' */
+    void RunMetaCommand(Session &session, std::string_view line);
+
+}
@@ -0,0 +1,133 @@
+#include <algorithm>
+
+#include "threadpool.h"
+#include "output.h"
+
+
+namespace asql {
+
+    static std::unique_ptr<ThreadPool> Pool;
+
+    ThreadPool::ThreadPool(size_t threads)
+    {
+        size_t nworkers = threads > 1 ? threads - 1 : 0;
+
+        // The submitting thread has no queue of its own, with no workers it still needs one to drain
+        for (size_t i = 0; i < std::max<size_t>(nworkers, 1); ++i)
+            queues.push_back(std::make_unique<Queue>());
+
+        for (size_t i = 0; i < nworkers; ++i)
+            workers.emplace_back([this, i] { WorkerLoop(i); });
+    }
+
+    ThreadPool::~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> guard{wake_lock};
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto &t : workers)
+            t.join();
+    }
+
+    bool ThreadPool::Pop(size_t self, Task &task)
+    {
+        for (size_t i = 0; i < queues.size(); ++i) {
+            auto &q = *queues[(self + i) % queues.size()];
+            std::lock_guard<std::mutex> guard{q.lock};
+            if (q.tasks.empty())
+                continue;
+
+            // Own queue in morsel order, victims from the far end
+            if (i == 0) {
+                task = q.tasks.front();
+                q.tasks.pop_front();
+            } else {
+                task = q.tasks.back();
+                q.tasks.pop_back();
+                steals++;
+            }
+            queued--;
+            return true;
+        }
+        return false;
+    }
+
+    void ThreadPool::Run(const Task &task)
+    {
+        FILE *saved = Output();
+        SetOutput(task.job->output);
+        (*task.job->fn)(task.index);
+        SetOutput(saved);
+        if (--task.job->pending == 0) {
+            std::lock_guard<std::mutex> guard{wake_lock};
+            done.notify_all();
+        }
+    }
+
+    void ThreadPool::WorkerLoop(size_t self)
+    {
+        Task task;
+        while ( true ) {
+            if (Pop(self, task)) {
+                Run(task);
+                continue;
+            }
+
+            std::unique_lock<std::mutex> guard{wake_lock};
+            wake.wait(guard, [&] { return stopping || queued > 0; });
+            if (stopping && queued == 0)
+                return;
+        }
+    }
+
+    void ThreadPool::ParallelFor(size_t n, const std::function<void(size_t)> &fn)
+    {
+        if (!n)
+            return;
+
+        Job job;
+        job.fn = &fn;
+        job.pending = n;
+        job.output = Output();
+
+        // Deal out contiguous chunks, queue q gets [q * n / queues, (q + 1) * n / queues)
+        for (size_t q = 0; q < queues.size(); ++q) {
+            size_t begin = q * n / queues.size();
+            size_t end = (q + 1) * n / queues.size();
+            std::lock_guard<std::mutex> guard{queues[q]->lock};
+            for (size_t i = begin; i < end; ++i)
+                queues[q]->tasks.push_back({&job, i});
+        }
+        {
+            std::lock_guard<std::mutex> guard{wake_lock};
+            queued += n;
+        }
+        wake.notify_all();
+
+        // Help out until the queues run dry, then wait for the tasks still running
+        Task task;
+        while (job.pending && Pop(0, task))
+            Run(task);
+
+        std::unique_lock<std::mutex> guard{wake_lock};
+        done.wait(guard, [&] { return job.pending == 0; });
+    }
+
+    ThreadPool& GetThreadPool()
+    {
+        if (!Pool)
+            SetThreadCount(0);
+        return *Pool;
+    }
+
+    void SetThreadCount(size_t threads)
+    {
+        if (!threads)
+            threads = std::max(std::thread::hardware_concurrency(), 1u);
+        Pool.reset();
+        Pool = std::make_unique<ThreadPool>(threads);
+    }
+
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace asql {
+
+    /*
+    * Work-stealing pool for morsel-driven execution. Every worker owns a queue,
+    * a job's tasks are dealt out to the queues in contiguous chunks so workers
+    * start on neighbouring morsels. A worker takes from the front of its own
+    * queue and, once that is empty, steals from the back of someone else's.
+    * The thread that submitted a job runs its tasks too.
+    */
+    class ThreadPool {
+    public:
+        /* threads counts the submitting thread, so a pool of 1 runs everything inline */
+        ThreadPool(size_t threads);
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+        ~ThreadPool();
+
+        /* Call fn(i) for every i in [0, n) and return once all of them ran */
+        void ParallelFor(size_t n, const std::function<void(size_t)> &fn);
+
+        size_t ThreadCount() const { return workers.size() + 1; }
+        std::atomic<size_t> steals{0};
+
+    private:
+        struct Job {
+            const std::function<void(size_t)> *fn;
+            std::atomic<size_t> pending;
+            // Output() of the submitting thread, its tasks print there too
+            FILE *output;
+        };
+
+        struct Task {
+            Job *job;
+            size_t index;
+        };
+
+        struct Queue {
+            std::mutex lock;
+            std::deque<Task> tasks;
+        };
+
+        /* Own queue first, then steal. self is a queue index */
+        bool Pop(size_t self, Task &task);
+        void Run(const Task &task);
+        void WorkerLoop(size_t self);
+
+        std::vector<std::unique_ptr<Queue>> queues;
+        std::vector<std::thread> workers;
+
+        // Guards sleeping and waking, queued counts tasks sitting in any queue
+        std::mutex wake_lock;
+        std::condition_variable wake;
+        std::condition_variable done;
+        std::atomic<size_t> queued{0};
+        bool stopping = false;
+    };
+
+    /* The pool queries run on, sized by SetThreadCount() */
+    ThreadPool& GetThreadPool();
+    /* Replace the pool, 0 picks the number of cores. Not safe while queries are running */
+    void SetThreadCount(size_t threads);
+
+}
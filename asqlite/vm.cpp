@@ -0,0 +1,551 @@
+#include <cstdio>
+#include <functional>
+#include <map>
+
+#include "query.h"
+#include "vm.h"
+#include "output.h"
+
+
+namespace asql {
+
+    /* Kernels */
+
+    /* Vectorized arithmetic kernels. Loops are kept branch free so the compiler can vectorize them.
+       Integer overflow wraps around, computed in uint64_t since signed overflow is undefined */
+    static inline int64_t Wrap(uint64_t v) { return static_cast<int64_t>(v); }
+    struct AddOp {
+        double operator()(double l, double r) const { return l + r; }
+        int64_t operator()(int64_t l, int64_t r) const { return Wrap(static_cast<uint64_t>(l) + static_cast<uint64_t>(r)); }
+    };
+    struct SubOp {
+        double operator()(double l, double r) const { return l - r; }
+        int64_t operator()(int64_t l, int64_t r) const { return Wrap(static_cast<uint64_t>(l) - static_cast<uint64_t>(r)); }
+    };
+    struct MulOp {
+        double operator()(double l, double r) const { return l * r; }
+        int64_t operator()(int64_t l, int64_t r) const { return Wrap(static_cast<uint64_t>(l) * static_cast<uint64_t>(r)); }
+    };
+    struct DivOp {
+        double operator()(double l, double r) const { return l / r; }
+        // No NULLs yet, so integer division by zero yields 0. INT64_MIN / -1 traps, negate instead and wrap
+        int64_t operator()(int64_t l, int64_t r) const
+        {
+            if (r == -1)
+                return Wrap(0ULL - static_cast<uint64_t>(l));
+            return r ? l / r : 0;
+        }
+    };
+
+    // Both sides constant only happens with n == 1, so the lconst loop covers it
+    template <typename T, typename Op>
+    static void ArithKernel(const T *__restrict l, bool lconst, const T *__restrict r, bool rconst,
+                            T *__restrict out, size_t n, Op op)
+    {
+        if (lconst) {
+            const T lv = l[0];
+            for (size_t i = 0; i < n; ++i)
+                out[i] = op(lv, r[i]);
+        } else if (rconst) {
+            const T rv = r[0];
+            for (size_t i = 0; i < n; ++i)
+                out[i] = op(l[i], rv);
+        } else {
+            for (size_t i = 0; i < n; ++i)
+                out[i] = op(l[i], r[i]);
+        }
+    }
+
+    /* out = l op r for two INT or two FLOAT vectors. Constant operands give a constant result */
+    template <typename Op>
+    static void ArithInts(const Vector &l, const Vector &r, size_t count, Vector &out, Op op)
+    {
+        const bool constant = l.constant && r.constant;
+        const size_t n = constant ? 1 : count;
+        auto dst = out.MakeInts(n);
+        ArithKernel(l.ints, l.constant, r.ints, r.constant, dst, n, op);
+        out.constant = constant;
+    }
+
+    template <typename Op>
+    static void ArithFloats(const Vector &l, const Vector &r, size_t count, Vector &out, Op op)
+    {
+        const bool constant = l.constant && r.constant;
+        const size_t n = constant ? 1 : count;
+        auto dst = out.MakeFloats(n);
+        ArithKernel(l.floats, l.constant, r.floats, r.constant, dst, n, op);
+        out.constant = constant;
+    }
+
+    static void ToFloats(const Vector &in, size_t count, Vector &out)
+    {
+        const size_t n = in.constant ? 1 : count;
+        auto dst = out.MakeFloats(n);
+        if (in.type == CT_FLOAT) {
+            for (size_t i = 0; i < n; ++i)
+                dst[i] = in.floats[i];
+        } else {
+            for (size_t i = 0; i < n; ++i)
+                dst[i] = static_cast<double>(in.ints[i]);
+        }
+        out.constant = in.constant;
+    }
+
+    template <typename Op>
+    static void ArithAny(const Vector &l, const Vector &r, size_t count, Vector &out, Op op)
+    {
+        if (l.type == CT_INT && r.type == CT_INT) {
+            ArithInts(l, r, count, out, op);
+            return;
+        }
+
+        // Integer arithmetic stays integral, anything else is promoted to float
+        Vector lf, rf;
+        ToFloats(l, count, lf);
+        ToFloats(r, count, rf);
+        ArithFloats(lf, rf, count, out, op);
+    }
+
+    void ArithBatch(int op, const Vector &l, const Vector &r, size_t count, Vector &out)
+    {
+        if (l.type == CT_STR || r.type == CT_STR) {
+            out.Constant({});
+            return;
+        }
+
+        switch (op) {
+        case '*': ArithAny(l, r, count, out, MulOp{}); break;
+        case '/': ArithAny(l, r, count, out, DivOp{}); break;
+        case '-': ArithAny(l, r, count, out, SubOp{}); break;
+        case '+': ArithAny(l, r, count, out, AddOp{}); break;
+        default:  out.Constant({});                    break;
+        }
+    }
+
+    /* Vectorized comparison. A stride of 0 broadcasts a constant side */
+    template <typename T, typename Cmp>
+    static void CompareKernel(const T *l, size_t ls, const T *r, size_t rs, uint8_t *keep, size_t n, Cmp cmp)
+    {
+        for (size_t i = 0; i < n; ++i)
+            keep[i] &= static_cast<uint8_t>(cmp(l[i * ls], r[i * rs]));
+    }
+
+    template <typename T>
+    static void Compare(int op, const T *l, size_t ls, const T *r, size_t rs, uint8_t *keep, size_t n)
+    {
+        switch (op) {
+        case EO_LESS_THAN:           CompareKernel(l, ls, r, rs, keep, n, std::less<T>{});          break;
+        case EO_LESS_THAN_EQUAL:     CompareKernel(l, ls, r, rs, keep, n, std::less_equal<T>{});    break;
+        case EO_EQUALS:              CompareKernel(l, ls, r, rs, keep, n, std::equal_to<T>{});      break;
+        case EO_NOT_EQUAL:           CompareKernel(l, ls, r, rs, keep, n, std::not_equal_to<T>{});  break;
+        case EO_GREATER_THAN:        CompareKernel(l, ls, r, rs, keep, n, std::greater<T>{});       break;
+        case EO_GREATER_THAN_EQUALS: CompareKernel(l, ls, r, rs, keep, n, std::greater_equal<T>{}); break;
+        }
+    }
+
+    static bool Matches(int op, int c)
+    {
+        switch (op) {
+        case EO_LESS_THAN:           return c < 0;
+        case EO_LESS_THAN_EQUAL:     return c <= 0;
+        case EO_EQUALS:              return c == 0;
+        case EO_NOT_EQUAL:           return c != 0;
+        case EO_GREATER_THAN:        return c > 0;
+        case EO_GREATER_THAN_EQUALS: return c >= 0;
+        }
+        return false;
+    }
+
+    /*
+    * Comparison with a dictionary encoded side. Against a constant every
+    * distinct value is compared once and rows only look up their code.
+    */
+    static void CompareDictionary(int op, const Vector &l, const Vector &r, size_t count, uint8_t *keep)
+    {
+        if ((l.codes && r.constant) || (r.codes && l.constant)) {
+            const auto &dict = l.codes ? l : r;
+            const auto other = (l.codes ? r : l).Get(0);
+            std::vector<uint8_t> matches(dict.dict_size);
+            for (size_t i = 0; i < dict.dict_size; ++i) {
+                auto v = Value::Str(dict.dict[i]);
+                matches[i] = Matches(op, l.codes ? CompareValues(v, other) : CompareValues(other, v));
+            }
+
+            for (size_t i = 0; i < count; ++i)
+                keep[i] &= matches[dict.codes[i]];
+            return;
+        }
+
+        for (size_t i = 0; i < count; ++i)
+            keep[i] &= static_cast<uint8_t>(Matches(op, CompareValues(l.Get(i), r.Get(i))));
+    }
+
+    void CompareBatch(int op, const Vector &l, const Vector &r, size_t count, uint8_t *keep)
+    {
+        const size_t ls = l.constant ? 0 : 1;
+        const size_t rs = r.constant ? 0 : 1;
+
+        if (l.codes || r.codes) {
+            CompareDictionary(op, l, r, count, keep);
+        } else if (l.type == CT_INT && r.type == CT_INT) {
+            Compare(op, l.ints, ls, r.ints, rs, keep, count);
+        } else if (l.type == CT_STR && r.type == CT_STR) {
+            Compare(op, l.strs, ls, r.strs, rs, keep, count);
+        } else if (l.type != CT_STR && r.type != CT_STR) {
+            Vector lf, rf;
+            ToFloats(l, count, lf);
+            ToFloats(r, count, rf);
+            Compare(op, lf.floats, ls, rf.floats, rs, keep, count);
+        } else {
+            // String against a number, fall back to the generic ordering
+            for (size_t i = 0; i < count; ++i)
+                keep[i] &= static_cast<uint8_t>(Matches(op, CompareValues(l.Get(i), r.Get(i))));
+        }
+    }
+
+    /* Interpreter */
+
+    static const char *OpNames[] = {
+        "COLUMN", "CONST", "PARAM", "TO_F64",
+        "ADD_I64", "SUB_I64", "MUL_I64", "DIV_I64",
+        "ADD_F64", "SUB_F64", "MUL_F64", "DIV_F64",
+        "ARITH",
+        "CMP_LT_I64", "CMP_LE_I64", "CMP_EQ_I64", "CMP_NE_I64", "CMP_GT_I64", "CMP_GE_I64",
+        "CMP_LT_F64", "CMP_LE_F64", "CMP_EQ_F64", "CMP_NE_F64", "CMP_GT_F64", "CMP_GE_F64",
+        "CMP_LT_STR", "CMP_LE_STR", "CMP_EQ_STR", "CMP_NE_STR", "CMP_GT_STR", "CMP_GE_STR",
+        "CMP",
+        "HALT_IF_EMPTY",
+        "RESULT_ROW",
+    };
+    static_assert(sizeof(OpNames) / sizeof(OpNames[0]) == OP_RESULT_ROW + 1, "every opcode needs a name");
+
+    bool Program::Run(const Batch &batch, std::vector<Vector> &regs, std::vector<uint8_t> &keep) const
+    {
+        if (!RunFilters(batch, regs, keep))
+            return false;
+        RunProjections(batch, regs, keep);
+        return true;
+    }
+
+    bool Program::RunFilters(const Batch &batch, std::vector<Vector> &regs, std::vector<uint8_t> &keep) const
+    {
+        regs.resize(registers);
+        keep.assign(batch.count, 1);
+        return Execute(0, filter_end, batch, regs, keep);
+    }
+
+    void Program::RunProjections(const Batch &batch, std::vector<Vector> &regs, std::vector<uint8_t> &keep) const
+    {
+        Execute(filter_end, code.size(), batch, regs, keep);
+    }
+
+    bool Program::Execute(size_t begin, size_t end, const Batch &batch, std::vector<Vector> &regs, std::vector<uint8_t> &keep) const
+    {
+        const size_t n = batch.count;
+
+        // Only index the registers an opcode uses, b and c are slots, constants or parameters for some
+        auto r = regs.data();
+        for (size_t pc = begin; pc < end; ++pc) {
+            const auto &ins = code[pc];
+            switch (ins.op) {
+            case OP_COLUMN:  r[ins.a].Reference(batch.columns[ins.b][ins.c]); break;
+            case OP_CONST:   r[ins.a].Constant(constants[ins.b]);             break;
+            case OP_PARAM:   r[ins.a].Constant(batch.params[ins.b]);          break;
+            case OP_TO_F64:  ToFloats(r[ins.b], n, r[ins.a]);                 break;
+
+            case OP_ADD_I64: ArithInts(r[ins.b], r[ins.c], n, r[ins.a], AddOp{});   break;
+            case OP_SUB_I64: ArithInts(r[ins.b], r[ins.c], n, r[ins.a], SubOp{});   break;
+            case OP_MUL_I64: ArithInts(r[ins.b], r[ins.c], n, r[ins.a], MulOp{});   break;
+            case OP_DIV_I64: ArithInts(r[ins.b], r[ins.c], n, r[ins.a], DivOp{});   break;
+            case OP_ADD_F64: ArithFloats(r[ins.b], r[ins.c], n, r[ins.a], AddOp{}); break;
+            case OP_SUB_F64: ArithFloats(r[ins.b], r[ins.c], n, r[ins.a], SubOp{}); break;
+            case OP_MUL_F64: ArithFloats(r[ins.b], r[ins.c], n, r[ins.a], MulOp{}); break;
+            case OP_DIV_F64: ArithFloats(r[ins.b], r[ins.c], n, r[ins.a], DivOp{}); break;
+            case OP_ARITH:   ArithBatch(ins.d, r[ins.b], r[ins.c], n, r[ins.a]);    break;
+
+            // Comparisons only read their registers and write keep
+            case OP_CMP_LT_I64: case OP_CMP_LE_I64: case OP_CMP_EQ_I64:
+            case OP_CMP_NE_I64: case OP_CMP_GT_I64: case OP_CMP_GE_I64:
+                Compare(ins.op - OP_CMP_LT_I64, r[ins.a].ints, r[ins.a].constant ? 0 : 1,
+                        r[ins.b].ints, r[ins.b].constant ? 0 : 1, keep.data(), n);
+                break;
+            case OP_CMP_LT_F64: case OP_CMP_LE_F64: case OP_CMP_EQ_F64:
+            case OP_CMP_NE_F64: case OP_CMP_GT_F64: case OP_CMP_GE_F64:
+                Compare(ins.op - OP_CMP_LT_F64, r[ins.a].floats, r[ins.a].constant ? 0 : 1,
+                        r[ins.b].floats, r[ins.b].constant ? 0 : 1, keep.data(), n);
+                break;
+            case OP_CMP_LT_STR: case OP_CMP_LE_STR: case OP_CMP_EQ_STR:
+            case OP_CMP_NE_STR: case OP_CMP_GT_STR: case OP_CMP_GE_STR:
+                if (r[ins.a].codes || r[ins.b].codes)
+                    CompareDictionary(ins.op - OP_CMP_LT_STR, r[ins.a], r[ins.b], n, keep.data());
+                else
+                    Compare(ins.op - OP_CMP_LT_STR, r[ins.a].strs, r[ins.a].constant ? 0 : 1,
+                            r[ins.b].strs, r[ins.b].constant ? 0 : 1, keep.data(), n);
+                break;
+            case OP_CMP:
+                CompareBatch(ins.d, r[ins.a], r[ins.b], n, keep.data());
+                break;
+
+            case OP_HALT_IF_EMPTY: {
+                bool any = false;
+                for (auto k : keep)
+                    any |= k != 0;
+                if (!any)
+                    return false;
+                break;
+            }
+            case OP_RESULT_ROW:
+                return true;
+            }
+        }
+        return true;
+    }
+
+    void Program::Print() const
+    {
+        asql::Print("addr | opcode        |    a |    b |    c |    d | comment\n");
+        for (size_t i = 0; i < code.size(); ++i) {
+            const auto &ins = code[i];
+            asql::Print("%4zu | %-13s | %4u | %4u | %4u | %4d | %s\n",
+                         i, OpNames[ins.op], ins.a, ins.b, ins.c, ins.d, comments[i].c_str());
+        }
+    }
+
+    /* Compiler */
+
+    // Operand type only known once parameters are bound
+    static constexpr int TYPE_UNKNOWN = -1;
+
+    class ProgramCompiler {
+    public:
+        ProgramCompiler(const SelectQuery &query, Program &prog): query{query}, prog{prog} {}
+
+        /* Emit the code computing expr, returns its register and sets type to its result type */
+        uint32_t Compile(const Expr *expr, int &type);
+        void CompileFilter(const Filter &filter);
+        void Emit(OpCode op, uint32_t a, uint32_t b, uint32_t c, int32_t d, std::string comment);
+        uint32_t Constant(const Value &v);
+
+    private:
+        uint32_t Register() { return static_cast<uint32_t>(prog.registers++); }
+        /* A FLOAT copy of an INT register, FLOAT registers are used as they are */
+        uint32_t Floats(uint32_t reg, int type);
+
+        const SelectQuery &query;
+        Program &prog;
+        // A column read by several expressions is loaded once
+        std::map<std::pair<int, int>, uint32_t> loaded;
+    };
+
+    void ProgramCompiler::Emit(OpCode op, uint32_t a, uint32_t b, uint32_t c, int32_t d, std::string comment)
+    {
+        prog.code.push_back({op, a, b, c, d});
+        prog.comments.push_back(std::move(comment));
+    }
+
+    uint32_t ProgramCompiler::Constant(const Value &v)
+    {
+        auto reg = Register();
+        Emit(OP_CONST, reg, static_cast<uint32_t>(prog.constants.size()), 0, 0,
+             v.type == CT_STR ? "'" + v.s + "'" : v.ToString());
+        prog.constants.push_back(v);
+        return reg;
+    }
+
+    uint32_t ProgramCompiler::Floats(uint32_t reg, int type)
+    {
+        if (type == CT_FLOAT)
+            return reg;
+        auto out = Register();
+        Emit(OP_TO_F64, out, reg, 0, 0, "");
+        return out;
+    }
+
+    static int ArithIndex(int op)
+    {
+        switch (op) {
+        case '+': return 0;
+        case '-': return 1;
+        case '*': return 2;
+        case '/': return 3;
+        }
+        return -1;
+    }
+
+    /* Evaluate expr at compile time if it has no column or parameter in it */
+    static bool Fold(const Expr *expr, Value &out)
+    {
+        if (auto i = dynamic_cast<const IntExpr*>(expr)) {
+            out = Value::Int(i->number);
+            return true;
+        }
+        if (auto f = dynamic_cast<const FloatExpr*>(expr)) {
+            out = Value::Float(f->number);
+            return true;
+        }
+        if (auto s = dynamic_cast<const StringExpr*>(expr)) {
+            out = Value::Str(std::string(s->str));
+            return true;
+        }
+
+        // Run the batch kernel over a single row, so a folded value matches the unfolded one exactly
+        auto b = dynamic_cast<const BinaryExpr*>(expr);
+        Value l, r;
+        if (!b || ArithIndex(b->op) < 0 || !Fold(b->lhs, l) || !Fold(b->rhs, r))
+            return false;
+
+        Vector lv, rv, result;
+        lv.Constant(l);
+        rv.Constant(r);
+        ArithBatch(b->op, lv, rv, 1, result);
+        out = result.Get(0);
+        return true;
+    }
+
+    uint32_t ProgramCompiler::Compile(const Expr *expr, int &type)
+    {
+        // Constant subtrees, e.g. 2 * 3 in 2 * 3 + weight_kg, become a single constant
+        Value folded;
+        if (Fold(expr, folded)) {
+            type = folded.type;
+            return Constant(folded);
+        }
+
+        if (auto v = dynamic_cast<const VariableExpr*>(expr)) {
+            type = v->type;
+            auto key = std::make_pair(v->slot, v->column);
+            if (auto f = loaded.find(key); f != loaded.end())
+                return f->second;
+
+            auto reg = Register();
+            const auto &table = query.tables[static_cast<size_t>(v->slot)];
+            Emit(OP_COLUMN, reg, static_cast<uint32_t>(v->slot), static_cast<uint32_t>(v->column), 0,
+                 std::string(table.alias) + "." + std::string(v->name));
+            loaded.emplace(key, reg);
+            return reg;
+        }
+
+        if (auto p = dynamic_cast<const ParamExpr*>(expr)) {
+            type = TYPE_UNKNOWN;
+            auto reg = Register();
+            Emit(OP_PARAM, reg, static_cast<uint32_t>(p->index), 0, 0, "?" + std::to_string(p->index + 1));
+            return reg;
+        }
+
+        auto b = dynamic_cast<const BinaryExpr*>(expr);
+        if (!b || ArithIndex(b->op) < 0) {
+            // Anything else evaluates to the default value, as Expr::EvalBatch() does
+            type = CT_INT;
+            return Constant({});
+        }
+
+        int ltype, rtype;
+        auto l = Compile(b->lhs, ltype);
+        auto r = Compile(b->rhs, rtype);
+        if (ltype == CT_STR || rtype == CT_STR) {
+            type = CT_INT;
+            return Constant({});
+        }
+
+        auto reg = Register();
+        if (ltype == TYPE_UNKNOWN || rtype == TYPE_UNKNOWN) {
+            type = TYPE_UNKNOWN;
+            Emit(OP_ARITH, reg, l, r, b->op, std::string(1, static_cast<char>(b->op)));
+        } else if (ltype == CT_INT && rtype == CT_INT) {
+            type = CT_INT;
+            Emit(static_cast<OpCode>(OP_ADD_I64 + ArithIndex(b->op)), reg, l, r, 0, "");
+        } else {
+            type = CT_FLOAT;
+            l = Floats(l, ltype);
+            r = Floats(r, rtype);
+            Emit(static_cast<OpCode>(OP_ADD_F64 + ArithIndex(b->op)), reg, l, r, 0, "");
+        }
+        return reg;
+    }
+
+    void ProgramCompiler::CompileFilter(const Filter &filter)
+    {
+        int ltype, rtype;
+        auto l = Compile(filter.lhs, ltype);
+        auto r = Compile(filter.rhs, rtype);
+        const int op = filter.Op;
+
+        if (ltype == TYPE_UNKNOWN || rtype == TYPE_UNKNOWN || (ltype == CT_STR) != (rtype == CT_STR)) {
+            Emit(OP_CMP, l, r, 0, op, "");
+        } else if (ltype == CT_STR) {
+            Emit(static_cast<OpCode>(OP_CMP_LT_STR + op), l, r, 0, 0, "");
+        } else if (ltype == CT_INT && rtype == CT_INT) {
+            Emit(static_cast<OpCode>(OP_CMP_LT_I64 + op), l, r, 0, 0, "");
+        } else {
+            l = Floats(l, ltype);
+            r = Floats(r, rtype);
+            Emit(static_cast<OpCode>(OP_CMP_LT_F64 + op), l, r, 0, 0, "");
+        }
+    }
+
+    /* The FROM slot every column of filter is read from, -1 if it reads none or several */
+    static int FilterSlot(const Filter &filter)
+    {
+        int slot = -1;
+        for (auto expr : {filter.lhs, filter.rhs}) {
+            for (auto var : expr->GetVariables()) {
+                if (slot >= 0 && var->slot != slot)
+                    return -1;
+                slot = var->slot;
+            }
+        }
+        return slot;
+    }
+
+    void CompileQuery(SelectQuery &query)
+    {
+        auto &prog = query.program;
+        prog = Program{};
+        ProgramCompiler compiler{query, prog};
+        int type;
+
+        // A join pushes the filters on a single table below it, they cut down its input instead of the joined tuples
+        query.join_filters.assign(query.tables.size() > 1 ? query.tables.size() : 0, Program{});
+        std::vector<ProgramCompiler> pushed;
+        for (auto &join_filter : query.join_filters)
+            pushed.emplace_back(query, join_filter);
+
+        bool filtered = false;
+        for (const auto &filter : query.filters) {
+            int slot = pushed.empty() ? -1 : FilterSlot(filter);
+            if (slot >= 0) {
+                pushed[static_cast<size_t>(slot)].CompileFilter(filter);
+                continue;
+            }
+            compiler.CompileFilter(filter);
+            filtered = true;
+        }
+        if (filtered) {
+            compiler.Emit(OP_HALT_IF_EMPTY, 0, 0, 0, 0, "");
+            prog.filter_end = prog.code.size();
+        }
+        for (size_t slot = 0; slot < pushed.size(); ++slot)
+            if (query.join_filters[slot].code.size())
+                pushed[slot].Emit(OP_RESULT_ROW, 0, 0, 0, 0, "");
+
+        // Aggregating queries output groups, only their keys and aggregate arguments are computed per row
+        if (query.IsAggregate()) {
+            for (auto expr : query.group_by)
+                prog.group_keys.push_back(compiler.Compile(expr, type));
+            for (auto agg : query.aggregates)
+                prog.aggregate_args.push_back(agg->args.size() ? compiler.Compile(agg->args[0], type) : compiler.Constant({}));
+        } else {
+            for (auto column : query.columns)
+                prog.columns.push_back(compiler.Compile(column, type));
+            for (const auto &key : query.order_by)
+                prog.order_keys.push_back(key.column >= 0 ? prog.columns[static_cast<size_t>(key.column)] : compiler.Compile(key.expr, type));
+        }
+
+        std::string results;
+        for (auto list : {&prog.columns, &prog.group_keys, &prog.aggregate_args, &prog.order_keys})
+            for (auto reg : *list)
+                results += (results.empty() ? "r" : ", r") + std::to_string(reg);
+        compiler.Emit(OP_RESULT_ROW, 0, 0, 0, 0, results);
+    }
+
+}
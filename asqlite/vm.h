@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "database.h"
+#include "parser.h"
+
+
+namespace asql {
+
+    class SelectQuery;
+
+    /*
+    * Opcodes of a query program. Registers hold a Vector, so an instruction
+    * runs over a whole batch and dispatch costs nothing per row. Arithmetic
+    * and comparisons are typed when both operand types are known once the
+    * query is bound. The untyped OP_ARITH and OP_CMP look at the vectors
+    * instead, that is only needed when a '?' parameter is an operand.
+    */
+    enum OpCode : uint8_t {
+        OP_COLUMN,          // r[a] = column c of FROM slot b
+        OP_CONST,           // r[a] = constants[b]
+        OP_PARAM,           // r[a] = parameter b
+        OP_TO_F64,          // r[a] = r[b] as FLOAT
+        OP_ADD_I64,         // r[a] = r[b] + r[c]
+        OP_SUB_I64,
+        OP_MUL_I64,
+        OP_DIV_I64,
+        OP_ADD_F64,
+        OP_SUB_F64,
+        OP_MUL_F64,
+        OP_DIV_F64,
+        OP_ARITH,           // r[a] = r[b] d r[c], d is the operator character
+        // Keep the rows where r[a] op r[b], in EqualityOp order for every type
+        OP_CMP_LT_I64, OP_CMP_LE_I64, OP_CMP_EQ_I64, OP_CMP_NE_I64, OP_CMP_GT_I64, OP_CMP_GE_I64,
+        OP_CMP_LT_F64, OP_CMP_LE_F64, OP_CMP_EQ_F64, OP_CMP_NE_F64, OP_CMP_GT_F64, OP_CMP_GE_F64,
+        OP_CMP_LT_STR, OP_CMP_LE_STR, OP_CMP_EQ_STR, OP_CMP_NE_STR, OP_CMP_GT_STR, OP_CMP_GE_STR,
+        OP_CMP,             // keep the rows where r[a] d r[b], d is the EqualityOp
+        OP_HALT_IF_EMPTY,   // stop once the filters left no row
+        OP_RESULT_ROW,      // the kept rows are output through the result registers, ends the program
+    };
+
+    struct Instruction {
+        OpCode op;
+        uint32_t a = 0;
+        uint32_t b = 0;
+        uint32_t c = 0;
+        int32_t d = 0;
+    };
+
+    /*
+    * A SELECT lowered into straight-line code over a batch: the WHERE clause
+    * first, then every expression the query outputs. The morsel loop feeds
+    * it one batch at a time. Compiled once by Validate() and shared by every
+    * execution of a cached plan, so it's never modified after that.
+    */
+    class Program {
+    public:
+        /*
+        * Run over batch. keep ends up with a 1 for every row that passes the
+        * filters. Returns false when the filters left no row, the result
+        * registers aren't computed then.
+        */
+        bool Run(const Batch &batch, std::vector<Vector> &regs, std::vector<uint8_t> &keep) const;
+        /* Run() in two halves, the WHERE clause and then the result registers of the rows it kept */
+        bool RunFilters(const Batch &batch, std::vector<Vector> &regs, std::vector<uint8_t> &keep) const;
+        void RunProjections(const Batch &batch, std::vector<Vector> &regs, std::vector<uint8_t> &keep) const;
+        /* EXPLAIN listing, one instruction per line */
+        void Print() const;
+
+        std::vector<Instruction> code;
+        // What an instruction works on, for the listing
+        std::vector<std::string> comments;
+        std::vector<Value> constants;
+        size_t registers = 0;
+        // The instructions before it are the WHERE clause, ending with HALT_IF_EMPTY
+        size_t filter_end = 0;
+
+        /* Result registers. Aggregating queries only fill group_keys and aggregate_args */
+        std::vector<uint32_t> columns;
+        std::vector<uint32_t> group_keys;
+        std::vector<uint32_t> aggregate_args;
+        // One per ORDER BY key of a non-aggregating query, keys naming a column share its register
+        std::vector<uint32_t> order_keys;
+
+    private:
+        bool Execute(size_t begin, size_t end, const Batch &batch, std::vector<Vector> &regs, std::vector<uint8_t> &keep) const;
+    };
+
+    /* Lower the bound query into query.program */
+    void CompileQuery(SelectQuery &query);
+
+    /* Vectorized arithmetic and comparison on vectors of any type, shared with the Expr tree */
+    void ArithBatch(int op, const Vector &l, const Vector &r, size_t count, Vector &out);
+    void CompareBatch(int op, const Vector &l, const Vector &r, size_t count, uint8_t *keep);
+
+}
@@ -0,0 +1,235 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "wal.h"
+#include "output.h"
+
+
+namespace asql {
+
+    // SYNC_OFF writes the buffered log once it grows past this
+    static constexpr size_t WAL_BUFFER_BYTES = 1 << 20;
+
+    /* Record framing: payload length, LSN, checksum of both, then the payload */
+    struct RecordHeader {
+        uint32_t length;
+        uint32_t checksum;
+        Lsn lsn;
+    };
+
+    static uint32_t Checksum(Lsn lsn, const char *data, size_t len)
+    {
+        // FNV-1a, enough to spot a torn write at the end of the log
+        uint32_t h = 2166136261u;
+        auto mix = [&](const char *p, size_t n) {
+            for (size_t i = 0; i < n; ++i) {
+                h ^= static_cast<unsigned char>(p[i]);
+                h *= 16777619u;
+            }
+        };
+        mix(reinterpret_cast<const char*>(&lsn), sizeof(lsn));
+        mix(data, len);
+        return h;
+    }
+
+    bool ParseSyncMode(const std::string &name, SyncMode &mode)
+    {
+        if (name == "full")
+            mode = SYNC_FULL;
+        else if (name == "normal")
+            mode = SYNC_NORMAL;
+        else if (name == "off")
+            mode = SYNC_OFF;
+        else
+            return false;
+        return true;
+    }
+
+    const char* SyncModeName(SyncMode mode)
+    {
+        switch (mode) {
+        case SYNC_FULL:   return "full";
+        case SYNC_NORMAL: return "normal";
+        case SYNC_OFF:    return "off";
+        }
+        return "?";
+    }
+
+    WriteAheadLog::~WriteAheadLog()
+    {
+        if (fd >= 0)
+            close(fd);
+    }
+
+    bool WriteAheadLog::Open(const std::string &path, SyncMode sync_mode, Lsn last_checkpoint)
+    {
+        fd = open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+        if (fd < 0) {
+            Print("Unable to open write-ahead log '%s'\n", path.c_str());
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+            Print("Unable to stat write-ahead log '%s'\n", path.c_str());
+            return false;
+        }
+
+        mode = sync_mode;
+        file_size = static_cast<size_t>(st.st_size);
+        checkpoint_lsn = last_checkpoint;
+        next_lsn = checkpoint_lsn + 1;
+        written_lsn = synced_lsn = checkpoint_lsn;
+        return true;
+    }
+
+    Lsn WriteAheadLog::Append(const std::vector<char> &payload)
+    {
+        std::lock_guard<std::mutex> guard{lock};
+        auto lsn = next_lsn++;
+
+        RecordHeader h{static_cast<uint32_t>(payload.size()), Checksum(lsn, payload.data(), payload.size()), lsn};
+        auto p = reinterpret_cast<const char*>(&h);
+        pending.insert(pending.end(), p, p + sizeof(h));
+        pending.insert(pending.end(), payload.begin(), payload.end());
+        return lsn;
+    }
+
+    /* Write out everything buffered so far. The lock is dropped for the I/O, flushing keeps other writers out */
+    bool WriteAheadLog::WritePending(std::unique_lock<std::mutex> &guard, bool sync)
+    {
+        flushing = true;
+        std::vector<char> buf;
+        buf.swap(pending);
+        Lsn upto = next_lsn - 1;
+        guard.unlock();
+
+        bool ok = true;
+        for (size_t off = 0; off < buf.size() && ok; ) {
+            auto n = write(fd, buf.data() + off, buf.size() - off);
+            if (n <= 0)
+                ok = false;
+            else
+                off += static_cast<size_t>(n);
+        }
+        if (ok && sync)
+            ok = fdatasync(fd) == 0;
+
+        guard.lock();
+        flushing = false;
+        if (ok) {
+            file_size += buf.size();
+            written_lsn = upto;
+            if (sync)
+                synced_lsn = upto;
+            syncs += sync;
+        } else {
+            Print("Failed to write the write-ahead log\n");
+        }
+        flushed.notify_all();
+        return ok;
+    }
+
+    bool WriteAheadLog::Commit(Lsn lsn)
+    {
+        std::unique_lock<std::mutex> guard{lock};
+        commits++;
+
+        if (mode == SYNC_OFF) {
+            if (flushing || pending.size() < WAL_BUFFER_BYTES)
+                return true;
+            return WritePending(guard, false);
+        }
+
+        // Whoever finds no flush in progress writes out every waiting committer's records
+        bool sync = mode == SYNC_FULL;
+        while ((sync ? synced_lsn : written_lsn) < lsn) {
+            if (flushing) {
+                flushed.wait(guard);
+                continue;
+            }
+            if (!WritePending(guard, sync))
+                return false;
+        }
+        return true;
+    }
+
+    bool WriteAheadLog::Replay(const std::function<bool(ByteReader&)> &apply)
+    {
+        std::vector<char> log(file_size);
+        for (size_t off = 0; off < log.size(); ) {
+            auto n = pread(fd, log.data() + off, log.size() - off, static_cast<off_t>(off));
+            if (n <= 0) {
+                Print("Failed to read the write-ahead log\n");
+                return false;
+            }
+            off += static_cast<size_t>(n);
+        }
+
+        size_t off = 0;
+        while (off + sizeof(RecordHeader) <= log.size()) {
+            RecordHeader h;
+            memcpy(&h, log.data() + off, sizeof(h));
+
+            const char *payload = log.data() + off + sizeof(h);
+            if (h.length > log.size() - off - sizeof(h) || h.checksum != Checksum(h.lsn, payload, h.length))
+                break;
+
+            off += sizeof(h) + h.length;
+            if (h.lsn <= checkpoint_lsn)
+                continue;
+
+            ByteReader r{payload, h.length};
+            if (!apply(r))
+                return false;
+
+            next_lsn = std::max(next_lsn, h.lsn + 1);
+        }
+
+        written_lsn = synced_lsn = next_lsn - 1;
+
+        // Anything past the last intact record is a write that never completed
+        if (off < log.size()) {
+            Print("Discarding %zu bytes of incomplete write-ahead log\n", log.size() - off);
+            if (ftruncate(fd, static_cast<off_t>(off)) < 0)
+                return false;
+            file_size = off;
+        }
+        return true;
+    }
+
+    bool WriteAheadLog::Reset()
+    {
+        std::unique_lock<std::mutex> guard{lock};
+        while (flushing)
+            flushed.wait(guard);
+
+        pending.clear();
+        if (ftruncate(fd, 0) < 0) {
+            Print("Failed to truncate the write-ahead log\n");
+            return false;
+        }
+
+        file_size = 0;
+        checkpoint_lsn = written_lsn = synced_lsn = next_lsn - 1;
+        flushed.notify_all();
+        return true;
+    }
+
+    Lsn WriteAheadLog::LastLsn()
+    {
+        std::lock_guard<std::mutex> guard{lock};
+        return next_lsn - 1;
+    }
+
+    size_t WriteAheadLog::Size()
+    {
+        std::lock_guard<std::mutex> guard{lock};
+        return file_size + pending.size();
+    }
+}
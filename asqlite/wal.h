@@ -0,0 +1,87 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "serialize.h"
+
+
+namespace asql {
+
+    /*
+    * How far a commit goes before it returns
+    *   SYNC_FULL:   the log is fsync'd, survives power loss
+    *   SYNC_NORMAL: the log is written to the OS, survives the process crashing
+    *   SYNC_OFF:    the log is buffered in memory and written when it fills up
+    */
+    enum SyncMode {
+        SYNC_FULL,
+        SYNC_NORMAL,
+        SYNC_OFF,
+    };
+
+    bool ParseSyncMode(const std::string &name, SyncMode &mode);
+    const char* SyncModeName(SyncMode mode);
+
+    /* Log record payloads */
+    enum WalRecord : uint8_t {
+        WAL_INSERT    = 1, // table name, then the row's values
+        WAL_STATEMENT = 2, // normalized UPDATE or DELETE text, replayed through the parser
+        WAL_ROWS      = 3, // table name, then a batch of rows a column at a time
+    };
+
+    using Lsn = uint64_t;
+
+
+    /*
+    * Append-only redo log next to the database file. Every record gets an LSN,
+    * the last checkpointed one is kept in the database header and replay skips
+    * anything at or before it. Committers that arrive while another one is
+    * syncing wait and are covered by a single write + fsync (group commit).
+    */
+    class WriteAheadLog {
+    public:
+        ~WriteAheadLog();
+
+        bool Open(const std::string &path, SyncMode mode, Lsn checkpoint_lsn);
+
+        /* Buffer a record, it isn't durable until Commit() covers its LSN */
+        Lsn Append(const std::vector<char> &payload);
+        bool Commit(Lsn lsn);
+
+        /* Call apply for every intact record the checkpoint doesn't cover. A torn tail is cut off */
+        bool Replay(const std::function<bool(ByteReader&)> &apply);
+
+        /* Everything up to LastLsn() is in the checkpointed database, start an empty log */
+        bool Reset();
+
+        Lsn LastLsn();
+        size_t Size();
+
+        SyncMode mode = SYNC_FULL;
+        // Counted under lock, read by .stats and benchmarks from any thread
+        std::atomic<size_t> commits{0};
+        std::atomic<size_t> syncs{0};
+
+    private:
+        bool WritePending(std::unique_lock<std::mutex> &guard, bool sync);
+
+        int fd = -1;
+        std::mutex lock;
+        std::condition_variable flushed;
+        std::vector<char> pending;
+        Lsn checkpoint_lsn = 0;
+        Lsn next_lsn = 1;
+        // Highest LSN handed to the OS and highest LSN known to be on disk
+        Lsn written_lsn = 0;
+        Lsn synced_lsn = 0;
+        bool flushing = false;
+        size_t file_size = 0;
+    };
+
+}
@@ -0,0 +1,59 @@
+/*
+* Write the generated sample tables as CSV files with a header line, ready
+* for .import. employees.csv, hours.csv and employee_type.csv go to dir.
+*
+* usage: datagen [scale_factor] [dir] [seed]
+*/
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "datagen.h"
+
+static bool WriteCsv(const std::string &path, const char *table, const asql::RowGroup &rows)
+{
+    FILE *f = fopen(path.c_str(), "w");
+    if (!f) {
+        printf("Unable to create '%s'\n", path.c_str());
+        return false;
+    }
+
+    const auto &schema = asql::database_tables.at(table);
+    for (size_t c = 0; c < schema.size(); ++c)
+        fprintf(f, "%s%s", c ? "," : "", schema.columns[c].first.c_str());
+    fputc('\n', f);
+
+    for (size_t r = 0; r < rows.rows; ++r) {
+        for (size_t c = 0; c < rows.columns.size(); ++c) {
+            const auto &col = rows.columns[c];
+            if (c)
+                fputc(',', f);
+            switch (col.type) {
+            case asql::CT_INT:   fprintf(f, "%lld", static_cast<long long>(col.ints[r])); break;
+            case asql::CT_FLOAT: fprintf(f, "%.1f", col.floats[r]);                      break;
+            case asql::CT_STR:   fputs(col.strs[r].c_str(), f);                           break;
+            }
+        }
+        fputc('\n', f);
+    }
+
+    bool ok = !ferror(f);
+    ok &= fclose(f) == 0;
+    if (!ok)
+        printf("Unable to write '%s'\n", path.c_str());
+    else
+        printf("%s: %zu rows\n", path.c_str(), rows.rows);
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    double scale = argc > 1 ? strtod(argv[1], nullptr) : 1;
+    std::string dir = argc > 2 ? argv[2] : ".";
+    uint64_t seed = argc > 3 ? strtoull(argv[3], nullptr, 10) : bench::DEFAULT_SEED;
+
+    bool ok = WriteCsv(dir + "/employee_type.csv", "EMPLOYEE_TYPE", bench::GenerateEmployeeTypes()) &&
+              WriteCsv(dir + "/employees.csv", "EMPLOYEES", bench::GenerateEmployees(scale, seed)) &&
+              WriteCsv(dir + "/hours.csv", "HOURS", bench::GenerateHours(scale, seed));
+    return ok ? 0 : 1;
+}
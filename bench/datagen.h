@@ -0,0 +1,111 @@
+#pragma once
+
+/*
+* Deterministic rows for the sample schemas. The same scale factor and seed
+* always give the same tables, so numbers from two builds are comparable.
+* Scale factor 1 is 1000 employees with 100 HOURS rows each. HOURS is
+* generated in TIME_START order, the way shifts are logged.
+*/
+
+#include <algorithm>
+#include <cstdint>
+
+#include "database.h"
+
+
+namespace bench {
+
+    constexpr size_t EMPLOYEES_PER_SCALE = 1000;
+    constexpr size_t HOURS_PER_EMPLOYEE = 100;
+    constexpr uint64_t DEFAULT_SEED = 42;
+
+    inline constexpr const char *FirstNames[] = {
+        "Anu", "Tak", "Sav", "Raj", "Mia", "Leo", "Ava", "Kai", "Zoe", "Eli", "Ivy", "Max", "Ana", "Ben", "Lia", "Sam",
+        "Noa", "Ari", "Eva", "Ian", "Uma", "Jon", "Kim", "Ray", "Tia", "Ola", "Dev", "Ida", "Yan", "Liv", "Oto", "Pia",
+    };
+    inline constexpr const char *TypeNames[] = {"eng", "ops", "sales", "support", "finance", "legal", "research", "admin"};
+
+    /* xorshift64*, small and the same everywhere */
+    class Rng {
+    public:
+        Rng(uint64_t seed): state{seed ? seed : 1} {}
+
+        uint64_t Next()
+        {
+            state ^= state >> 12;
+            state ^= state << 25;
+            state ^= state >> 27;
+            return state * 0x2545f4914f6cdd1dULL;
+        }
+        size_t Below(size_t n) { return static_cast<size_t>(Next() % n); }
+
+    private:
+        uint64_t state;
+    };
+
+    inline size_t EmployeeCount(double scale)
+    {
+        return std::max<size_t>(static_cast<size_t>(scale * EMPLOYEES_PER_SCALE), 1);
+    }
+
+    /* Empty columns in schema order, ready to append to */
+    inline asql::RowGroup EmptyRows(const char *table)
+    {
+        asql::RowGroup rows;
+        for (const auto &col : asql::database_tables.at(table))
+            rows.columns.emplace_back(col.second);
+        return rows;
+    }
+
+    inline asql::RowGroup GenerateEmployeeTypes()
+    {
+        auto rows = EmptyRows("EMPLOYEE_TYPE");
+        for (size_t i = 0; i < sizeof(TypeNames) / sizeof(TypeNames[0]); ++i) {
+            rows.columns[0].ints.push_back(static_cast<int64_t>(i));
+            rows.columns[1].strs.push_back(TypeNames[i]);
+            rows.rows++;
+        }
+        return rows;
+    }
+
+    inline asql::RowGroup GenerateEmployees(double scale, uint64_t seed = DEFAULT_SEED)
+    {
+        Rng rng{seed};
+        auto rows = EmptyRows("EMPLOYEES");
+        for (size_t i = 0; i < EmployeeCount(scale); ++i) {
+            rows.columns[0].ints.push_back(static_cast<int64_t>(i));
+            rows.columns[1].ints.push_back(static_cast<int64_t>(rng.Below(sizeof(TypeNames) / sizeof(TypeNames[0]))));
+            rows.columns[2].strs.push_back(FirstNames[rng.Below(sizeof(FirstNames) / sizeof(FirstNames[0]))]);
+            rows.columns[3].floats.push_back(50 + static_cast<double>(rng.Below(800)) / 10);
+            rows.rows++;
+        }
+        return rows;
+    }
+
+    inline asql::RowGroup GenerateHours(double scale, uint64_t seed = DEFAULT_SEED)
+    {
+        Rng rng{seed + 1};
+        const size_t employees = EmployeeCount(scale);
+        auto rows = EmptyRows("HOURS");
+        int64_t time = 0;
+        for (size_t i = 0; i < employees * HOURS_PER_EMPLOYEE; ++i) {
+            time += static_cast<int64_t>(rng.Below(60));
+            rows.columns[0].ints.push_back(static_cast<int64_t>(rng.Below(employees)));
+            rows.columns[1].ints.push_back(time);
+            rows.columns[2].ints.push_back(time + 60 + static_cast<int64_t>(rng.Below(480)));
+            rows.rows++;
+        }
+        return rows;
+    }
+
+    /* Fill the in-memory tables, replacing whatever they held */
+    inline bool LoadData(double scale, uint64_t seed = DEFAULT_SEED)
+    {
+        asql::TableData.clear();
+        asql::InitTables();
+        return asql::GetTable("EMPLOYEE_TYPE")->AppendRows(GenerateEmployeeTypes()) &&
+               asql::GetTable("EMPLOYEES")->AppendRows(GenerateEmployees(scale, seed)) &&
+               asql::GetTable("HOURS")->AppendRows(GenerateHours(scale, seed));
+    }
+
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+/*
+* Timing harness shared by the benchmarks. A benchmark runs its operation
+* in a loop for at least a minimum time, timing every call, and prints one
+* CSV row with the throughput and latency percentiles so runs of two
+* versions can be diffed or loaded into anything that reads CSV.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+
+namespace bench {
+
+    // Operations a benchmark runs at the least, however slow they are
+    constexpr size_t MIN_OPS = 5;
+
+    inline void PrintHeader()
+    {
+        printf("suite,benchmark,ops,seconds,ops_per_sec,p50_us,p95_us,p99_us,max_us\n");
+        fflush(stdout);
+    }
+
+    /* Nearest rank percentile of sorted samples */
+    inline double Percentile(const std::vector<double> &sorted, double p)
+    {
+        size_t rank = static_cast<size_t>(p / 100 * static_cast<double>(sorted.size()));
+        return sorted[std::min(rank, sorted.size() - 1)];
+    }
+
+    /* Time op() until min_seconds have passed, after one untimed warm up call */
+    template <typename Fn>
+    void Run(const std::string &suite, const std::string &name, double min_seconds, Fn op)
+    {
+        using Clock = std::chrono::steady_clock;
+        op();
+
+        std::vector<double> samples;
+        const auto start = Clock::now();
+        double elapsed = 0;
+        while (elapsed < min_seconds || samples.size() < MIN_OPS) {
+            const auto t = Clock::now();
+            op();
+            const auto end = Clock::now();
+            samples.push_back(std::chrono::duration<double, std::micro>(end - t).count());
+            elapsed = std::chrono::duration<double>(end - start).count();
+        }
+
+        std::sort(samples.begin(), samples.end());
+        printf("%s,%s,%zu,%.3f,%.0f,%.3f,%.3f,%.3f,%.3f\n", suite.c_str(), name.c_str(), samples.size(), elapsed,
+               static_cast<double>(samples.size()) / elapsed, Percentile(samples, 50), Percentile(samples, 95),
+               Percentile(samples, 99), samples.back());
+        fflush(stdout);
+    }
+
+}
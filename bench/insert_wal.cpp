@@ -0,0 +1,80 @@
+/*
+* Durable insert throughput. Every thread owns a Session and runs INSERTs of
+* batch rows each against a fresh database file, for each sync mode and
+* thread count. With sync full the commits of concurrent threads share
+* fsyncs, compare syncs against commits to see how well group commit batches
+* them.
+*
+* usage: insert_wal [max_threads] [rows_per_thread] [db_path] [batch]
+*/
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "database.h"
+#include "lexer.h"
+#include "statement.h"
+
+static void InsertLoop(size_t thread, size_t rows, size_t batch)
+{
+    asql::Session session;
+    for (size_t i = 0; i < rows; ) {
+        std::string sql = "INSERT INTO hours VALUES ";
+        for (size_t end = std::min(rows, i + batch); i < end; ++i) {
+            sql += "(" + std::to_string(thread) + ", " + std::to_string(i) + ", " + std::to_string(i + 60) + ")";
+            sql += i + 1 < end ? ", " : ";";
+        }
+        session.ctx.SetInput(sql);
+        session.ctx.GetNextToken();
+        asql::RunInsert(session);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    size_t max_threads = argc > 1 ? strtoul(argv[1], nullptr, 10) : 16;
+    size_t rows = argc > 2 ? strtoul(argv[2], nullptr, 10) : 2000;
+    std::string path = argc > 3 ? argv[3] : "insert_wal.db";
+    size_t batch = argc > 4 ? strtoul(argv[4], nullptr, 10) : 1;
+    if (!max_threads)
+        max_threads = 1;
+    if (!batch)
+        batch = 1;
+
+    printf("sync,threads,batch,rows,seconds,rows_per_sec,commits,syncs\n");
+    for (auto mode : {asql::SYNC_FULL, asql::SYNC_NORMAL, asql::SYNC_OFF}) {
+        for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+            unlink(path.c_str());
+            unlink((path + "-wal").c_str());
+
+            asql::TableData.clear();
+            asql::InitTables();
+            if (!asql::OpenDatabase(path, 16 << 20, mode))
+                return 1;
+
+            std::vector<std::thread> workers;
+            auto start = std::chrono::steady_clock::now();
+            for (size_t t = 0; t < threads; ++t)
+                workers.emplace_back(InsertLoop, t, rows, batch);
+            for (auto &w : workers)
+                w.join();
+            double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            auto wal = asql::GetWal();
+            size_t total = asql::GetTable("HOURS")->RowCount();
+            printf("%s,%zu,%zu,%zu,%.3f,%.0f,%zu,%zu\n", asql::SyncModeName(mode), threads, batch, total, secs,
+                   static_cast<double>(total) / secs, wal->commits.load(), wal->syncs.load());
+            asql::CloseDatabase();
+        }
+    }
+
+    unlink(path.c_str());
+    unlink((path + "-wal").c_str());
+    return 0;
+}
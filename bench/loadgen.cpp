@@ -0,0 +1,115 @@
+/*
+* Load generator for asql --serve. Every client is a thread with its own
+* connection sending the statement again as soon as the previous answer is
+* complete, one CSV row per client count with the queries per second and
+* latency percentiles over all clients.
+*
+* usage: loadgen [--socket path | --port N] [--clients 1,8,32] [--seconds S] [statement]
+*/
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "harness.h"
+#include "server.h"
+
+int main(int argc, char **argv)
+{
+    std::string socket_path = "asql.sock";
+    int port = 0;
+    std::string clients = "1,8";
+    double seconds = 2;
+    std::string sql = "SELECT name, weight_kg FROM employees WHERE emp_id = 1;";
+
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--socket") && i + 1 < argc)
+            socket_path = argv[++i];
+        else if (!strcmp(argv[i], "--port") && i + 1 < argc) {
+            port = atoi(argv[++i]);
+            socket_path.clear();
+        } else if (!strcmp(argv[i], "--clients") && i + 1 < argc)
+            clients = argv[++i];
+        else if (!strcmp(argv[i], "--seconds") && i + 1 < argc)
+            seconds = strtod(argv[++i], nullptr);
+        else
+            sql = argv[i];
+    }
+
+    bench::PrintHeader();
+    for (const char *p = clients.c_str(); *p; ) {
+        char *end;
+        size_t count = strtoull(p, &end, 10);
+        p = *end ? end + 1 : end;
+        if (!count)
+            continue;
+
+        std::vector<int> fds;
+        for (size_t c = 0; c < count; ++c) {
+            int fd = asql::ConnectServer(socket_path.c_str(), port);
+            if (fd < 0) {
+                fprintf(stderr, "Unable to connect to %s\n", socket_path.size() ? socket_path.c_str() : "the server");
+                return 1;
+            }
+            fds.push_back(fd);
+        }
+
+        using Clock = std::chrono::steady_clock;
+        std::mutex lock;
+        std::vector<double> samples;
+        std::atomic<bool> failed{false};
+        const auto start = Clock::now();
+        const auto deadline = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds));
+
+        std::vector<std::thread> threads;
+        for (int fd : fds) {
+            threads.emplace_back([&, fd] {
+                std::vector<double> local;
+                std::string payload;
+                asql::MessageType type;
+                while (Clock::now() < deadline && !failed) {
+                    const auto t = Clock::now();
+                    if (!asql::WriteFrame(fd, asql::MSG_QUERY, sql)) {
+                        failed = true;
+                        break;
+                    }
+                    do {
+                        if (!asql::ReadFrame(fd, type, payload)) {
+                            failed = true;
+                            break;
+                        }
+                    } while (type != asql::MSG_DONE);
+                    local.push_back(std::chrono::duration<double, std::micro>(Clock::now() - t).count());
+                }
+
+                std::lock_guard<std::mutex> guard{lock};
+                samples.insert(samples.end(), local.begin(), local.end());
+            });
+        }
+        for (auto &t : threads)
+            t.join();
+        const double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+        for (int fd : fds)
+            close(fd);
+
+        if (failed || samples.empty()) {
+            fprintf(stderr, "Connection to the server failed\n");
+            return 1;
+        }
+
+        std::sort(samples.begin(), samples.end());
+        printf("server,clients%zu,%zu,%.3f,%.0f,%.3f,%.3f,%.3f,%.3f\n", count, samples.size(), elapsed,
+               static_cast<double>(samples.size()) / elapsed, bench::Percentile(samples, 50), bench::Percentile(samples, 95),
+               bench::Percentile(samples, 99), samples.back());
+        fflush(stdout);
+    }
+    return 0;
+}
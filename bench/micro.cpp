@@ -0,0 +1,102 @@
+/*
+* Microbenchmarks of the statement pipeline, one op each:
+*   lex.*       GetToken() over a whole statement
+*   parse.*     ParseSelectQuery() of a statement
+*   validate.*  ParseSelectQuery() + Validate(), binding and compiling the program
+*   eval.*      one ROW_GROUP_SIZE batch of generated HOURS rows through a
+*               compiled program, and through the Expr tree for comparison
+*
+* usage: micro [seconds_per_benchmark]
+*/
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "datagen.h"
+#include "harness.h"
+#include "parser.h"
+#include "query.h"
+
+struct Statement {
+    const char *name;
+    const char *sql;
+};
+
+static const Statement Statements[] = {
+    {"point",     "SELECT name, weight_kg FROM employees WHERE emp_id = 42;"},
+    {"arith",     "SELECT name, weight_kg * 2.2 + 1, (emp_id + 1) * 2 / 3 FROM employees e WHERE e.weight_kg > 80.5 LIMIT 10;"},
+    {"aggregate", "SELECT emp_id, COUNT(*), SUM(time_end - time_start), MAX(time_end) FROM hours WHERE time_start >= 1000 "
+                  "GROUP BY emp_id ORDER BY 3 DESC LIMIT 5;"},
+    {"join",      "SELECT e.name, t.type, h.time_start FROM hours h JOIN employees e ON h.emp_id = e.emp_id "
+                  "JOIN employee_type t ON e.emp_type_id = t.emp_type_id WHERE h.time_start < 5000;"},
+};
+
+static std::unique_ptr<asql::SelectQuery> Parse(asql::ParserContext &ctx, const char *sql)
+{
+    ctx.SetInput(sql);
+    ctx.GetNextToken();
+    return asql::ParseSelectQuery(ctx);
+}
+
+int main(int argc, char **argv)
+{
+    double seconds = argc > 1 ? strtod(argv[1], nullptr) : 0.5;
+    asql::ParserContext ctx;
+
+    // Every statement has to make it through before anything is timed
+    for (const auto &st : Statements) {
+        auto query = Parse(ctx, st.sql);
+        if (!query || !query->Validate()) {
+            printf("Benchmark statement '%s' doesn't validate\n", st.name);
+            return 1;
+        }
+    }
+
+    bench::PrintHeader();
+    for (const auto &st : Statements) {
+        size_t tokens = 0;
+        bench::Run("micro", std::string("lex.") + st.name, seconds, [&] {
+            ctx.SetInput(st.sql);
+            while (ctx.GetNextToken() != asql::T_EOF)
+                tokens++;
+        });
+    }
+
+    for (const auto &st : Statements)
+        bench::Run("micro", std::string("parse.") + st.name, seconds, [&] { Parse(ctx, st.sql); });
+
+    for (const auto &st : Statements)
+        bench::Run("micro", std::string("validate.") + st.name, seconds, [&] { Parse(ctx, st.sql)->Validate(); });
+
+    // Expressions over one batch of generated rows
+    auto hours = bench::GenerateHours(0.1);
+    asql::Batch batch;
+    batch.count = std::min(hours.rows, asql::ROW_GROUP_SIZE);
+    batch.columns.resize(1);
+    for (const auto &col : hours.columns) {
+        batch.columns[0].emplace_back();
+        batch.columns[0].back().Reference(col);
+    }
+
+    const Statement exprs[] = {
+        {"column_arith", "SELECT (time_end - time_start) * 2 + 1 FROM hours;"},
+        {"mixed_arith",  "SELECT (time_end - time_start) / 60.0 + emp_id * 1.5 FROM hours;"},
+        {"filter",       "SELECT emp_id FROM hours WHERE time_end - time_start > 300 AND emp_id < 50;"},
+    };
+    for (const auto &e : exprs) {
+        auto query = Parse(ctx, e.sql);
+        if (!query || !query->Validate())
+            return 1;
+
+        std::vector<asql::Vector> regs;
+        std::vector<uint8_t> keep;
+        bench::Run("micro", std::string("eval.program.") + e.name, seconds, [&] { query->program.Run(batch, regs, keep); });
+
+        if (query->filters.empty()) {
+            asql::Vector out;
+            bench::Run("micro", std::string("eval.tree.") + e.name, seconds, [&] { query->columns[0]->EvalBatch(batch, out); });
+        }
+    }
+    return 0;
+}
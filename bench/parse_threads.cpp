@@ -0,0 +1,71 @@
+/*
+* Multithreaded parse throughput. Every thread owns a ParserContext and
+* parses + validates the same statement mix, reports statements/sec per
+* thread count so the scaling can be compared against the 1 thread run.
+*
+* usage: parse_threads [max_threads] [statements_per_thread]
+*/
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "parser.h"
+#include "query.h"
+
+static const char *Statements[] = {
+    "SELECT name, weight_kg * 2.2 + 1 FROM employees WHERE emp_id = 42;",
+    "SELECT e.name, e.emp_type_id AS type FROM employees e LIMIT 10;",
+    "SELECT emp_id, time_end - time_start FROM hours WHERE emp_id = 7;",
+    "SELECT t.type FROM employee_type t WHERE t.emp_type_id = 3;",
+    "SELECT (e.emp_id + 1) * 2 / 3 FROM employees e, employee_type t WHERE t.emp_type_id = 1;",
+};
+
+static void ParseLoop(size_t iterations, size_t *parsed)
+{
+    asql::ParserContext ctx;
+    size_t ok = 0;
+    for (size_t i = 0; i < iterations; ++i) {
+        const char *sql = Statements[i % (sizeof(Statements) / sizeof(Statements[0]))];
+        ctx.SetInput(sql);
+        ctx.GetNextToken();
+        auto query = asql::ParseSelectQuery(ctx);
+        if (query && query->Validate())
+            ok++;
+    }
+    *parsed = ok;
+}
+
+int main(int argc, char **argv)
+{
+    size_t max_threads = argc > 1 ? strtoul(argv[1], nullptr, 10) : std::thread::hardware_concurrency();
+    size_t iterations = argc > 2 ? strtoul(argv[2], nullptr, 10) : 200000;
+    if (!max_threads)
+        max_threads = 1;
+
+    double base = 0;
+    printf("threads,statements,seconds,statements_per_sec,speedup\n");
+    for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+        std::vector<std::thread> workers;
+        std::vector<size_t> parsed(threads);
+
+        auto start = std::chrono::steady_clock::now();
+        for (size_t t = 0; t < threads; ++t)
+            workers.emplace_back(ParseLoop, iterations, &parsed[t]);
+        for (auto &w : workers)
+            w.join();
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        size_t total = 0;
+        for (auto p : parsed)
+            total += p;
+
+        double rate = static_cast<double>(total) / secs;
+        if (threads == 1)
+            base = rate;
+        printf("%zu,%zu,%.3f,%.0f,%.2f\n", threads, total, secs, rate, rate / base);
+    }
+    return 0;
+}
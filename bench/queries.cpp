@@ -0,0 +1,95 @@
+/*
+* End-to-end queries against generated tables, one op is a whole statement
+* through the plan cache and the morsel scan. Each scale factor is its own
+* suite, so rows of two runs only compare at the same scale. Result rows
+* are discarded, only the CSV rows reach stdout.
+*
+* usage: queries [scale_factors, e.g. 1,10] [seconds_per_benchmark] [threads]
+*/
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "datagen.h"
+#include "harness.h"
+#include "lexer.h"
+#include "statement.h"
+#include "threadpool.h"
+
+struct Query {
+    const char *name;
+    const char *sql;
+};
+
+static const Query Queries[] = {
+    {"count",       "SELECT COUNT(*) FROM hours;"},
+    {"point",       "SELECT name, weight_kg FROM employees WHERE emp_id = 42;"},
+    {"time_window", "SELECT COUNT(*), SUM(time_end - time_start) FROM hours WHERE time_start >= 100000 AND time_start < 110000;"},
+    {"scan_filter", "SELECT SUM(time_end - time_start) FROM hours WHERE time_end - time_start > 400;"},
+    {"group_by",    "SELECT emp_id, COUNT(*), AVG(time_end - time_start) FROM hours GROUP BY emp_id;"},
+    {"group_by_str", "SELECT name, COUNT(*), MAX(weight_kg) FROM employees GROUP BY name;"},
+    {"top_k",       "SELECT emp_id, time_start FROM hours ORDER BY time_end - time_start DESC LIMIT 10;"},
+    {"join",        "SELECT t.type, COUNT(*) FROM hours h, employees e, employee_type t "
+                    "WHERE h.emp_id = e.emp_id AND e.emp_type_id = t.emp_type_id AND e.weight_kg > 100 GROUP BY t.type;"},
+};
+
+/* Point stdout at /dev/null while alive, the engine prints result rows straight to it */
+class DiscardOutput {
+public:
+    DiscardOutput()
+    {
+        fflush(stdout);
+        saved = dup(STDOUT_FILENO);
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        close(null);
+    }
+    ~DiscardOutput()
+    {
+        fflush(stdout);
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+    }
+
+private:
+    int saved;
+};
+
+int main(int argc, char **argv)
+{
+    std::string scales = argc > 1 ? argv[1] : "1";
+    double seconds = argc > 2 ? strtod(argv[2], nullptr) : 1;
+    asql::SetThreadCount(argc > 3 ? strtoull(argv[3], nullptr, 10) : 0);
+
+    bench::PrintHeader();
+    for (const char *p = scales.c_str(); *p; ) {
+        char *end;
+        double scale = strtod(p, &end);
+        p = *end ? end + 1 : end;
+
+        if (!bench::LoadData(scale))
+            return 1;
+        asql::QueryPlanCache.Clear();
+
+        std::string suite = "sf" + std::to_string(scale);
+        suite.erase(suite.find_last_not_of('0') + 1);
+        if (suite.back() == '.')
+            suite.pop_back();
+
+        asql::Session session;
+        for (const auto &q : Queries) {
+            bench::Run(suite, q.name, seconds, [&] {
+                DiscardOutput discard;
+                session.ctx.SetInput(q.sql);
+                session.ctx.GetNextToken();
+                asql::RunSelect(session);
+            });
+        }
+    }
+    return 0;
+}